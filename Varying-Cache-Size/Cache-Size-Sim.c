@@ -2,11 +2,38 @@
 // and simulates how a cache would behave.
 // It prints how many cache misses happen, and how many reads/writes go to memory.
 
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     // for MAP_ANONYMOUS
+#define _GNU_SOURCE         // for O_DIRECT, mremap and memfd_create
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <glob.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE           // linux/fs.h has one of its own
+#define HAVE_IO_URING
+#endif
 
 // Each block in the cache is 64 bytes.
 // This is fixed because the assignment said to assume 64B blocks.
@@ -16,6 +43,7 @@
 typedef struct {
     bool valid;                       // true if there is actually data stored here
     bool dirty;                       // true if the data was changed but not yet written to memory (only for write-back)
+    unsigned int rank;                // place in the set's replacement order, 0 = newest (only kept with track_state)
     unsigned long long tag;           // used to tell if the stored block matches the memory address
     unsigned long long lru_ts;        // keeps track of when this line was last used (for LRU)
     unsigned long long fifo_ts;       // keeps track of when this line was added (for FIFO)
@@ -27,6 +55,87 @@ typedef struct {
     line_t *ways;
 } set_t;
 
+// One block we are keeping an eye on in a "space-saving" top-K sketch.
+// count is an over-estimate of how often the block was seen; count - err is
+// a guaranteed lower bound. The other counters only cover the time the block
+// has been tracked, so they are lower bounds too.
+typedef struct {
+    unsigned long long block;       // block number (addr / BLOCK_SIZE)
+    unsigned long long count;       // estimated number of times the block was seen
+    unsigned long long err;         // how much of count may belong to blocks we kicked out
+    unsigned long long accesses;    // accesses while tracked
+    unsigned long long misses;      // misses while tracked
+    unsigned long long writebacks;  // dirty evictions while tracked
+} hot_entry_t;
+
+// A fixed-size space-saving sketch. It never uses more than k entries, no matter
+// how many different blocks the trace touches. When it is full, a new block
+// takes over the entry with the smallest count (found with a min-heap).
+typedef struct {
+    size_t k;                       // max number of blocks tracked
+    size_t used;                    // entries in use so far
+    hot_entry_t *entries;
+    size_t *heap;                   // entry indexes, smallest count on top
+    size_t *heap_pos;               // where each entry currently sits in heap
+    unsigned long long *slot_block; // small hash table: block -> entry index
+    size_t *slot_entry;             // SIZE_MAX means the slot is empty
+    size_t slot_mask;
+} topk_t;
+
+// The hot-block tracker: one sketch ranks blocks by accesses, one by misses.
+// Each sketch has HOT_COUNTERS counters for every block reported: with only
+// K counters for the top K, most of each count could belong to other blocks.
+#define HOT_COUNTERS 64
+typedef struct {
+    size_t k;                       // blocks reported from each sketch
+    topk_t by_access;
+    topk_t by_miss;
+} hot_t;
+
+// One event in the flight recorder (see recorder_t).
+enum { REC_HIT = 1, REC_EVICT = 2, REC_DIRTY = 4 };
+typedef struct {
+    unsigned long long idx;     // number of the (first) access in the run, from 0
+    unsigned long long addr;
+    unsigned long long evicted; // tag of the line pushed out (REC_EVICT), or the
+                                // writes among `count` hits counted at once
+    unsigned int set;
+    unsigned int way;           // UINT_MAX if nothing was filled (write-through write miss)
+    unsigned int count;         // accesses covered; more than 1 for hits counted at once
+    char op;
+    unsigned char flags;        // REC_HIT, REC_EVICT, REC_DIRTY (the evicted line was dirty)
+} rec_event_t;
+
+// The flight recorder: the last few thousand events of a cache, so a run with
+// surprising numbers can be looked at afterwards. The ring's size is a power
+// of two; an event goes to ring[next++ & mask], with no other branches.
+typedef struct {
+    rec_event_t *ring;
+    size_t mask;                // ring size - 1
+    unsigned long long next;    // events recorded so far
+    FILE *out;                  // where rec_dump writes
+} recorder_t;
+
+// When several programs share one cache, each line remembers which program
+// (source) brought it in. The source number lives in the top bits of the tag,
+// so blocks of different programs never match even at the same address, just
+// like separate address spaces.
+#define SRC_SHIFT 56
+#define TAG_MASK ((1ULL << SRC_SHIFT) - 1)
+#define MAX_SOURCES 64
+
+// Per-source counters for a shared cache.
+typedef struct {
+    unsigned long long accesses;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long mem_reads;        // memory traffic caused by this source's accesses
+    unsigned long long mem_writes;
+    unsigned long long writebacks;       // dirty lines of this source written back
+    unsigned long long evicted_by_other; // lines of this source pushed out by another source
+    unsigned long long lines;            // lines held right now (occupancy)
+} src_stats_t;
+
 // This struct represents the entire cache.
 typedef struct {
     size_t cache_size;      // total size of cache in bytes
@@ -42,8 +151,38 @@ typedef struct {
     unsigned long long misses;
     unsigned long long mem_reads;
     unsigned long long mem_writes;
+    unsigned long long writes;    // accesses that were writes (the rest are reads)
 
     unsigned long long global_ts; // increases each time we access the cache
+
+    hot_t *hot;             // optional hot-block tracker (NULL when turned off)
+    recorder_t *rec;        // optional flight recorder (NULL when turned off)
+
+    // Only used when several sources share the cache (see run_mix).
+    src_stats_t *src;       // one entry per source, or NULL
+    unsigned int cur_src;   // source of the access being simulated
+    unsigned long long tag_src; // cur_src << SRC_SHIFT, or'ed into every tag
+    unsigned long long *way_mask; // per source: ways it may fill (NULL = any way)
+
+    // Optional: called for every read or write this cache sends to memory,
+    // in order (e.g. to record the stream a lower level would see). Addresses
+    // are block aligned, since a lower level only cares which block it is.
+    void (*lower)(void *ctx, char op, unsigned long long addr);
+    void *lower_ctx;
+
+    // Optional, for an inclusive level of a hierarchy: called with every block
+    // this cache evicts, so the levels above drop it too. Returns true if one
+    // of them held it dirty; then the block is written back even if our own
+    // copy is clean.
+    bool (*inval)(void *ctx, unsigned long long addr);
+    void *inval_ctx;
+    line_t *leaving;        // the line evict_if_needed let go and fill_line hasn't replaced yet
+
+    // Optional: keep state_hash equal to cache_state_hash after every access,
+    // so two caches (or engines, or runs) can be compared at any point in O(1).
+    // See cache_track_state.
+    bool track_state;
+    unsigned long long state_hash;
 } cache_t;
 
 // Figure out which set a memory address belongs to.
@@ -58,59 +197,359 @@ static inline unsigned long long get_tag(unsigned long long addr, size_t num_set
     return block_number / num_sets;
 }
 
-// Make the cache with the right number of sets and lines
-static cache_t *cache_create(size_t cache_size, size_t assoc, int replacement, int writeback) {
-    cache_t *c = (cache_t*)calloc(1, sizeof(cache_t));
-    if (!c) return NULL;
+// Mix the bits of a block number so nearby blocks land in different hash slots.
+static inline unsigned long long hash_block(unsigned long long x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Set up a sketch that tracks at most k blocks. Returns false if out of memory.
+static bool topk_init(topk_t *t, size_t k) {
+    memset(t, 0, sizeof(*t));
+    t->k = k;
+    size_t slots = 1;
+    while (slots < 2 * k) slots <<= 1; // keep the hash table at most half full
+
+    t->entries = (hot_entry_t*)calloc(k, sizeof(hot_entry_t));
+    t->heap = (size_t*)calloc(k, sizeof(size_t));
+    t->heap_pos = (size_t*)calloc(k, sizeof(size_t));
+    t->slot_block = (unsigned long long*)calloc(slots, sizeof(unsigned long long));
+    t->slot_entry = (size_t*)malloc(slots * sizeof(size_t));
+    if (!t->entries || !t->heap || !t->heap_pos || !t->slot_block || !t->slot_entry) return false;
+
+    for (size_t i = 0; i < slots; ++i) t->slot_entry[i] = SIZE_MAX;
+    t->slot_mask = slots - 1;
+    return true;
+}
+
+static void topk_free(topk_t *t) {
+    free(t->entries);
+    free(t->heap);
+    free(t->heap_pos);
+    free(t->slot_block);
+    free(t->slot_entry);
+}
+
+// Find the entry tracking this block, or SIZE_MAX if it isn't tracked.
+static size_t topk_find(const topk_t *t, unsigned long long block) {
+    size_t i = hash_block(block) & t->slot_mask;
+    while (t->slot_entry[i] != SIZE_MAX) {
+        if (t->slot_block[i] == block) return t->slot_entry[i];
+        i = (i + 1) & t->slot_mask;
+    }
+    return SIZE_MAX;
+}
+
+static void topk_slot_insert(topk_t *t, unsigned long long block, size_t entry) {
+    size_t i = hash_block(block) & t->slot_mask;
+    while (t->slot_entry[i] != SIZE_MAX) i = (i + 1) & t->slot_mask;
+    t->slot_block[i] = block;
+    t->slot_entry[i] = entry;
+}
+
+// Remove a block from the hash table. Later entries in the same probe run are
+// shifted back so lookups never stop early at the hole we leave behind.
+static void topk_slot_remove(topk_t *t, unsigned long long block) {
+    size_t i = hash_block(block) & t->slot_mask;
+    while (t->slot_block[i] != block || t->slot_entry[i] == SIZE_MAX) i = (i + 1) & t->slot_mask;
+
+    size_t hole = i;
+    for (size_t j = (hole + 1) & t->slot_mask; t->slot_entry[j] != SIZE_MAX; j = (j + 1) & t->slot_mask) {
+        size_t home = hash_block(t->slot_block[j]) & t->slot_mask;
+        // move j into the hole unless its home slot lies between the hole and j
+        bool stays = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (!stays) {
+            t->slot_block[hole] = t->slot_block[j];
+            t->slot_entry[hole] = t->slot_entry[j];
+            hole = j;
+        }
+    }
+    t->slot_entry[hole] = SIZE_MAX;
+}
+
+static void topk_heap_swap(topk_t *t, size_t a, size_t b) {
+    size_t ea = t->heap[a], eb = t->heap[b];
+    t->heap[a] = eb; t->heap_pos[eb] = a;
+    t->heap[b] = ea; t->heap_pos[ea] = b;
+}
+
+// An entry's count only ever goes up, so it can only need to sink in the min-heap.
+static void topk_heap_sink(topk_t *t, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < t->used && t->entries[t->heap[l]].count < t->entries[t->heap[m]].count) m = l;
+        if (r < t->used && t->entries[t->heap[r]].count < t->entries[t->heap[m]].count) m = r;
+        if (m == i) return;
+        topk_heap_swap(t, i, m);
+        i = m;
+    }
+}
+
+static void topk_heap_rise(topk_t *t, size_t i) {
+    while (i > 0) {
+        size_t p = (i - 1) / 2;
+        if (t->entries[t->heap[p]].count <= t->entries[t->heap[i]].count) return;
+        topk_heap_swap(t, i, p);
+        i = p;
+    }
+}
+
+// Count `weight` more sightings of a block (space-saving update).
+// Returns the entry that now tracks it.
+static hot_entry_t *topk_add(topk_t *t, unsigned long long block, unsigned long long weight) {
+    size_t e = topk_find(t, block);
+    if (e == SIZE_MAX) {
+        if (t->used < t->k) {
+            // still room: start a fresh entry
+            e = t->used++;
+            memset(&t->entries[e], 0, sizeof(hot_entry_t));
+            t->heap[e] = e;
+            t->heap_pos[e] = e;
+            topk_heap_rise(t, e);
+        } else {
+            // full: the least counted block gives up its entry, and the
+            // newcomer inherits its count as possible error
+            e = t->heap[0];
+            hot_entry_t *old = &t->entries[e];
+            topk_slot_remove(t, old->block);
+            unsigned long long min = old->count;
+            memset(old, 0, sizeof(hot_entry_t));
+            old->count = min;
+            old->err = min;
+        }
+        t->entries[e].block = block;
+        topk_slot_insert(t, block, e);
+    }
+    t->entries[e].count += weight;
+    topk_heap_sink(t, t->heap_pos[e]);
+    return &t->entries[e];
+}
+
+// Look up a block without counting it. Returns NULL if not tracked.
+static inline hot_entry_t *topk_get(topk_t *t, unsigned long long block) {
+    size_t e = topk_find(t, block);
+    return (e == SIZE_MAX) ? NULL : &t->entries[e];
+}
+
+static hot_t *hot_create(size_t k) {
+    if (k > SIZE_MAX / (4 * HOT_COUNTERS * sizeof(hot_entry_t))) return NULL;
+    hot_t *h = (hot_t*)calloc(1, sizeof(hot_t));
+    if (!h) return NULL;
+    h->k = k;
+    if (!topk_init(&h->by_access, k * HOT_COUNTERS) || !topk_init(&h->by_miss, k * HOT_COUNTERS)) {
+        topk_free(&h->by_access);
+        topk_free(&h->by_miss);
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+static void hot_destroy(hot_t *h) {
+    if (!h) return;
+    topk_free(&h->by_access);
+    topk_free(&h->by_miss);
+    free(h);
+}
 
+// Called for every access (n > 1 when several accesses are counted at once).
+static void hot_on_access(hot_t *h, unsigned long long block, unsigned long long n) {
+    topk_add(&h->by_access, block, n)->accesses += n;
+    hot_entry_t *m = topk_get(&h->by_miss, block);
+    if (m) m->accesses += n;
+}
+
+static void hot_on_miss(hot_t *h, unsigned long long block) {
+    topk_add(&h->by_miss, block, 1)->misses++;
+    hot_entry_t *a = topk_get(&h->by_access, block);
+    if (a) a->misses++;
+}
+
+static void hot_on_writeback(hot_t *h, unsigned long long block) {
+    hot_entry_t *a = topk_get(&h->by_access, block);
+    if (a) a->writebacks++;
+    hot_entry_t *m = topk_get(&h->by_miss, block);
+    if (m) m->writebacks++;
+}
+
+// Make a recorder holding at least `events` events (rounded up to a power of
+// two). It dumps to `out`, and closes it when destroyed unless it's stderr.
+static recorder_t *rec_create(size_t events, FILE *out) {
+    size_t size = 1;
+    while (size < events) size <<= 1;
+    recorder_t *rec = (recorder_t*)calloc(1, sizeof(recorder_t));
+    if (!rec) return NULL;
+    rec->ring = (rec_event_t*)calloc(size, sizeof(rec_event_t));
+    if (!rec->ring) {
+        free(rec);
+        return NULL;
+    }
+    rec->mask = size - 1;
+    rec->out = out;
+    return rec;
+}
+
+static void rec_destroy(recorder_t *rec) {
+    if (!rec) return;
+    if (rec->out != stderr) fclose(rec->out);
+    free(rec->ring);
+    free(rec);
+}
+
+static inline void rec_log(recorder_t *rec, unsigned long long idx, char op, unsigned long long addr,
+                           size_t set, size_t way, unsigned int count, unsigned int flags,
+                           unsigned long long evicted) {
+    rec_event_t *e = &rec->ring[rec->next++ & rec->mask];
+    e->idx = idx;
+    e->addr = addr;
+    e->evicted = evicted;
+    e->set = (unsigned int)set;
+    e->way = (unsigned int)way;
+    e->count = count;
+    e->op = op;
+    e->flags = (unsigned char)flags;
+}
+
+// Sort helper: biggest guaranteed count (count - err) first, then biggest
+// estimate, then lowest block number for ties.
+static int hot_entry_cmp(const void *pa, const void *pb) {
+    const hot_entry_t *a = (const hot_entry_t*)pa, *b = (const hot_entry_t*)pb;
+    unsigned long long ga = a->count - a->err, gb = b->count - b->err;
+    if (ga != gb) return (ga < gb) ? 1 : -1;
+    if (a->count != b->count) return (a->count < b->count) ? 1 : -1;
+    return (a->block > b->block) - (a->block < b->block);
+}
+
+// Print the k surest blocks of one sketch as a ranked table.
+static void topk_print(FILE *out, const topk_t *t, size_t k, const char *what, unsigned long long total) {
+    hot_entry_t *sorted = (hot_entry_t*)malloc((t->used ? t->used : 1) * sizeof(hot_entry_t));
+    if (!sorted) return;
+    memcpy(sorted, t->entries, t->used * sizeof(hot_entry_t));
+    qsort(sorted, t->used, sizeof(hot_entry_t), hot_entry_cmp);
+
+    // Any block not in the sketch was seen at most as often as its smallest
+    // counter, so a row whose guaranteed count isn't above that could be
+    // beaten by a block we don't even track; those rows are marked with '?'.
+    // The accesses/misses/writebacks columns only count while the block was
+    // tracked.
+    unsigned long long smallest = t->used == t->k ? t->entries[t->heap[0]].count : 0;
+    size_t rows = t->used < k ? t->used : k;
+    bool unsure = false;
+    fprintf(out, "Hot blocks by %s (top %zu of %llu, from %zu counters)\n", what, k, total, t->k);
+    fprintf(out, "%-5s %-18s %12s %12s %12s %12s %12s %12s\n", "rank", "block_addr", "estimate", "max_error",
+            "guaranteed", "accesses", "misses", "writebacks");
+    for (size_t i = 0; i < rows; ++i) {
+        const hot_entry_t *e = &sorted[i];
+        bool sure = e->count - e->err > smallest;
+        unsure = unsure || !sure;
+        fprintf(out, "%-5zu 0x%-16llx %12llu %12llu %12llu %12llu %12llu %12llu%s\n", i + 1,
+                e->block * BLOCK_SIZE, e->count, e->err, e->count - e->err, e->accesses, e->misses,
+                e->writebacks, sure ? "" : " ?");
+    }
+    if (unsure) fprintf(out, "? = guaranteed count not above the smallest counter (%llu)\n", smallest);
+    free(sorted);
+}
+
+// Set up a cache in memory the caller already has (e.g. one of an array of
+// caches, see lockstep_t). Returns false if the configuration is invalid or
+// we ran out of memory; then there's nothing to clean up.
+static bool cache_init(cache_t *c, size_t cache_size, size_t assoc, int replacement, int writeback) {
+    memset(c, 0, sizeof(*c));
     c->cache_size = cache_size;
     c->assoc = assoc;
     c->replacement = replacement;
     c->writeback = writeback;
 
-    if (assoc == 0) { free(c); return NULL; }
+    if (assoc == 0) return false;
 
     size_t lines = cache_size / BLOCK_SIZE;
     if (lines == 0 || lines % assoc != 0) {
         // this checks that the cache divides evenly into sets
-        free(c);
-        return NULL;
+        return false;
     }
 
     c->num_sets = lines / assoc;
 
     // make space for all the sets
     c->sets = (set_t*)calloc(c->num_sets, sizeof(set_t));
-    if (!c->sets) { free(c); return NULL; }
+    if (!c->sets) return false;
 
     for (size_t s = 0; s < c->num_sets; ++s) {
         c->sets[s].ways = (line_t*)calloc(assoc, sizeof(line_t));
         if (!c->sets[s].ways) {
             for (size_t k = 0; k < s; ++k) free(c->sets[k].ways);
             free(c->sets);
-            free(c);
-            return NULL;
+            c->sets = NULL;
+            return false;
         }
     }
+    return true;
+}
+
+// Make a cache on the heap (see cache_init). Returns NULL if it can't be built.
+static cache_t *cache_create(size_t cache_size, size_t assoc, int replacement, int writeback) {
+    cache_t *c = (cache_t*)malloc(sizeof(cache_t));
+    if (!c) return NULL;
+    if (!cache_init(c, cache_size, assoc, replacement, writeback)) {
+        free(c);
+        return NULL;
+    }
     return c;
 }
 
-// Clean up memory when we’re done
-static void cache_destroy(cache_t *c) {
-    if (!c) return;
+// Free what cache_init set up (but not the cache_t itself).
+static void cache_fini(cache_t *c) {
     if (c->sets) {
         for (size_t s = 0; s < c->num_sets; ++s)
             free(c->sets[s].ways);
         free(c->sets);
     }
+    hot_destroy(c->hot);
+    rec_destroy(c->rec);
+    free(c->src);
+    free(c->way_mask);
+}
+
+// Clean up memory when we’re done with a cache from cache_create.
+static void cache_destroy(cache_t *c) {
+    if (!c) return;
+    cache_fini(c);
     free(c);
 }
 
+// Same as select_victim, but only ways whose bit is set in `mask` may be picked
+// (way partitioning: a source can hit anywhere but only fills its own ways).
+static size_t select_victim_masked(cache_t *c, size_t set_idx, unsigned long long mask) {
+    set_t *set = &c->sets[set_idx];
+
+    for (size_t w = 0; w < c->assoc; ++w) {
+        if (((mask >> w) & 1) && !set->ways[w].valid) return w;
+    }
+
+    size_t victim = 0;
+    unsigned long long best = ULLONG_MAX;
+    for (size_t w = 0; w < c->assoc; ++w) {
+        if (!((mask >> w) & 1)) continue;
+        unsigned long long ts = (c->replacement == 0) ? set->ways[w].lru_ts : set->ways[w].fifo_ts;
+        if (ts < best) {
+            best = ts;
+            victim = w;
+        }
+    }
+    return victim;
+}
+
 // Choose which line to replace when the cache is full.
 // If there’s an empty one, use it. Otherwise pick one based on the rule (LRU or FIFO).
 static size_t select_victim(cache_t *c, size_t set_idx) {
     set_t *set = &c->sets[set_idx];
 
+    if (c->way_mask) return select_victim_masked(c, set_idx, c->way_mask[c->cur_src]);
+
     // look for an empty spot first
     for (size_t w = 0; w < c->assoc; ++w) {
         if (!set->ways[w].valid) return w;
@@ -138,17 +577,70 @@ static size_t select_victim(cache_t *c, size_t set_idx) {
     return victim;
 }
 
+// One line's share of the state hash: its set, its place in the set's
+// replacement order (0 = most recently used, or filled for FIFO), its tag and
+// whether it's dirty.
+static inline unsigned long long state_line_hash(size_t set_idx, size_t rank, unsigned long long tag, bool dirty) {
+    return hash_block(hash_block(tag) ^ ((unsigned long long)set_idx << 21 | (unsigned long long)rank << 1 | dirty));
+}
+
+static inline unsigned long long line_state_hash(size_t set_idx, const line_t *ln) {
+    return state_line_hash(set_idx, ln->rank, ln->tag, ln->dirty);
+}
+
+// For track_state: a line becomes the newest of its set. The lines that were
+// newer than it (rank below old_rank) move back one place. old_rank is
+// c->assoc for a line that wasn't in the set before.
+static void state_promote(cache_t *c, size_t set_idx, size_t way_idx, size_t old_rank) {
+    line_t *ways = c->sets[set_idx].ways;
+    for (size_t w = 0; w < c->assoc; ++w) {
+        line_t *ln = &ways[w];
+        if (w == way_idx || !ln->valid || ln->rank >= old_rank) continue;
+        c->state_hash -= line_state_hash(set_idx, ln);
+        ln->rank++;
+        c->state_hash += line_state_hash(set_idx, ln);
+    }
+    ways[way_idx].rank = 0;
+}
+
 // When we hit something that’s already in the cache, update its timestamp (for LRU).
 static void update_on_hit(cache_t *c, size_t set_idx, size_t way_idx) {
     line_t *ln = &c->sets[set_idx].ways[way_idx];
     if (c->replacement == 0) {
         ln->lru_ts = ++c->global_ts;
+        if (c->track_state && ln->rank != 0) {
+            c->state_hash -= line_state_hash(set_idx, ln);
+            state_promote(c, set_idx, way_idx, ln->rank);
+            c->state_hash += line_state_hash(set_idx, ln);
+        }
+    }
+}
+
+// A write-back write hit: the line now differs from memory.
+static inline void mark_dirty(cache_t *c, size_t set_idx, line_t *ln) {
+    if (c->track_state && !ln->dirty) {
+        c->state_hash -= line_state_hash(set_idx, ln);
+        ln->dirty = true;
+        c->state_hash += line_state_hash(set_idx, ln);
     }
+    ln->dirty = true;
 }
 
 // Store a new block into the cache after we choose where it goes.
 static void fill_line(cache_t *c, size_t set_idx, size_t way_idx, unsigned long long tag, bool make_dirty) {
     line_t *ln = &c->sets[set_idx].ways[way_idx];
+    if (c->src) {
+        // keep track of who holds how many lines, and who pushed out whom
+        if (ln->valid) {
+            unsigned int old = (unsigned int)(ln->tag >> SRC_SHIFT);
+            c->src[old].lines--;
+            if (old != c->cur_src) c->src[old].evicted_by_other++;
+        }
+        c->src[c->cur_src].lines++;
+    }
+    // (evict_if_needed has already taken the old line out of state_hash)
+    size_t old_rank = ln->valid ? ln->rank : c->assoc;
+    c->leaving = NULL;
     ln->valid = true;
     ln->tag = tag;
     ln->dirty = make_dirty;
@@ -156,36 +648,67 @@ static void fill_line(cache_t *c, size_t set_idx, size_t way_idx, unsigned long
     unsigned long long now = ++c->global_ts;
     ln->lru_ts = now;
     ln->fifo_ts = now;
+
+    if (c->track_state) {
+        state_promote(c, set_idx, way_idx, old_rank);
+        c->state_hash += line_state_hash(set_idx, ln);
+    }
 }
 
 // If the line we’re removing was dirty (changed), we need to write it back to memory.
 static void evict_if_needed(cache_t *c, size_t set_idx, size_t way_idx) {
     line_t *ln = &c->sets[set_idx].ways[way_idx];
-    if (ln->valid && c->writeback == 1 && ln->dirty) {
+    c->leaving = ln;
+    if (!ln->valid) return;
+    if (c->track_state) c->state_hash -= line_state_hash(set_idx, ln);
+    bool dirty = c->writeback == 1 && ln->dirty;
+    if (c->inval) {
+        // inclusive: the levels above give the block up first, and a dirty
+        // copy of theirs goes out with ours
+        unsigned long long block = (ln->tag & TAG_MASK) * c->num_sets + set_idx;
+        if (c->inval(c->inval_ctx, block * BLOCK_SIZE)) dirty = true;
+    }
+    if (dirty) {
         c->mem_writes++;
+        unsigned long long block = (ln->tag & TAG_MASK) * c->num_sets + set_idx;
+        if (c->src) c->src[ln->tag >> SRC_SHIFT].writebacks++;
+        if (c->hot) hot_on_writeback(c->hot, block);
+        if (c->lower) c->lower(c->lower_ctx, 'W', block * BLOCK_SIZE);
     }
 }
 
-// This runs for each read or write in the trace file.
-static void cache_access(cache_t *c, char op, unsigned long long addr) {
-    unsigned long long tag = get_tag(addr, c->num_sets);
-    size_t set_idx = get_set_index(addr, c->num_sets);
+// Record a miss that fills `way` (SIZE_MAX: no fill), before the old line goes.
+static inline void rec_miss(cache_t *c, char op, unsigned long long addr, size_t set_idx, size_t way) {
+    const line_t *ln = &c->sets[set_idx].ways[way == SIZE_MAX ? 0 : way];
+    bool evict = way != SIZE_MAX && ln->valid;
+    rec_log(c->rec, c->hits + c->misses - 1, op, addr, set_idx, way == SIZE_MAX ? UINT_MAX : way, 1,
+            evict * REC_EVICT | (evict && ln->dirty) * REC_DIRTY, ln->tag);
+}
+
+// Apply one access whose set and tag (including tag_src) are already known.
+static inline void cache_access_at(cache_t *c, char op, unsigned long long addr,
+                                   size_t set_idx, unsigned long long tag) {
     set_t *set = &c->sets[set_idx];
 
+    c->writes += (op == 'W' || op == 'w');
+    if (c->hot) hot_on_access(c->hot, addr / BLOCK_SIZE, 1);
+
     // check if it’s already in the cache (a hit)
     for (size_t w = 0; w < c->assoc; ++w) {
         if (set->ways[w].valid && set->ways[w].tag == tag) {
             c->hits++;
+            if (c->rec) rec_log(c->rec, c->hits + c->misses - 1, op, addr, set_idx, w, 1, REC_HIT, 0);
             update_on_hit(c, set_idx, w);
 
             // handle writes
             if (op == 'W' || op == 'w') {
                 if (c->writeback == 1) {
                     // for write-back, mark dirty and don’t write right now
-                    set->ways[w].dirty = true;
+                    mark_dirty(c, set_idx, &set->ways[w]);
                 } else {
                     // for write-through, write to memory right away
                     c->mem_writes++;
+                    if (c->lower) c->lower(c->lower_ctx, 'W', addr / BLOCK_SIZE * BLOCK_SIZE);
                 }
             }
             return;
@@ -194,77 +717,6204 @@ static void cache_access(cache_t *c, char op, unsigned long long addr) {
 
     // if we didn’t find it, that’s a miss
     c->misses++;
+    if (c->hot) hot_on_miss(c->hot, addr / BLOCK_SIZE);
 
-    if (op == 'R' || op == 'r') {
-        // read miss means we bring the block from memory into the cache
+    if (op == 'R' || op == 'r' || op == 'I' || op == 'i') {
+        // read miss (or instruction fetch miss) means we bring the block from
+        // memory into the cache
         size_t victim = select_victim(c, set_idx);
+        if (c->rec) rec_miss(c, op, addr, set_idx, victim);
         evict_if_needed(c, set_idx, victim);
         c->mem_reads++;
+        if (c->lower) c->lower(c->lower_ctx, 'R', addr / BLOCK_SIZE * BLOCK_SIZE);
         fill_line(c, set_idx, victim, tag, false);
     } else { // write miss
         if (c->writeback == 1) {
             // write-back: bring it in (write-allocate), then mark dirty
             size_t victim = select_victim(c, set_idx);
+            if (c->rec) rec_miss(c, op, addr, set_idx, victim);
             evict_if_needed(c, set_idx, victim);
             c->mem_reads++;
+            if (c->lower) c->lower(c->lower_ctx, 'R', addr / BLOCK_SIZE * BLOCK_SIZE);
             fill_line(c, set_idx, victim, tag, true);
         } else {
             // write-through: don’t bring it in (no-write-allocate), just write directly
+            if (c->rec) rec_miss(c, op, addr, set_idx, SIZE_MAX);
             c->mem_writes++;
+            if (c->lower) c->lower(c->lower_ctx, 'W', addr / BLOCK_SIZE * BLOCK_SIZE);
         }
     }
 }
 
-int main(int argc, char **argv) {
-    // check that the arguments are correct
-    if (argc != 6) {
-        fprintf(stderr, "Usage: %s <CACHE_SIZE> <ASSOC> <REPLACEMENT> <WB> <TRACE_FILE>\n", argv[0]);
-        return 1;
+// This runs for each read or write in the trace file.
+static void cache_access(cache_t *c, char op, unsigned long long addr) {
+    cache_access_at(c, op, addr, get_set_index(addr, c->num_sets), get_tag(addr, c->num_sets) | c->tag_src);
+}
+
+// Empty the whole cache, writing dirty lines back first (what an OS has to do
+// on a context switch without address-space tags). Returns the lines dropped.
+static unsigned long long cache_flush(cache_t *c) {
+    unsigned long long flushed = 0;
+    for (size_t s = 0; s < c->num_sets; ++s) {
+        for (size_t w = 0; w < c->assoc; ++w) {
+            line_t *ln = &c->sets[s].ways[w];
+            if (!ln->valid) continue;
+            evict_if_needed(c, s, w);
+            if (c->src) c->src[ln->tag >> SRC_SHIFT].lines--;
+            ln->valid = false;
+            ln->dirty = false;
+            flushed++;
+        }
     }
+    return flushed;
+}
 
-    unsigned long long cache_size = strtoull(argv[1], NULL, 10);
-    unsigned long long assoc      = strtoull(argv[2], NULL, 10);
-    int replacement               = atoi(argv[3]); // 0 = LRU, 1 = FIFO
-    int writeback                 = atoi(argv[4]); // 0 = write-through, 1 = write-back
-    const char *trace_path        = argv[5];
+typedef struct {
+    unsigned long long ts;
+    size_t way;
+} way_age_t;
 
-    // make sure we got valid numbers
-    if (cache_size == 0 || assoc == 0) {
-        fprintf(stderr, "Invalid cache size or associativity.\n");
-        return 1;
+// Sort helper: newest first.
+static int way_age_cmp(const void *pa, const void *pb) {
+    const way_age_t *a = (const way_age_t*)pa, *b = (const way_age_t*)pb;
+    return (a->ts < b->ts) - (a->ts > b->ts);
+}
+
+// The valid lines of set s, newest first in the replacement order. order[]
+// needs room for c->assoc entries. Returns how many there are.
+static size_t set_order(const cache_t *c, size_t s, way_age_t *order) {
+    const line_t *ways = c->sets[s].ways;
+    size_t n = 0;
+    for (size_t w = 0; w < c->assoc; ++w) {
+        if (!ways[w].valid) continue;
+        order[n].ts = (c->replacement == 0) ? ways[w].lru_ts : ways[w].fifo_ts;
+        order[n].way = w;
+        n++;
     }
+    qsort(order, n, sizeof(way_age_t), way_age_cmp);
+    return n;
+}
 
-    cache_t *cache = cache_create((size_t)cache_size, (size_t)assoc, replacement, writeback);
-    if (!cache) {
-        fprintf(stderr, "Could not set up cache.\n");
-        return 1;
+// Hash of everything in the cache that the engines have to agree on: every
+// valid line's set, tag, dirty bit and place in the replacement order. Which
+// way a line sits in and the raw timestamps are left out, since engines may
+// differ there and still behave the same from then on. This walks the whole
+// cache; with track_state the same value is in c->state_hash all along.
+static unsigned long long cache_state_hash(const cache_t *c) {
+    way_age_t *order = (way_age_t*)malloc(c->assoc * sizeof(way_age_t));
+    if (!order) return 0;
+    unsigned long long h = 0;
+    for (size_t s = 0; s < c->num_sets; ++s) {
+        size_t n = set_order(c, s, order);
+        for (size_t k = 0; k < n; ++k) {
+            const line_t *ln = &c->sets[s].ways[order[k].way];
+            h += state_line_hash(s, k, ln->tag, ln->dirty);
+        }
     }
+    free(order);
+    return h;
+}
 
-    // open the trace file
-    FILE *fp = fopen(trace_path, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: could not open the trace file: %s\n", trace_path);
-        cache_destroy(cache);
-        return 1;
+// Start keeping c->state_hash up to date. Each line's rank is worked out once
+// here; after that fill_line, update_on_hit, evict_if_needed and mark_dirty
+// only touch the lines that change, so an LRU hit on the newest line or a
+// FIFO hit costs nothing extra. Works on a cache that is already in use.
+// Returns false if we ran out of memory.
+static bool cache_track_state(cache_t *c) {
+    way_age_t *order = (way_age_t*)malloc(c->assoc * sizeof(way_age_t));
+    if (!order) return false;
+    c->state_hash = 0;
+    for (size_t s = 0; s < c->num_sets; ++s) {
+        size_t n = set_order(c, s, order);
+        for (size_t k = 0; k < n; ++k) {
+            line_t *ln = &c->sets[s].ways[order[k].way];
+            ln->rank = (unsigned int)k;
+            c->state_hash += line_state_hash(s, ln);
+        }
     }
+    free(order);
+    c->track_state = true;
+    return true;
+}
 
-    char op;
-    unsigned long long addr;
-    // read one line at a time: operation (R or W) and address
-    while (fscanf(fp, " %c %llx", &op, &addr) == 2) {
-        cache_access(cache, op, addr);
+// A run of back-to-back accesses to the same block. Everything after the first
+// access of a run is a hit on the most recently used line, so the whole run can
+// be applied with one lookup (see cache_access_run).
+typedef struct {
+    unsigned long long addr;    // address of the first access
+    char first_op;              // op of the first access
+    unsigned int count;         // accesses in the run
+    unsigned int lead;          // accesses at the start that are not reads
+    unsigned int writes;        // writes among accesses 2..count
+    unsigned int tail_writes;   // writes after the first read of the run
+} block_run_t;
+
+// Collapse n accesses into runs of the same block. runs[] needs room for n entries.
+static size_t rle_collapse(const unsigned long long *addrs, const char *ops, size_t n, block_run_t *runs) {
+    size_t nruns = 0;
+    size_t i = 0;
+    while (i < n) {
+        unsigned long long block = addrs[i] / BLOCK_SIZE;
+        block_run_t *r = &runs[nruns++];
+        r->addr = addrs[i];
+        r->first_op = ops[i];
+        r->count = 0;
+        r->lead = 0;
+        r->writes = 0;
+        r->tail_writes = 0;
+        bool seen_read = false;
+        for (; i < n && addrs[i] / BLOCK_SIZE == block; ++i) {
+            bool is_read = (ops[i] == 'R' || ops[i] == 'r' || ops[i] == 'I' || ops[i] == 'i');
+            bool is_write = (ops[i] == 'W' || ops[i] == 'w');
+            if (!seen_read && !is_read) r->lead++;
+            if (r->count > 0 && is_write) {
+                r->writes++;
+                if (seen_read) r->tail_writes++;
+            }
+            if (is_read) seen_read = true;
+            r->count++;
+        }
     }
-    fclose(fp);
+    return nruns;
+}
 
-    // figure out the miss ratio (misses divided by total accesses)
-    unsigned long long total = cache->hits + cache->misses;
-    double miss_ratio = (total > 0) ? (double)cache->misses / (double)total : 0.0;
+// Apply n hits with `writes` writes to a line that is already the most recently
+// used one in its set. Gives the same result as n calls to cache_access.
+static void cache_bulk_hits(cache_t *c, size_t set_idx, size_t way, unsigned long long addr,
+                            unsigned long long n, unsigned long long writes) {
+    if (n == 0) return;
+    line_t *ln = &c->sets[set_idx].ways[way];
+    c->hits += n;
+    c->writes += writes;
+    if (c->rec) rec_log(c->rec, c->hits + c->misses - n, writes ? 'W' : 'R', addr, set_idx, way,
+                        n > UINT_MAX ? UINT_MAX : (unsigned int)n, REC_HIT, writes);
+    if (c->replacement == 0) {
+        c->global_ts += n;
+        ln->lru_ts = c->global_ts;
+    }
+    if (writes > 0) {
+        if (c->writeback == 1) {
+            mark_dirty(c, set_idx, ln);
+        } else {
+            c->mem_writes += writes;
+            if (c->lower) {
+                unsigned long long block_addr = addr / BLOCK_SIZE * BLOCK_SIZE;
+                for (unsigned long long k = 0; k < writes; ++k) c->lower(c->lower_ctx, 'W', block_addr);
+            }
+        }
+    }
+    if (c->hot) hot_on_access(c->hot, addr / BLOCK_SIZE, n);
+}
 
-    // print the results
-    printf("Miss ratio %f\n", miss_ratio);
-    printf("write %llu\n", cache->mem_writes);
-    printf("read %llu\n", cache->mem_reads);
+// Look for a block in its set. Returns the way, or SIZE_MAX if it isn't cached.
+static size_t cache_find(const cache_t *c, size_t set_idx, unsigned long long tag) {
+    const set_t *set = &c->sets[set_idx];
+    for (size_t w = 0; w < c->assoc; ++w) {
+        if (set->ways[w].valid && set->ways[w].tag == tag) return w;
+    }
+    return SIZE_MAX;
+}
 
-    cache_destroy(cache);
-    return 0;
+// Drop one block without writing it back (a back-invalidation from an
+// inclusive level below, which writes it back itself). Returns false if the
+// block wasn't cached; *dirty tells whether our copy was dirty. The line this
+// cache is in the middle of replacing has already been dealt with, so it
+// counts as gone.
+static bool cache_invalidate(cache_t *c, unsigned long long addr, bool *dirty) {
+    size_t set_idx = get_set_index(addr, c->num_sets);
+    size_t way = cache_find(c, set_idx, get_tag(addr, c->num_sets) | c->tag_src);
+    *dirty = false;
+    if (way == SIZE_MAX) return false;
+    line_t *ways = c->sets[set_idx].ways;
+    line_t *ln = &ways[way];
+    if (ln == c->leaving) return false;
+    if (c->track_state) {
+        // the lines that were older than it move up one place
+        c->state_hash -= line_state_hash(set_idx, ln);
+        for (size_t w = 0; w < c->assoc; ++w) {
+            if (!ways[w].valid || ways[w].rank <= ln->rank) continue;
+            c->state_hash -= line_state_hash(set_idx, &ways[w]);
+            ways[w].rank--;
+            c->state_hash += line_state_hash(set_idx, &ways[w]);
+        }
+    }
+    *dirty = ln->dirty;
+    ln->valid = false;
+    ln->dirty = false;
+    return true;
+}
+
+// Apply a whole run whose set and tag (including tag_src) are already known:
+// the first access goes through cache_access_at as usual, the rest are
+// counted as hits in one go.
+static void cache_access_run_at(cache_t *c, const block_run_t *r, size_t set_idx, unsigned long long tag) {
+    cache_access_at(c, r->first_op, r->addr, set_idx, tag);
+    if (r->count == 1) return;
+
+    size_t way = cache_find(c, set_idx, tag);
+    if (way != SIZE_MAX) {
+        cache_bulk_hits(c, set_idx, way, r->addr, r->count - 1, r->writes);
+        return;
+    }
+
+    // The block was not brought in: a write-through write miss doesn't allocate.
+    // The rest of the leading writes (and other non-read ops, which miss the
+    // same way but aren't counted as writes) miss too, then the first read
+    // brings the block in and everything after it hits.
+    unsigned int lead_writes = r->writes - r->tail_writes;
+    for (unsigned int k = 1; k < r->lead; ++k)
+        cache_access_at(c, k <= lead_writes ? 'W' : 'X', r->addr, set_idx, tag);
+    if (r->lead == r->count) return;
+    cache_access_at(c, 'R', r->addr, set_idx, tag);
+    way = cache_find(c, set_idx, tag);
+    cache_bulk_hits(c, set_idx, way, r->addr, r->count - r->lead - 1, r->tail_writes);
+}
+
+static void cache_access_run(cache_t *c, const block_run_t *r) {
+    cache_access_run_at(c, r, get_set_index(r->addr, c->num_sets), get_tag(r->addr, c->num_sets) | c->tag_src);
+}
+
+// Print what the flight recorder holds, oldest first. `why` says what asked
+// for it (the end of the run, or SIGUSR1).
+static void rec_dump(const cache_t *c, const char *why) {
+    const recorder_t *rec = c->rec;
+    FILE *out = rec->out;
+    unsigned long long size = rec->mask + 1;
+    unsigned long long first = rec->next > size ? rec->next - size : 0;
+    fprintf(out, "Flight recorder (%s): last %llu of %llu events, cache %zu %zu %d %d\n", why,
+            rec->next - first, rec->next, c->cache_size, c->assoc, c->replacement, c->writeback);
+    fprintf(out, "%-12s %-2s %-18s %8s %6s %-10s %s\n", "access", "op", "addr", "set", "way", "result",
+            "evicted");
+    for (unsigned long long i = first; i < rec->next; ++i) {
+        const rec_event_t *e = &rec->ring[i & rec->mask];
+        char way[16], result[24];
+        if (e->way == UINT_MAX) snprintf(way, sizeof(way), "-");
+        else snprintf(way, sizeof(way), "%u", e->way);
+        if (!(e->flags & REC_HIT)) snprintf(result, sizeof(result), "miss");
+        else if (e->count > 1) snprintf(result, sizeof(result), "hit x%u", e->count);
+        else snprintf(result, sizeof(result), "hit");
+        fprintf(out, "%-12llu %-2c 0x%-16llx %8u %6s ", e->idx, e->op, e->addr, e->set, way);
+        if (e->flags & REC_EVICT) {
+            fprintf(out, "%-10s 0x%llx%s\n", result,
+                    ((e->evicted & TAG_MASK) * c->num_sets + e->set) * BLOCK_SIZE,
+                    (e->flags & REC_DIRTY) ? " (dirty)" : "");
+        } else if (e->count > 1 && e->evicted > 0) {
+            fprintf(out, "%s (%llu of them writes)\n", result, e->evicted);
+        } else {
+            fprintf(out, "%s\n", result);
+        }
+    }
+    fflush(out);
+}
+
+// Set by SIGUSR1: dump the flight recorder at the next chance.
+static volatile sig_atomic_t rec_wanted = 0;
+
+static void rec_on_signal(int sig) {
+    (void)sig;
+    rec_wanted = 1;
+}
+
+// Called between chunks of the trace: dump if SIGUSR1 came in meanwhile.
+static inline void rec_poll(const cache_t *c) {
+    if (c->rec && rec_wanted) {
+        rec_wanted = 0;
+        rec_dump(c, "SIGUSR1");
+    }
+}
+
+// The trace is handled in chunks of this many accesses. It is also the size of
+// one block in the compressed trace store.
+#define TRACE_CHUNK 65536
+
+// Deltas inside a store block are packed in groups of this many, each group
+// with its own minimum and bit width ("frame of reference" packing).
+#define PACK_GROUP 128
+
+// One packed group of address deltas.
+typedef struct {
+    unsigned long long min;     // smallest zigzag delta in the group
+    unsigned int word;          // where the group's bits start in the block's words[]
+    unsigned char width;        // bits used per delta after subtracting min
+} pack_group_t;
+
+// One block of up to TRACE_CHUNK accesses, compressed.
+typedef struct {
+    size_t n;                   // accesses in this block
+    unsigned long long first;   // first address, stored as is
+    pack_group_t *groups;       // (n - 1) deltas, PACK_GROUP at a time
+    unsigned long long *words;  // the packed delta bits
+    unsigned long long *op_bits;// one bit per access: bit 0 of its op_code (1 = write)
+    unsigned long long *op_hi;  // bit 1 of each op_code, or NULL if every op is R or W
+} store_block_t;
+
+// The whole trace kept in memory in compressed form, so it can be replayed as
+// many times as we like without going back to the disk.
+typedef struct {
+    store_block_t *blocks;
+    size_t nblocks, cap;
+    unsigned long long records;  // total accesses stored
+    size_t bytes;                // memory used by the compressed data
+
+    // accesses waiting to be packed into the next block
+    unsigned long long *stage_addr;
+    char *stage_op;
+    size_t staged;
+} trace_store_t;
+
+// How the store and binary traces keep an op: 0 = read, 1 = write,
+// 2 = instruction fetch, 3 = anything else. cache_access treats any other
+// letter like a write on a miss and like a read on a hit, so those are kept
+// apart (and come back as 'X') instead of being folded into R or W.
+static inline unsigned op_code(char op) {
+    if (op == 'R' || op == 'r') return 0;
+    if (op == 'W' || op == 'w') return 1;
+    if (op == 'I' || op == 'i') return 2;
+    return 3;
+}
+
+static const char OP_CHARS[4] = { 'R', 'W', 'I', 'X' };
+
+static inline unsigned long long zigzag(long long v) {
+    return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static inline long long unzigzag(unsigned long long v) {
+    return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static trace_store_t *store_create(void) {
+    trace_store_t *st = (trace_store_t*)calloc(1, sizeof(trace_store_t));
+    if (!st) return NULL;
+    st->stage_addr = (unsigned long long*)malloc(TRACE_CHUNK * sizeof(unsigned long long));
+    st->stage_op = (char*)malloc(TRACE_CHUNK);
+    if (!st->stage_addr || !st->stage_op) {
+        free(st->stage_addr);
+        free(st->stage_op);
+        free(st);
+        return NULL;
+    }
+    return st;
+}
+
+static void store_destroy(trace_store_t *st) {
+    if (!st) return;
+    for (size_t b = 0; b < st->nblocks; ++b) {
+        free(st->blocks[b].groups);
+        free(st->blocks[b].words);
+        free(st->blocks[b].op_bits);
+        free(st->blocks[b].op_hi);
+    }
+    free(st->blocks);
+    free(st->stage_addr);
+    free(st->stage_op);
+    free(st);
+}
+
+// Number of bits needed to hold v (0 for v == 0).
+static inline unsigned bit_width(unsigned long long v) {
+    return v ? 64 - (unsigned)__builtin_clzll(v) : 0;
+}
+
+// Pack the staged accesses into a new block.
+static bool store_seal(trace_store_t *st) {
+    size_t n = st->staged;
+    if (n == 0) return true;
+    if (st->nblocks == st->cap) {
+        size_t cap = st->cap ? st->cap * 2 : 64;
+        store_block_t *nb = (store_block_t*)realloc(st->blocks, cap * sizeof(store_block_t));
+        if (!nb) return false;
+        st->blocks = nb;
+        st->cap = cap;
+    }
+
+    store_block_t *b = &st->blocks[st->nblocks];
+    memset(b, 0, sizeof(*b));
+    b->n = n;
+    b->first = st->stage_addr[0];
+
+    // turn addresses into zigzag deltas in place (the stage is refilled anyway)
+    unsigned long long *d = st->stage_addr;
+    for (size_t i = n - 1; i > 0; --i)
+        d[i] = zigzag((long long)(d[i] - d[i - 1]));
+
+    size_t ndeltas = n - 1;
+    size_t ngroups = (ndeltas + PACK_GROUP - 1) / PACK_GROUP;
+    b->groups = (pack_group_t*)calloc(ngroups ? ngroups : 1, sizeof(pack_group_t));
+    b->op_bits = (unsigned long long*)calloc((n + 63) / 64, sizeof(unsigned long long));
+    if (!b->groups || !b->op_bits) goto fail;
+
+    // first pass: pick the frame (min and width) for each group
+    size_t total_words = 0;
+    for (size_t g = 0; g < ngroups; ++g) {
+        size_t lo = 1 + g * PACK_GROUP, hi = lo + PACK_GROUP;
+        if (hi > n) hi = n;
+        unsigned long long mn = ULLONG_MAX, mx = 0;
+        for (size_t i = lo; i < hi; ++i) {
+            if (d[i] < mn) mn = d[i];
+            if (d[i] > mx) mx = d[i];
+        }
+        b->groups[g].min = mn;
+        b->groups[g].width = (unsigned char)bit_width(mx - mn);
+        b->groups[g].word = (unsigned int)total_words;
+        total_words += ((hi - lo) * b->groups[g].width + 63) / 64;
+    }
+
+    // second pass: write the bits
+    b->words = (unsigned long long*)calloc(total_words + 1, sizeof(unsigned long long));
+    if (!b->words) goto fail;
+    for (size_t g = 0; g < ngroups; ++g) {
+        size_t lo = 1 + g * PACK_GROUP, hi = lo + PACK_GROUP;
+        if (hi > n) hi = n;
+        unsigned w = b->groups[g].width;
+        unsigned long long *out = b->words + b->groups[g].word;
+        if (w == 0) continue;
+        for (size_t i = lo; i < hi; ++i) {
+            unsigned long long v = d[i] - b->groups[g].min;
+            size_t bit = (i - lo) * w;
+            out[bit / 64] |= v << (bit % 64);
+            if (bit % 64 + w > 64) out[bit / 64 + 1] |= v >> (64 - bit % 64);
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        unsigned code = op_code(st->stage_op[i]);
+        if (code & 1) b->op_bits[i / 64] |= 1ULL << (i % 64);
+        if (code < 2) continue;
+        // the second bit is only kept for blocks with an op other than R or W
+        if (!b->op_hi) {
+            b->op_hi = (unsigned long long*)calloc((n + 63) / 64, sizeof(unsigned long long));
+            if (!b->op_hi) goto fail;
+            st->bytes += (n + 63) / 64 * sizeof(unsigned long long);
+        }
+        b->op_hi[i / 64] |= 1ULL << (i % 64);
+    }
+
+    st->bytes += sizeof(store_block_t) + ngroups * sizeof(pack_group_t)
+               + (total_words + 1) * sizeof(unsigned long long)
+               + (n + 63) / 64 * sizeof(unsigned long long);
+    st->records += n;
+    st->nblocks++;
+    st->staged = 0;
+    return true;
+
+fail:
+    free(b->groups);
+    free(b->op_bits);
+    free(b->op_hi);
+    free(b->words);
+    return false;
+}
+
+// Add one access to the end of the store.
+static inline bool store_append(trace_store_t *st, char op, unsigned long long addr) {
+    st->stage_addr[st->staged] = addr;
+    st->stage_op[st->staged] = op;
+    if (++st->staged == TRACE_CHUNK) return store_seal(st);
+    return true;
+}
+
+// Unpack one group of deltas. Written as a plain fixed-trip loop with no
+// branches inside so the compiler can vectorize the bit extraction.
+static inline void unpack_group(const unsigned long long *in, unsigned w, unsigned long long min,
+                                unsigned long long *out, size_t count) {
+    if (w == 0) {
+        for (size_t i = 0; i < count; ++i) out[i] = min;
+        return;
+    }
+    unsigned long long mask = (w == 64) ? ULLONG_MAX : ((1ULL << w) - 1);
+    for (size_t i = 0; i < count; ++i) {
+        size_t bit = i * w;
+        size_t word = bit / 64;
+        unsigned shift = (unsigned)(bit % 64);
+        // bits from the next word; they fall outside the mask unless the value
+        // straddles two words (the double shift keeps shift == 0 well defined)
+        unsigned long long hi = in[word + 1] << (63 - shift) << 1;
+        out[i] = (((in[word] >> shift) | hi) & mask) + min;
+    }
+}
+
+// Decode block b back into addresses and ops (see OP_CHARS). Returns the number of accesses.
+static size_t store_decode(const trace_store_t *st, size_t b_idx, unsigned long long *addrs, char *ops) {
+    const store_block_t *b = &st->blocks[b_idx];
+    size_t n = b->n;
+    size_t ndeltas = n - 1;
+
+    // unpack all zigzag deltas into addrs[1..], then prefix-sum them
+    for (size_t g = 0, lo = 1; lo < n; ++g, lo += PACK_GROUP) {
+        size_t count = ndeltas - (lo - 1) < PACK_GROUP ? ndeltas - (lo - 1) : PACK_GROUP;
+        unpack_group(b->words + b->groups[g].word, b->groups[g].width, b->groups[g].min, addrs + lo, count);
+    }
+    addrs[0] = b->first;
+    for (size_t i = 1; i < n; ++i)
+        addrs[i] = addrs[i - 1] + (unsigned long long)unzigzag(addrs[i]);
+
+    for (size_t i = 0; i < n; ++i)
+        ops[i] = ((b->op_bits[i / 64] >> (i % 64)) & 1) ? 'W' : 'R';
+    if (b->op_hi) {
+        for (size_t i = 0; i < n; ++i)
+            if ((b->op_hi[i / 64] >> (i % 64)) & 1) ops[i] = OP_CHARS[2 | (ops[i] == 'W')];
+    }
+    return n;
+}
+
+// ---- Binary traces ----
+//
+// A binary trace starts with a small header and then holds one record per
+// "stride run": `count` accesses with the same op at base, base + stride,
+// base + 2*stride, ... A lone access is just a run of one. Each record is
+//   1 byte   : op in bits 0-1 (0 = R, 1 = W, 2 = I, 3 = other), bit 2 set if count > 1
+//   varint   : zigzag(base - previous record's last address)
+//   varint   : zigzag(stride)   (only if count > 1)
+//   varint   : count            (only if count > 1)
+// All header fields are little-endian 32-bit numbers. Version 2 adds the
+// configuration of the cache a filtered trace came out of (see --filter).
+
+// The first byte can't start a text trace, so we can tell the formats apart
+// by peeking at one character (which also works on pipes).
+static const unsigned char BT_MAGIC[8] = { 0x89, 'C', 'S', 'T', 'R', 'A', 'C', 'E' };
+#define BT_VERSION 2
+#define BT_HEADER_V1 (sizeof(BT_MAGIC) + 3 * 4)
+#define BT_HEADER_V2 (BT_HEADER_V1 + 5 * 4)
+
+// Runs shorter than this are written as separate accesses; a two-access run
+// isn't any smaller than two single records.
+#define BT_MIN_RUN 3
+
+typedef struct {
+    unsigned int version;
+    unsigned int header_bytes;  // total header size, so newer fields can be skipped
+    unsigned int block_size;
+
+    // If the trace is the miss and write-back stream of a cache, its settings.
+    // filter_size == 0 means the trace is not filtered.
+    unsigned long long filter_size;
+    unsigned int filter_assoc;
+    unsigned int filter_repl;
+    unsigned int filter_wb;
+} bt_header_t;
+
+// `count` accesses with the same op and a fixed distance between addresses.
+typedef struct {
+    unsigned long long base;
+    long long stride;
+    unsigned long long count;
+    char op;
+} stride_run_t;
+
+static void put_u32(FILE *fp, unsigned int v) {
+    for (int i = 0; i < 4; ++i) fputc((int)((v >> (8 * i)) & 0xff), fp);
+}
+
+static bool get_u32(FILE *fp, unsigned int *v) {
+    *v = 0;
+    for (int i = 0; i < 4; ++i) {
+        int ch = getc(fp);
+        if (ch == EOF) return false;
+        *v |= (unsigned int)ch << (8 * i);
+    }
+    return true;
+}
+
+static size_t put_varint(FILE *fp, unsigned long long v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        fputc((int)((v & 0x7f) | 0x80), fp);
+        v >>= 7;
+        n++;
+    }
+    fputc((int)v, fp);
+    return n;
+}
+
+static bool get_varint(FILE *fp, unsigned long long *v) {
+    *v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int ch = getc(fp);
+        if (ch == EOF) return false;
+        *v |= (unsigned long long)(ch & 0x7f) << shift;
+        if (!(ch & 0x80)) return true;
+    }
+    return false;
+}
+
+// Writes a binary trace, finding stride runs as accesses come in.
+typedef struct {
+    FILE *fp;
+    unsigned long long prev;    // last address of the previous record
+    stride_run_t pending;       // run being grown (count == 0 means none)
+    unsigned long long accesses;
+    unsigned long long records;
+    unsigned long long bytes;
+} bt_writer_t;
+
+// Start a binary trace in fp, which bt_writer_close closes. filter may be
+// NULL for an unfiltered trace.
+static void bt_writer_start(bt_writer_t *w, FILE *fp, const bt_header_t *filter) {
+    memset(w, 0, sizeof(*w));
+    w->fp = fp;
+    fwrite(BT_MAGIC, 1, sizeof(BT_MAGIC), w->fp);
+    put_u32(w->fp, BT_VERSION);
+    put_u32(w->fp, (unsigned int)BT_HEADER_V2);
+    put_u32(w->fp, (unsigned int)BLOCK_SIZE);
+    unsigned long long fsize = filter ? filter->filter_size : 0;
+    put_u32(w->fp, (unsigned int)(fsize & 0xffffffffULL));
+    put_u32(w->fp, (unsigned int)(fsize >> 32));
+    put_u32(w->fp, filter ? filter->filter_assoc : 0);
+    put_u32(w->fp, filter ? filter->filter_repl : 0);
+    put_u32(w->fp, filter ? filter->filter_wb : 0);
+    w->bytes = BT_HEADER_V2;
+}
+
+// Create a binary trace file. filter may be NULL for an unfiltered trace.
+static bool bt_writer_open(bt_writer_t *w, const char *path, const bt_header_t *filter) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return false;
+    bt_writer_start(w, fp, filter);
+    return true;
+}
+
+static void bt_emit(bt_writer_t *w, unsigned long long base, long long stride, unsigned long long count, char op) {
+    unsigned char tag = (unsigned char)op_code(op);
+    if (count > 1) tag |= 4;
+    fputc(tag, w->fp);
+    w->bytes += 1 + put_varint(w->fp, zigzag((long long)(base - w->prev)));
+    if (count > 1) {
+        w->bytes += put_varint(w->fp, zigzag(stride));
+        w->bytes += put_varint(w->fp, count);
+    }
+    w->prev = base + (unsigned long long)stride * (count - 1);
+    w->records++;
+}
+
+// Write out the pending run (or its accesses one by one if it is too short).
+static void bt_flush(bt_writer_t *w) {
+    stride_run_t *p = &w->pending;
+    if (p->count >= BT_MIN_RUN) {
+        bt_emit(w, p->base, p->stride, p->count, p->op);
+    } else {
+        for (unsigned long long k = 0; k < p->count; ++k)
+            bt_emit(w, p->base + (unsigned long long)p->stride * k, 0, 1, p->op);
+    }
+    p->count = 0;
+}
+
+static void bt_write(bt_writer_t *w, char op, unsigned long long addr) {
+    stride_run_t *p = &w->pending;
+    char o = OP_CHARS[op_code(op)];
+    w->accesses++;
+
+    if (p->count >= 2 && o == p->op && addr == p->base + (unsigned long long)p->stride * p->count) {
+        p->count++;
+        return;
+    }
+    if (p->count == 2) {
+        // two accesses aren't a run yet: write out the first one and let the
+        // second one try to pair up with this access instead
+        bt_emit(w, p->base, 0, 1, p->op);
+        p->base += (unsigned long long)p->stride;
+        p->count = 1;
+    }
+    if (p->count == 1 && o == p->op) {
+        p->stride = (long long)(addr - p->base);
+        p->count = 2;
+        return;
+    }
+    bt_flush(w);
+    p->base = addr;
+    p->stride = 0;
+    p->op = o;
+    p->count = 1;
+}
+
+static bool bt_writer_close(bt_writer_t *w) {
+    bt_flush(w);
+    bool ok = !ferror(w->fp);
+    if (fclose(w->fp) != 0) ok = false;
+    w->fp = NULL;
+    return ok;
+}
+
+// Read the next record. Returns false at the end of the trace.
+static bool bt_read(FILE *fp, unsigned long long *prev, stride_run_t *run) {
+    int tag = getc(fp);
+    if (tag == EOF) return false;
+    unsigned long long delta, stride = 0, count = 1;
+    if (!get_varint(fp, &delta)) return false;
+    if (tag & 4) {
+        if (!get_varint(fp, &stride) || !get_varint(fp, &count)) return false;
+    }
+    run->op = OP_CHARS[tag & 3];
+    run->base = *prev + (unsigned long long)unzigzag(delta);
+    run->stride = unzigzag(stride);
+    run->count = count;
+    *prev = run->base + (unsigned long long)run->stride * (count - 1);
+    return true;
+}
+
+// ---- Reading text trace files ----
+//
+// By default a text trace is read line by line through stdio. With --io=uring
+// a trace that is a regular file is read with io_uring instead: several large
+// reads are kept in flight so the disk stays busy while we parse, and the
+// finished buffers are handed to the parser in file order. With --direct the
+// reads bypass the page cache (O_DIRECT), which is why buffers, offsets and
+// sizes are all aligned. If io_uring isn't there (an old kernel, or blocked in
+// a container), or with --io=mmap, the file is mapped into memory instead,
+// telling the kernel we read it front to back. The io_uring calls are made
+// with syscall(), so no extra library is needed.
+
+enum { IO_URING, IO_MMAP, IO_STDIO };
+
+#define IO_DEPTH 4                  // reads in flight
+#define IO_CHUNK (1u << 20)         // bytes per read
+#define IO_ALIGN 4096u              // what O_DIRECT wants buffers, offsets and sizes aligned to
+
+// How trace files are read (set in main).
+static int io_mode = IO_STDIO;
+static bool io_direct = false;
+static bool io_stats = false;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#ifdef HAVE_IO_URING
+
+// The submission and completion rings we share with the kernel.
+typedef struct {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+static void uring_free(uring_t *u) {
+    if (u->sqes) munmap(u->sqes, u->sqes_len);
+    if (u->cq_ptr && u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_len);
+    if (u->sq_ptr) munmap(u->sq_ptr, u->sq_len);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+static void *uring_map(const uring_t *u, size_t len, off_t what) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, what);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Set up a ring with room for `entries` requests. Returns false if the kernel
+// doesn't let us use io_uring.
+static bool uring_init(uring_t *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return false;
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+    u->sq_ptr = uring_map(u, u->sq_len, IORING_OFF_SQ_RING);
+    u->cq_ptr = single ? u->sq_ptr : uring_map(u, u->cq_len, IORING_OFF_CQ_RING);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)uring_map(u, u->sqes_len, IORING_OFF_SQES);
+    if (!u->sq_ptr || !u->cq_ptr || !u->sqes) {
+        uring_free(u);
+        return false;
+    }
+
+    char *sq = (char*)u->sq_ptr, *cq = (char*)u->cq_ptr;
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return true;
+}
+
+// Start reading into iov at offset off of file fd. `tag` comes back with the result.
+static bool uring_read(uring_t *u, int fd, const struct iovec *iov, unsigned long long off,
+                       unsigned long long tag) {
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = off;
+    sqe->user_data = tag;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) == 1;
+}
+
+// Wait for the next finished read. Returns false if waiting failed.
+static bool uring_wait(uring_t *u, unsigned long long *tag, int *res) {
+    for (;;) {
+        unsigned head = *u->cq_head;
+        if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            *tag = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) return false;
+    }
+}
+
+// One of the reads kept in flight.
+typedef struct {
+    unsigned char *buf;         // IO_CHUNK bytes, aligned
+    struct iovec iov;
+    unsigned long long off;     // where in the file it starts
+    size_t len;                 // bytes of the file it covers (0 = past the end)
+    size_t got;                 // bytes read so far
+    bool busy;                  // waiting on the kernel
+} io_slot_t;
+
+// A file read front to back with IO_DEPTH reads in flight. The slots are
+// started in a circle, so slot `cur` always holds the next bytes of the file.
+typedef struct {
+    uring_t ring;
+    int fd;
+    unsigned long long size;    // of the file
+    unsigned long long next;    // offset the next read starts at
+    io_slot_t slots[IO_DEPTH];
+    size_t cur;                 // slot handed out next
+    size_t used;                // bytes of it handed out already
+    double wait;                // seconds spent waiting for the disk
+} io_stream_t;
+
+static bool io_slot_submit(io_stream_t *s, size_t k) {
+    io_slot_t *sl = &s->slots[k];
+    // after a short read, start again at the last aligned offset (O_DIRECT
+    // can't read from anywhere else; the bytes read twice are the same)
+    sl->got = sl->got / IO_ALIGN * IO_ALIGN;
+    // ask for whole aligned blocks, but never past the buffer; the kernel
+    // stops at the end of the file
+    size_t want = (sl->len - sl->got + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+    if (want > IO_CHUNK - sl->got) want = IO_CHUNK - sl->got;
+    sl->iov.iov_base = sl->buf + sl->got;
+    sl->iov.iov_len = want;
+    sl->busy = uring_read(&s->ring, s->fd, &sl->iov, sl->off + sl->got, k);
+    return sl->busy;
+}
+
+// Start reading the next IO_CHUNK of the file into slot k.
+static bool io_slot_start(io_stream_t *s, size_t k) {
+    io_slot_t *sl = &s->slots[k];
+    sl->off = s->next;
+    sl->got = 0;
+    sl->len = s->next < s->size ? (size_t)(s->size - s->next < IO_CHUNK ? s->size - s->next : IO_CHUNK) : 0;
+    sl->busy = false;
+    if (sl->len == 0) return true;
+    s->next += sl->len;
+    return io_slot_submit(s, k);
+}
+
+static void io_stream_close(io_stream_t *s) {
+    if (s->ring.sq_ptr) uring_free(&s->ring);
+    for (size_t k = 0; k < IO_DEPTH; ++k) free(s->slots[k].buf);
+    if (s->fd >= 0) close(s->fd);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+// Start reading file fd (from the beginning). Returns false if io_uring can't
+// be used, so the caller can read the file another way.
+static bool io_stream_open(io_stream_t *s, int fd, unsigned long long size, bool direct) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    if (!uring_init(&s->ring, IO_DEPTH)) return false;
+    s->size = size;
+    s->fd = dup(fd);
+    bool ok = s->fd >= 0;
+    if (ok && direct) {
+        int fl = fcntl(s->fd, F_GETFL);
+        if (fl < 0 || fcntl(s->fd, F_SETFL, fl | O_DIRECT) != 0)
+            fprintf(stderr, "note: this file can't be read with O_DIRECT; using the page cache\n");
+    }
+    for (size_t k = 0; ok && k < IO_DEPTH; ++k) {
+        void *buf = NULL;
+        ok = posix_memalign(&buf, IO_ALIGN, IO_CHUNK) == 0;
+        s->slots[k].buf = (unsigned char*)buf;
+    }
+    for (size_t k = 0; ok && k < IO_DEPTH; ++k) ok = io_slot_start(s, k);
+    if (!ok) io_stream_close(s);
+    return ok;
+}
+
+// Copy the next (up to) n bytes of the file to dst. Returns how many, 0 at the
+// end of the file, or -1 if a read failed.
+static long long io_stream_read(io_stream_t *s, char *dst, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        io_slot_t *sl = &s->slots[s->cur];
+        if (sl->len == 0) break;
+        double t0 = now_seconds();
+        while (sl->busy) {
+            unsigned long long k;
+            int res;
+            if (!uring_wait(&s->ring, &k, &res) || k >= IO_DEPTH) return -1;
+            io_slot_t *d = &s->slots[k];
+            d->busy = false;
+            if (res == -EINTR || res == -EAGAIN) res = 0;
+            else if (res < 0) return -1;
+            else if (res == 0) d->len = d->got;     // the file got shorter
+            d->got += (size_t)res;
+            if (d->got > d->len) d->got = d->len;   // read the padding past the end
+            if (d->got < d->len && !io_slot_submit(s, (size_t)k)) return -1;
+        }
+        s->wait += now_seconds() - t0;
+
+        size_t take = sl->len - s->used;
+        if (take > n - done) take = n - done;
+        memcpy(dst + done, sl->buf + s->used, take);
+        done += take;
+        s->used += take;
+        if (s->used == sl->len) {
+            // this slot is used up: start the read after the ones in flight
+            s->used = 0;
+            if (!io_slot_start(s, s->cur)) return -1;
+            s->cur = (s->cur + 1) % IO_DEPTH;
+        }
+    }
+    return (long long)done;
+}
+
+#else
+
+// Without io_uring headers, files are always mapped instead.
+typedef struct { int fd; double wait; } io_stream_t;
+static bool io_stream_open(io_stream_t *s, int fd, unsigned long long size, bool direct) {
+    (void)s; (void)fd; (void)size; (void)direct;
+    return false;
+}
+static long long io_stream_read(io_stream_t *s, char *dst, size_t n) {
+    (void)s; (void)dst; (void)n;
+    return -1;
+}
+static void io_stream_close(io_stream_t *s) { (void)s; }
+
+#endif
+
+// ---- Parallel text parsing ----
+//
+// Text traces are parsed a window at a time. Each window ends on a newline
+// and is split into newline-aligned pieces that threads parse at the same
+// time, each into its own arrays, which are then handed out in order. Pieces
+// are cut into lines the way fgets(line, 256) would, so the simulator sees
+// exactly the accesses the line-by-line reader does (including stopping at
+// the first line that isn't an access). Pipes such as stdin keep using the
+// fgets loop.
+
+#define TEXT_WINDOW (8u << 20)     // bytes each thread parses per window
+#define TEXT_MIN_PIECE (1u << 20)  // don't bother with threads for less than this
+#define TEXT_LINE 256
+
+// Threads used to parse one text trace (set in main).
+static size_t text_threads = 1;
+
+typedef struct {
+    const char *begin, *end;    // the piece of the file, ending on a newline
+    unsigned long long *addrs;
+    char *ops;
+    unsigned long long *ts;
+    bool *has_ts;
+    size_t n, cap;
+    bool stop;                  // hit a line that isn't an access
+    bool ok;                    // false if we ran out of memory
+} text_piece_t;
+
+typedef struct {
+    char *data;                 // bytes of the file we have (all of it when mapped)
+    size_t len, room;           // bytes in data, and room for
+    size_t pos;                 // first byte of data not parsed yet
+    bool eof;                   // data holds the rest of the file
+    bool mapped;
+    io_stream_t *io;            // where more bytes come from (NULL when mapped)
+    text_piece_t *pieces;       // the window being handed out
+    size_t npieces, cap;
+    size_t cur, cur_i;          // next access to hand out: pieces[cur], index cur_i
+    size_t threads;
+    unsigned long long bytes;   // parsed so far, for --io-stats
+    double start;
+} text_par_t;
+
+static bool text_piece_grow(text_piece_t *pc) {
+    size_t cap = pc->cap ? 2 * pc->cap : 4096;
+    unsigned long long *a = (unsigned long long*)realloc(pc->addrs, cap * sizeof(unsigned long long));
+    if (a) pc->addrs = a;
+    char *o = (char*)realloc(pc->ops, cap);
+    if (o) pc->ops = o;
+    unsigned long long *t = (unsigned long long*)realloc(pc->ts, cap * sizeof(unsigned long long));
+    if (t) pc->ts = t;
+    bool *h = (bool*)realloc(pc->has_ts, cap * sizeof(bool));
+    if (h) pc->has_ts = h;
+    if (!a || !o || !t || !h) return false;
+    pc->cap = cap;
+    return true;
+}
+
+static int parse_trace_line(const char *p, char *op, unsigned long long *addr,
+                            unsigned long long *ts, bool *has_ts);
+
+static void *text_piece_parse(void *arg) {
+    text_piece_t *pc = (text_piece_t*)arg;
+    char line[TEXT_LINE];
+    const char *p = pc->begin;
+    pc->n = 0;
+    pc->stop = false;
+    pc->ok = true;
+    while (p < pc->end && !pc->stop) {
+        // what fgets would hand back: up to 255 bytes, through the newline
+        size_t len = 0;
+        while (len < TEXT_LINE - 1 && p + len < pc->end) {
+            if (p[len++] == '\n') break;
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p += len;
+
+        if (pc->n == pc->cap && !text_piece_grow(pc)) {
+            pc->ok = false;
+            return NULL;
+        }
+        int got = parse_trace_line(line, &pc->ops[pc->n], &pc->addrs[pc->n], &pc->ts[pc->n], &pc->has_ts[pc->n]);
+        if (got < 0) pc->stop = true;
+        if (got > 0) pc->n++;
+    }
+    return NULL;
+}
+
+// Start of the line after the one `p` is in (or `end`).
+static const char *next_line(const char *p, const char *end) {
+    const char *nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+    return nl ? nl + 1 : end;
+}
+
+// Just past the last newline in [begin, end), or NULL if there isn't one.
+static const char *last_line_end(const char *begin, const char *end) {
+    for (const char *p = end; p > begin; --p) {
+        if (p[-1] == '\n') return p;
+    }
+    return NULL;
+}
+
+// Read more of the file until `want` bytes past pos are in data (or the file
+// ends). Returns false if a read fails or we run out of memory.
+static bool text_par_fill(text_par_t *tp, size_t want) {
+    if (tp->eof) return true;
+    // what's left of the last window moves to the front
+    memmove(tp->data, tp->data + tp->pos, tp->len - tp->pos);
+    tp->len -= tp->pos;
+    tp->pos = 0;
+    if (want > tp->room) {
+        char *d = (char*)realloc(tp->data, want);
+        if (!d) {
+            fprintf(stderr, "Out of memory while reading the trace; stopping early.\n");
+            return false;
+        }
+        tp->data = d;
+        tp->room = want;
+    }
+    while (!tp->eof && tp->len < want) {
+        long long got = io_stream_read(tp->io, tp->data + tp->len, tp->room - tp->len);
+        if (got < 0) {
+            fprintf(stderr, "Error reading the trace; stopping early.\n");
+            return false;
+        }
+        if (got == 0) tp->eof = true;
+        tp->len += (size_t)got;
+    }
+    return true;
+}
+
+// Parse the next window of the file. Returns false (after saying why) if we
+// couldn't.
+static bool text_par_window(text_par_t *tp) {
+    size_t want = TEXT_WINDOW * tp->threads;
+    const char *start, *end;
+    for (;;) {
+        if (!text_par_fill(tp, want)) return false;
+        start = tp->data + tp->pos;
+        const char *have = tp->data + tp->len;
+        if (tp->eof && (size_t)(have - start) <= want) {
+            end = have;
+            break;
+        }
+        // stop after the last whole line that fits, or after the first line if
+        // it doesn't fit on its own
+        const char *limit = (size_t)(have - start) < want ? have : start + want;
+        end = last_line_end(start, limit);
+        if (!end && limit < have) end = last_line_end(limit, next_line(limit, have));
+        if (end) break;
+        if (tp->eof) {
+            end = have;
+            break;
+        }
+        want *= 2;
+    }
+
+    size_t len = (size_t)(end - start);
+    size_t k = len / TEXT_MIN_PIECE + 1;
+    if (k > tp->threads) k = tp->threads;
+    if (k > tp->cap) {
+        text_piece_t *p = (text_piece_t*)realloc(tp->pieces, k * sizeof(text_piece_t));
+        if (!p) {
+            fprintf(stderr, "Out of memory while parsing the trace; stopping early.\n");
+            return false;
+        }
+        memset(p + tp->cap, 0, (k - tp->cap) * sizeof(text_piece_t));
+        tp->pieces = p;
+        tp->cap = k;
+    }
+    const char *b = start;
+    for (size_t i = 0; i < k; ++i) {
+        const char *e = i + 1 == k ? end : start + len * (i + 1) / k;
+        if (e < b) e = b;
+        if (e < end && e > start && e[-1] != '\n') e = next_line(e, end);
+        tp->pieces[i].begin = b;
+        tp->pieces[i].end = e;
+        b = e;
+    }
+
+    pthread_t *tids = (pthread_t*)calloc(k, sizeof(pthread_t));
+    bool *started = (bool*)calloc(k, sizeof(bool));
+    for (size_t i = 1; i < k && tids && started; ++i)
+        started[i] = pthread_create(&tids[i], NULL, text_piece_parse, &tp->pieces[i]) == 0;
+    text_piece_parse(&tp->pieces[0]);
+    for (size_t i = 1; i < k; ++i) {
+        if (started && started[i]) pthread_join(tids[i], NULL);
+        else text_piece_parse(&tp->pieces[i]);
+    }
+    free(tids);
+    free(started);
+
+    bool ok = true;
+    for (size_t i = 0; i < k; ++i) ok = ok && tp->pieces[i].ok;
+    if (!ok) fprintf(stderr, "Out of memory while parsing the trace; stopping early.\n");
+    tp->npieces = k;
+    tp->cur = tp->cur_i = 0;
+    tp->pos = (size_t)(end - tp->data);
+    tp->bytes += len;
+    return ok;
+}
+
+// True once every byte of the file has been parsed.
+static bool text_par_done(const text_par_t *tp) {
+    return tp->eof && tp->pos >= tp->len;
+}
+
+static void text_par_free(text_par_t *tp) {
+    if (!tp) return;
+    if (io_stats) {
+        double secs = now_seconds() - tp->start;
+        fprintf(stderr, "io: %.1f MB read in %.3f s (%.1f MB/s)", tp->bytes / 1e6, secs,
+                secs > 0 ? tp->bytes / 1e6 / secs : 0.0);
+        if (tp->io) {
+            fprintf(stderr, " with io_uring, %d reads of %u KB in flight%s, %.3f s waiting for the disk\n",
+                    IO_DEPTH, IO_CHUNK >> 10, io_direct ? " (O_DIRECT)" : "", tp->io->wait);
+        } else {
+            fprintf(stderr, " from a memory-mapped file\n");
+        }
+    }
+    for (size_t i = 0; i < tp->cap; ++i) {
+        free(tp->pieces[i].addrs);
+        free(tp->pieces[i].ops);
+        free(tp->pieces[i].ts);
+        free(tp->pieces[i].has_ts);
+    }
+    free(tp->pieces);
+    if (tp->mapped) {
+        munmap(tp->data, tp->len);
+    } else {
+        free(tp->data);
+        io_stream_close(tp->io);
+        free(tp->io);
+    }
+    free(tp);
+}
+
+// Set up fp (a text trace) for parallel parsing, read with io_uring or mapped
+// into memory. Returns NULL if it isn't a regular file or --io=stdio asked
+// for the plain reader; the caller then reads it line by line.
+static text_par_t *text_par_open(FILE *fp, size_t threads) {
+    struct stat sb;
+    int fd = fileno(fp);
+    if (io_mode == IO_STDIO || fd < 0 || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size <= 0)
+        return NULL;
+    text_par_t *tp = (text_par_t*)calloc(1, sizeof(text_par_t));
+    if (!tp) return NULL;
+    tp->threads = threads ? threads : 1;
+    tp->start = now_seconds();
+
+    if (io_mode == IO_URING) {
+        tp->io = (io_stream_t*)calloc(1, sizeof(io_stream_t));
+        if (tp->io && io_stream_open(tp->io, fd, (unsigned long long)sb.st_size, io_direct)) return tp;
+        free(tp->io);
+        tp->io = NULL;
+    }
+
+    void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        free(tp);
+        return NULL;
+    }
+    madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+    tp->data = (char*)map;
+    tp->len = (size_t)sb.st_size;
+    tp->eof = true;
+    tp->mapped = true;
+    return tp;
+}
+
+// Something we can pull accesses from, a chunk at a time: a text or binary
+// trace file, or a compressed store in memory.
+typedef struct {
+    FILE *fp;
+    bool binary;                // fp holds a binary trace
+    bt_header_t hdr;
+    unsigned long long prev;    // last address decoded from the binary trace
+    stride_run_t pending;       // part of a binary run not handed out yet
+    bool text_done;             // hit a line that isn't an access
+    text_par_t *par;            // text file parsed in parallel (NULL = use fgets)
+    const trace_store_t *store;
+    size_t next_block;
+    unsigned long long position;// accesses handed out so far
+} reader_t;
+
+// Start reading from an open file, text or binary. Returns false if the file
+// looks like a binary trace but its header is broken.
+static bool reader_open_file(reader_t *r, FILE *fp) {
+    memset(r, 0, sizeof(*r));
+    r->fp = fp;
+    int ch = getc(fp);
+    if (ch != BT_MAGIC[0]) {
+        if (ch != EOF) ungetc(ch, fp);
+        if (ftell(fp) == 0) r->par = text_par_open(fp, text_threads);
+        return true;
+    }
+
+    unsigned char magic[sizeof(BT_MAGIC)];
+    magic[0] = (unsigned char)ch;
+    if (fread(magic + 1, 1, sizeof(magic) - 1, fp) != sizeof(magic) - 1 ||
+        memcmp(magic, BT_MAGIC, sizeof(magic)) != 0 ||
+        !get_u32(fp, &r->hdr.version) || !get_u32(fp, &r->hdr.header_bytes) ||
+        !get_u32(fp, &r->hdr.block_size) || r->hdr.header_bytes < BT_HEADER_V1) {
+        fprintf(stderr, "Error: bad binary trace header.\n");
+        return false;
+    }
+    unsigned int read_bytes = BT_HEADER_V1;
+    if (r->hdr.header_bytes >= BT_HEADER_V2) {
+        unsigned int lo, hi;
+        if (!get_u32(fp, &lo) || !get_u32(fp, &hi) || !get_u32(fp, &r->hdr.filter_assoc) ||
+            !get_u32(fp, &r->hdr.filter_repl) || !get_u32(fp, &r->hdr.filter_wb)) {
+            fprintf(stderr, "Error: bad binary trace header.\n");
+            return false;
+        }
+        r->hdr.filter_size = ((unsigned long long)hi << 32) | lo;
+        read_bytes = BT_HEADER_V2;
+    }
+    if (r->hdr.block_size != BLOCK_SIZE) {
+        fprintf(stderr, "Error: binary trace was made for %u byte blocks, this build uses %llu.\n",
+                r->hdr.block_size, BLOCK_SIZE);
+        return false;
+    }
+    // skip header fields added by newer versions
+    for (unsigned int i = read_bytes; i < r->hdr.header_bytes; ++i) {
+        if (getc(fp) == EOF) return false;
+    }
+    r->binary = true;
+    return true;
+}
+
+// Let the user know when a trace only holds what got past another cache.
+static void reader_note_filter(const reader_t *r) {
+    if (!r->binary || r->hdr.filter_size == 0) return;
+    fprintf(stderr, "note: trace is the miss/write-back stream of a %llu byte, %u-way, %s, %s cache\n",
+            r->hdr.filter_size, r->hdr.filter_assoc, r->hdr.filter_repl == 0 ? "LRU" : "FIFO",
+            r->hdr.filter_wb == 1 ? "WB" : "WT");
+}
+
+// Let go of what reader_open_file set up (the file itself stays open).
+static void reader_close(reader_t *r) {
+    text_par_free(r->par);
+    r->par = NULL;
+}
+
+static void reader_open_store(reader_t *r, const trace_store_t *st) {
+    memset(r, 0, sizeof(*r));
+    r->store = st;
+}
+
+// Read one text trace line: "<op> <hex address> [timestamp]". The op is R
+// (read), W (write) or I (instruction fetch); see op_code for anything else.
+// Returns 1 for an access, 0 for a blank line and -1 for anything else.
+static int parse_trace_line(const char *p, char *op, unsigned long long *addr,
+                            unsigned long long *ts, bool *has_ts) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    if (!*p) return 0;
+    *op = *p++;
+    char *end;
+    *addr = strtoull(p, &end, 16);
+    if (end == p) return -1;
+    p = end;
+    *ts = strtoull(p, &end, 10);
+    *has_ts = (end != p);
+    return 1;
+}
+
+// Fill addrs/ops with up to TRACE_CHUNK accesses. Returns 0 at the end of the trace.
+// If ts isn't NULL it gets each access's timestamp: the optional third column
+// of a text trace, or else the access's position in the trace.
+static size_t reader_next_ts(reader_t *r, unsigned long long *addrs, char *ops, unsigned long long *ts) {
+    size_t n = 0;
+    if (r->store) {
+        if (r->next_block >= r->store->nblocks) return 0;
+        n = store_decode(r->store, r->next_block++, addrs, ops);
+        if (ts) {
+            for (size_t i = 0; i < n; ++i) ts[i] = r->position + i;
+        }
+        r->position += n;
+        return n;
+    }
+
+    if (r->binary) {
+        // hand out runs access by access, picking up where the last chunk stopped
+        stride_run_t *p = &r->pending;
+        while (n < TRACE_CHUNK) {
+            if (p->count == 0 && !bt_read(r->fp, &r->prev, p)) break;
+            while (p->count > 0 && n < TRACE_CHUNK) {
+                addrs[n] = p->base;
+                ops[n] = p->op;
+                if (ts) ts[n] = r->position + n;
+                n++;
+                p->base += (unsigned long long)p->stride;
+                p->count--;
+            }
+        }
+        r->position += n;
+        return n;
+    }
+
+    if (r->par) {
+        // hand out the parsed pieces in order, parsing the next window when they run out
+        text_par_t *tp = r->par;
+        while (n < TRACE_CHUNK) {
+            if (tp->cur == tp->npieces) {
+                if (r->text_done || text_par_done(tp)) break;
+                if (!text_par_window(tp)) {
+                    r->text_done = true;
+                    break;
+                }
+                continue;
+            }
+            text_piece_t *pc = &tp->pieces[tp->cur];
+            size_t take = pc->n - tp->cur_i;
+            if (take > TRACE_CHUNK - n) take = TRACE_CHUNK - n;
+            memcpy(addrs + n, pc->addrs + tp->cur_i, take * sizeof(unsigned long long));
+            memcpy(ops + n, pc->ops + tp->cur_i, take);
+            if (ts) {
+                for (size_t i = 0; i < take; ++i)
+                    ts[n + i] = pc->has_ts[tp->cur_i + i] ? pc->ts[tp->cur_i + i] : r->position + n + i;
+            }
+            n += take;
+            tp->cur_i += take;
+            if (tp->cur_i == pc->n) {
+                // a piece that stopped early ends the trace
+                if (pc->stop) {
+                    r->text_done = true;
+                    tp->npieces = tp->cur;
+                } else {
+                    tp->cur++;
+                    tp->cur_i = 0;
+                }
+            }
+        }
+        r->position += n;
+        return n;
+    }
+
+    // read one line at a time: operation (R, W or I), address and maybe a timestamp;
+    // like the old fscanf loop, the trace ends at the first line we can't read
+    char line[256];
+    while (n < TRACE_CHUNK && !r->text_done && fgets(line, sizeof(line), r->fp)) {
+        unsigned long long t;
+        bool has_ts;
+        int got = parse_trace_line(line, &ops[n], &addrs[n], &t, &has_ts);
+        if (got < 0) r->text_done = true;
+        if (got <= 0) continue;
+        if (ts) ts[n] = has_ts ? t : r->position + n;
+        n++;
+    }
+    r->position += n;
+    return n;
+}
+
+static size_t reader_next(reader_t *r, unsigned long long *addrs, char *ops) {
+    return reader_next_ts(r, addrs, ops, NULL);
+}
+
+// Apply a whole stride run. Instead of looking at every access we work out
+// how many of them fall in each block and apply each block's share as one
+// same-block run; strides of a block or more touch a new block every time.
+static void cache_access_stride(cache_t *c, const stride_run_t *s) {
+    bool is_write = (s->op == 'W' || s->op == 'w');
+    bool is_read = (s->op == 'R' || s->op == 'r' || s->op == 'I' || s->op == 'i');
+    unsigned long long step = s->stride < 0 ? (unsigned long long)(-s->stride) : (unsigned long long)s->stride;
+
+    if (s->count > 1 && step >= BLOCK_SIZE) {
+        unsigned long long a = s->base;
+        for (unsigned long long k = 0; k < s->count; ++k, a += (unsigned long long)s->stride)
+            cache_access(c, s->op, a);
+        return;
+    }
+
+    unsigned long long a = s->base;
+    unsigned long long left = s->count;
+    while (left > 0) {
+        // how many accesses from `a` on stay inside a's block
+        unsigned long long in_block;
+        if (step == 0) {
+            in_block = left;
+        } else if (s->stride > 0) {
+            unsigned long long to_end = BLOCK_SIZE - a % BLOCK_SIZE;
+            in_block = (to_end + step - 1) / step;
+        } else {
+            in_block = a % BLOCK_SIZE / step + 1;
+        }
+        if (in_block > left) in_block = left;
+
+        // a block run never holds more than BLOCK_SIZE accesses unless the
+        // stride is 0, so split very long zero-stride runs to fit the counters
+        while (in_block > 0) {
+            unsigned int m = in_block > UINT_MAX ? UINT_MAX : (unsigned int)in_block;
+            block_run_t br;
+            br.addr = a;
+            br.first_op = s->op;
+            br.count = m;
+            br.lead = is_read ? 0 : m;
+            br.writes = is_write ? m - 1 : 0;
+            br.tail_writes = 0;
+            cache_access_run(c, &br);
+            in_block -= m;
+            left -= m;
+            a += (unsigned long long)s->stride * m;
+        }
+    }
+}
+
+// Buffers for one decoded chunk of the trace.
+typedef struct {
+    unsigned long long *addrs;
+    char *ops;
+    block_run_t *runs;      // only used when collapsing runs
+} chunk_buf_t;
+
+static bool chunk_buf_init(chunk_buf_t *b, bool with_runs) {
+    b->addrs = (unsigned long long*)malloc(TRACE_CHUNK * sizeof(unsigned long long));
+    b->ops = (char*)malloc(TRACE_CHUNK);
+    b->runs = with_runs ? (block_run_t*)malloc(TRACE_CHUNK * sizeof(block_run_t)) : NULL;
+    return b->addrs && b->ops && (b->runs || !with_runs);
+}
+
+static void chunk_buf_free(chunk_buf_t *b) {
+    free(b->addrs);
+    free(b->ops);
+    free(b->runs);
+}
+
+// Counts of how much work collapsing runs saved.
+typedef struct {
+    unsigned long long accesses;
+    unsigned long long runs;
+} rle_stats_t;
+
+// Run every access from the reader through the cache. With `rle` set, runs of
+// accesses to the same block are collapsed first (same results, fewer lookups);
+// rs, if given, collects how much was collapsed. Binary traces always go run by run.
+static bool simulate(cache_t *c, reader_t *r, bool rle, rle_stats_t *rs) {
+    if (r->binary) {
+        // binary traces are already made of runs; replay them run by run
+        stride_run_t s;
+        while (bt_read(r->fp, &r->prev, &s)) {
+            cache_access_stride(c, &s);
+            if (rs) {
+                rs->accesses += s.count;
+                rs->runs++;
+            }
+            rec_poll(c);
+        }
+        return true;
+    }
+
+    chunk_buf_t buf;
+    if (!chunk_buf_init(&buf, rle)) { chunk_buf_free(&buf); return false; }
+    size_t n;
+    while ((n = reader_next(r, buf.addrs, buf.ops)) > 0) {
+        if (rle) {
+            size_t nruns = rle_collapse(buf.addrs, buf.ops, n, buf.runs);
+            for (size_t i = 0; i < nruns; ++i)
+                cache_access_run(c, &buf.runs[i]);
+            if (rs) {
+                rs->accesses += n;
+                rs->runs += nruns;
+            }
+        } else {
+            for (size_t i = 0; i < n; ++i)
+                cache_access(c, buf.ops[i], buf.addrs[i]);
+        }
+        rec_poll(c);
+    }
+    chunk_buf_free(&buf);
+    return true;
+}
+
+// One cache configuration from the command line.
+typedef struct {
+    size_t cache_size;
+    size_t assoc;
+    int replacement;
+    int writeback;
+} config_t;
+
+// Does the configuration divide into whole sets (what cache_init checks)?
+static bool config_valid(const config_t *cfg) {
+    size_t lines = cfg->cache_size / BLOCK_SIZE;
+    return cfg->assoc != 0 && lines != 0 && lines % cfg->assoc == 0;
+}
+
+// ---- Lockstep simulation of many caches ----
+//
+// A sweep would otherwise replay (and decode) the trace once per cache.
+// Instead all the caches run side by side over one pass of the trace, grouped
+// by number of sets: the set index and tag only depend on that, so caches
+// that share it (a WB/WT pair, LRU and FIFO, or 8KB 4-way next to 16KB 8-way)
+// share the work. Each chunk is decoded once, and each group walks it working
+// out every access's index and tag once for all of its caches, which sit next
+// to each other in one array.
+
+typedef struct {
+    size_t num_sets;
+    size_t first, n;        // the group's caches are caches[first .. first+n-1]
+} lock_group_t;
+
+typedef struct {
+    cache_t *caches;        // every valid configuration's cache, grouped by num_sets
+    size_t *cfg_index;      // caches[k] simulates configuration cfg_index[k]
+    size_t ncaches;
+    lock_group_t *groups;
+    size_t ngroups;
+} lockstep_t;
+
+static void lockstep_free(lockstep_t *ls) {
+    for (size_t k = 0; k < ls->ncaches; ++k) cache_fini(&ls->caches[k]);
+    free(ls->caches);
+    free(ls->cfg_index);
+    free(ls->groups);
+    memset(ls, 0, sizeof(*ls));
+}
+
+// Set up a cache for every valid configuration (invalid ones are reported and
+// left out). Returns false if we ran out of memory.
+static bool lockstep_init(lockstep_t *ls, const config_t *cfgs, size_t ncfg) {
+    memset(ls, 0, sizeof(*ls));
+    ls->caches = (cache_t*)calloc(ncfg ? ncfg : 1, sizeof(cache_t));
+    ls->cfg_index = (size_t*)calloc(ncfg ? ncfg : 1, sizeof(size_t));
+    ls->groups = (lock_group_t*)calloc(ncfg ? ncfg : 1, sizeof(lock_group_t));
+    if (!ls->caches || !ls->cfg_index || !ls->groups) {
+        lockstep_free(ls);
+        return false;
+    }
+
+    // configurations in order of their number of sets (insertion sort keeps
+    // the command line order within a group)
+    size_t *sets = (size_t*)calloc(ncfg ? ncfg : 1, sizeof(size_t));
+    if (!sets) {
+        lockstep_free(ls);
+        return false;
+    }
+    size_t nvalid = 0;
+    for (size_t i = 0; i < ncfg; ++i) {
+        if (!config_valid(&cfgs[i])) {
+            fprintf(stderr, "Skipping invalid configuration: size %zu assoc %zu\n",
+                    cfgs[i].cache_size, cfgs[i].assoc);
+            continue;
+        }
+        size_t ns = cfgs[i].cache_size / BLOCK_SIZE / cfgs[i].assoc, k = nvalid++;
+        while (k > 0 && sets[k - 1] > ns) {
+            sets[k] = sets[k - 1];
+            ls->cfg_index[k] = ls->cfg_index[k - 1];
+            k--;
+        }
+        sets[k] = ns;
+        ls->cfg_index[k] = i;
+    }
+    free(sets);
+
+    for (size_t k = 0; k < nvalid; ++k) {
+        const config_t *cfg = &cfgs[ls->cfg_index[k]];
+        if (!cache_init(&ls->caches[k], cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback)) {
+            lockstep_free(ls);
+            return false;
+        }
+        ls->ncaches++;
+        if (ls->ngroups == 0 || ls->groups[ls->ngroups - 1].num_sets != ls->caches[k].num_sets) {
+            ls->groups[ls->ngroups].num_sets = ls->caches[k].num_sets;
+            ls->groups[ls->ngroups].first = k;
+            ls->ngroups++;
+        }
+        ls->groups[ls->ngroups - 1].n++;
+    }
+    return true;
+}
+
+// Run the whole trace through every cache. With rle, runs are collapsed once
+// per chunk, and each group works out a run's index and tag once too.
+static bool lockstep_run(lockstep_t *ls, reader_t *r, bool rle) {
+    chunk_buf_t buf;
+    if (!chunk_buf_init(&buf, rle)) { chunk_buf_free(&buf); return false; }
+    size_t n;
+    while ((n = reader_next(r, buf.addrs, buf.ops)) > 0) {
+        if (rle) {
+            size_t nruns = rle_collapse(buf.addrs, buf.ops, n, buf.runs);
+            for (size_t g = 0; g < ls->ngroups; ++g) {
+                const lock_group_t *grp = &ls->groups[g];
+                cache_t *group = ls->caches + grp->first;
+                for (size_t i = 0; i < nruns; ++i) {
+                    const block_run_t *run = &buf.runs[i];
+                    size_t set_idx = get_set_index(run->addr, grp->num_sets);
+                    unsigned long long tag = get_tag(run->addr, grp->num_sets);
+                    for (size_t k = 0; k < grp->n; ++k) cache_access_run_at(&group[k], run, set_idx, tag);
+                }
+            }
+            continue;
+        }
+        for (size_t g = 0; g < ls->ngroups; ++g) {
+            const lock_group_t *grp = &ls->groups[g];
+            cache_t *group = ls->caches + grp->first;
+            for (size_t i = 0; i < n; ++i) {
+                unsigned long long addr = buf.addrs[i];
+                size_t set_idx = get_set_index(addr, grp->num_sets);
+                unsigned long long tag = get_tag(addr, grp->num_sets);
+                for (size_t k = 0; k < grp->n; ++k)
+                    cache_access_at(&group[k], buf.ops[i], addr, set_idx, tag);
+            }
+        }
+    }
+    chunk_buf_free(&buf);
+    return true;
+}
+
+static void rle_report(FILE *out, const rle_stats_t *rs) {
+    fprintf(out, "run-length: %llu accesses collapsed into %llu runs (%.2f accesses/run)\n",
+            rs->accesses, rs->runs, rs->runs ? (double)rs->accesses / (double)rs->runs : 0.0);
+}
+
+// Read a whole trace file (text or binary) into a compressed store.
+static trace_store_t *store_load(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open the trace file: %s\n", path);
+        return NULL;
+    }
+    reader_t r;
+    if (!reader_open_file(&r, fp)) {
+        fclose(fp);
+        return NULL;
+    }
+    reader_note_filter(&r);
+
+    trace_store_t *st = store_create();
+    chunk_buf_t buf;
+    bool ok = chunk_buf_init(&buf, false) && st;
+    size_t n;
+    while (ok && (n = reader_next(&r, buf.addrs, buf.ops)) > 0) {
+        for (size_t i = 0; i < n && ok; ++i) ok = store_append(st, buf.ops[i], buf.addrs[i]);
+    }
+    ok = ok && store_seal(st);
+    chunk_buf_free(&buf);
+    reader_close(&r);
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "Out of memory while loading %s\n", path);
+        store_destroy(st);
+        return NULL;
+    }
+    return st;
+}
+
+// Print how small the store is and how fast it decodes (raw = 16 bytes per access).
+static void store_report(FILE *out, const trace_store_t *st) {
+    chunk_buf_t buf;
+    double secs = 0.0;
+    if (chunk_buf_init(&buf, false)) {
+        double t0 = now_seconds();
+        for (size_t b = 0; b < st->nblocks; ++b) store_decode(st, b, buf.addrs, buf.ops);
+        secs = now_seconds() - t0;
+    }
+    chunk_buf_free(&buf);
+
+    double raw = (double)st->records * 16.0;
+    fprintf(out, "trace store: %llu accesses in %zu bytes (%.2f bits/access, %.1f%% of raw)",
+            st->records, st->bytes,
+            st->records ? 8.0 * (double)st->bytes / (double)st->records : 0.0,
+            raw > 0 ? 100.0 * (double)st->bytes / raw : 0.0);
+    if (secs > 0) fprintf(out, ", decodes at %.2f GB/s", raw / secs / 1e9);
+    fprintf(out, "\n");
+}
+
+// ---- Stack distances (Mattson) ----
+//
+// The LRU stack distance of an access is the number of different blocks used
+// since the last access to the same block. A fully associative LRU cache of C
+// lines hits exactly the accesses with distance < C, so one pass over the trace
+// gives the miss ratio of every size at once (the miss-ratio curve, MRC).
+// Each block's last access time is kept in a hash map, and a Fenwick tree over
+// access times holds a 1 at the last access of every block, so a distance is
+// the number of 1s after the block's previous access: O(log n) per access.
+
+typedef struct {
+    unsigned long long *tree;   // Fenwick tree over access times (1-based)
+    size_t cap;                 // times the tree can hold (a power of two)
+    unsigned long long now;     // accesses so far
+    unsigned long long *keys;   // hash map: block + 1 (0 = empty slot) ...
+    unsigned long long *last;   // ... -> time of its last access
+    size_t mask;
+    size_t blocks;              // different blocks seen
+    unsigned long long *hist;   // hist[d] = accesses with stack distance d
+    size_t hist_len;
+    unsigned long long cold;    // first accesses to a block (infinite distance)
+} stackdist_t;
+
+static void sd_free(stackdist_t *sd) {
+    free(sd->tree);
+    free(sd->keys);
+    free(sd->last);
+    free(sd->hist);
+    memset(sd, 0, sizeof(*sd));
+}
+
+static bool sd_init(stackdist_t *sd) {
+    memset(sd, 0, sizeof(*sd));
+    sd->cap = 1 << 16;
+    sd->mask = (1 << 12) - 1;
+    sd->hist_len = 1 << 12;
+    sd->tree = (unsigned long long*)calloc(sd->cap + 1, sizeof(unsigned long long));
+    sd->keys = (unsigned long long*)calloc(sd->mask + 1, sizeof(unsigned long long));
+    sd->last = (unsigned long long*)calloc(sd->mask + 1, sizeof(unsigned long long));
+    sd->hist = (unsigned long long*)calloc(sd->hist_len, sizeof(unsigned long long));
+    if (!sd->tree || !sd->keys || !sd->last || !sd->hist) {
+        sd_free(sd);
+        return false;
+    }
+    return true;
+}
+
+static void fenwick_add(unsigned long long *tree, size_t cap, size_t i, long long v) {
+    for (; i <= cap; i += i & (~i + 1)) tree[i] += (unsigned long long)v;
+}
+
+// Sum of positions 1..i.
+static unsigned long long fenwick_sum(const unsigned long long *tree, size_t i) {
+    unsigned long long sum = 0;
+    for (; i > 0; i -= i & (~i + 1)) sum += tree[i];
+    return sum;
+}
+
+// Double the tree. The new upper half is empty, so the only new node that
+// covers old positions is the last one, which covers them all.
+static bool sd_grow_tree(stackdist_t *sd) {
+    unsigned long long *t = (unsigned long long*)realloc(sd->tree, (2 * sd->cap + 1) * sizeof(unsigned long long));
+    if (!t) return false;
+    memset(t + sd->cap + 1, 0, sd->cap * sizeof(unsigned long long));
+    t[2 * sd->cap] = t[sd->cap];
+    sd->tree = t;
+    sd->cap *= 2;
+    return true;
+}
+
+// Find the hash map slot of a block (empty if it isn't there yet).
+static size_t sd_slot(const stackdist_t *sd, unsigned long long block) {
+    size_t i = hash_block(block) & sd->mask;
+    while (sd->keys[i] != 0 && sd->keys[i] != block + 1) i = (i + 1) & sd->mask;
+    return i;
+}
+
+static bool sd_grow_map(stackdist_t *sd) {
+    size_t old_size = sd->mask + 1;
+    unsigned long long *old_keys = sd->keys, *old_last = sd->last;
+    sd->keys = (unsigned long long*)calloc(2 * old_size, sizeof(unsigned long long));
+    sd->last = (unsigned long long*)calloc(2 * old_size, sizeof(unsigned long long));
+    if (!sd->keys || !sd->last) {
+        free(sd->keys);
+        free(sd->last);
+        sd->keys = old_keys;
+        sd->last = old_last;
+        return false;
+    }
+    sd->mask = 2 * old_size - 1;
+    for (size_t i = 0; i < old_size; ++i) {
+        if (old_keys[i] == 0) continue;
+        size_t j = sd_slot(sd, old_keys[i] - 1);
+        sd->keys[j] = old_keys[i];
+        sd->last[j] = old_last[i];
+    }
+    free(old_keys);
+    free(old_last);
+    return true;
+}
+
+// Add n accesses with stack distance d to the histogram.
+static bool sd_count(stackdist_t *sd, unsigned long long d, unsigned long long n) {
+    if (d >= sd->hist_len) {
+        size_t len = sd->hist_len;
+        while (len <= d) len *= 2;
+        unsigned long long *h = (unsigned long long*)realloc(sd->hist, len * sizeof(unsigned long long));
+        if (!h) return false;
+        memset(h + sd->hist_len, 0, (len - sd->hist_len) * sizeof(unsigned long long));
+        sd->hist = h;
+        sd->hist_len = len;
+    }
+    sd->hist[d] += n;
+    return true;
+}
+
+// Record one access to a block. Returns false if we ran out of memory.
+static bool sd_access(stackdist_t *sd, unsigned long long block) {
+    if (sd->now == sd->cap && !sd_grow_tree(sd)) return false;
+    if (2 * (sd->blocks + 1) > sd->mask + 1 && !sd_grow_map(sd)) return false;
+
+    size_t t = (size_t)++sd->now;
+    size_t i = sd_slot(sd, block);
+    if (sd->keys[i] == 0) {
+        sd->keys[i] = block + 1;
+        sd->blocks++;
+        sd->cold++;
+    } else {
+        size_t prev = (size_t)sd->last[i];
+        if (!sd_count(sd, fenwick_sum(sd->tree, t - 1) - fenwick_sum(sd->tree, prev), 1)) return false;
+        fenwick_add(sd->tree, sd->cap, prev, -1);
+    }
+    sd->last[i] = t;
+    fenwick_add(sd->tree, sd->cap, t, 1);
+    return true;
+}
+
+// Forget everything but keep the memory.
+static void sd_reset(stackdist_t *sd) {
+    memset(sd->tree, 0, (sd->cap + 1) * sizeof(unsigned long long));
+    memset(sd->keys, 0, (sd->mask + 1) * sizeof(unsigned long long));
+    memset(sd->hist, 0, sd->hist_len * sizeof(unsigned long long));
+    sd->now = 0;
+    sd->blocks = 0;
+    sd->cold = 0;
+}
+
+// Feed a whole trace through the stack distance engine.
+static bool sd_run(stackdist_t *sd, reader_t *r) {
+    chunk_buf_t buf;
+    bool ok = chunk_buf_init(&buf, false);
+    size_t n;
+    while (ok && (n = reader_next(r, buf.addrs, buf.ops)) > 0) {
+        for (size_t i = 0; i < n && ok; ++i) ok = sd_access(sd, buf.addrs[i] / BLOCK_SIZE);
+    }
+    chunk_buf_free(&buf);
+    return ok;
+}
+
+// Misses of a fully associative LRU cache with this many lines.
+static unsigned long long sd_misses(const stackdist_t *sd, size_t lines) {
+    unsigned long long misses = sd->cold;
+    for (size_t d = lines; d < sd->hist_len; ++d) misses += sd->hist[d];
+    return misses;
+}
+
+// ---- Dense block IDs ----
+//
+// Stack distances (and anything else that keeps state per block) look blocks
+// up in hash maps, and on big traces those lookups cost more than the rest of
+// the work. One pass over the trace can instead give every different block a
+// dense 32-bit ID (0, 1, 2, ...) and rewrite the trace as IDs. After that,
+// per-block state is a flat array indexed by ID.
+//
+// The pass runs on several threads in three steps:
+//  1. each thread takes a chunk of the store and numbers the blocks of its
+//     chunk locally, in order of first use, sorting them into shards by hash;
+//  2. each thread takes one shard and numbers its blocks across all chunks
+//     (in chunk order, so the result doesn't depend on timing);
+//  3. each chunk turns its local numbers into shard number + the shard's
+//     offset, and rewrites its part of the trace.
+// Which ID a block gets depends on the number of threads, but every block
+// gets exactly one.
+
+// A block -> ID hash map (open addressing, linear probing).
+typedef struct {
+    unsigned long long *keys;   // block + 1, 0 = empty slot
+    unsigned int *vals;
+    size_t mask;
+    size_t used;
+} id_map_t;
+
+static void id_map_free(id_map_t *m) {
+    free(m->keys);
+    free(m->vals);
+    memset(m, 0, sizeof(*m));
+}
+
+static bool id_map_init(id_map_t *m, size_t size) {
+    m->keys = (unsigned long long*)calloc(size, sizeof(unsigned long long));
+    m->vals = (unsigned int*)malloc(size * sizeof(unsigned int));
+    m->mask = size - 1;
+    m->used = 0;
+    if (m->keys && m->vals) return true;
+    id_map_free(m);
+    return false;
+}
+
+static bool id_map_grow(id_map_t *m) {
+    id_map_t bigger;
+    if (!id_map_init(&bigger, 2 * (m->mask + 1))) return false;
+    for (size_t i = 0; i <= m->mask; ++i) {
+        if (m->keys[i] == 0) continue;
+        size_t j = hash_block(m->keys[i] - 1) & bigger.mask;
+        while (bigger.keys[j] != 0) j = (j + 1) & bigger.mask;
+        bigger.keys[j] = m->keys[i];
+        bigger.vals[j] = m->vals[i];
+    }
+    bigger.used = m->used;
+    id_map_free(m);
+    *m = bigger;
+    return true;
+}
+
+// The ID of a block. A block not seen yet gets `next`, and *added is set.
+// Returns false if we ran out of memory.
+static inline bool id_map_get(id_map_t *m, unsigned long long block, unsigned int next,
+                              unsigned int *id, bool *added) {
+    if (2 * (m->used + 1) > m->mask + 1 && !id_map_grow(m)) return false;
+    size_t i = hash_block(block) & m->mask;
+    while (m->keys[i] != 0 && m->keys[i] != block + 1) i = (i + 1) & m->mask;
+    *added = m->keys[i] == 0;
+    if (*added) {
+        m->keys[i] = block + 1;
+        m->vals[i] = next;
+        m->used++;
+    }
+    *id = m->vals[i];
+    return true;
+}
+
+// Which shard a block belongs to (the map slots use the low bits of the hash).
+static inline size_t id_shard(unsigned long long block, size_t nshards) {
+    return (size_t)(hash_block(block) >> 32) % nshards;
+}
+
+// A whole trace as dense block IDs.
+typedef struct {
+    unsigned int *ids;          // ids[i] = ID of the block of access i
+    size_t n;                   // accesses
+    size_t nids;                // different blocks (IDs are 0 .. nids - 1)
+    unsigned long long *blocks; // blocks[id] = block number
+} block_ids_t;
+
+static void block_ids_free(block_ids_t *bi) {
+    free(bi->ids);
+    free(bi->blocks);
+    memset(bi, 0, sizeof(*bi));
+}
+
+typedef struct {
+    const trace_store_t *st;
+    size_t first_block, end_block;  // store blocks in this chunk
+    unsigned int *ids;              // the chunk's part of block_ids_t.ids
+    size_t nshards;
+    unsigned long long *blk;        // blocks of the chunk by local ID (first use order)
+    size_t nblk, cap;
+    unsigned int *by_shard;         // local IDs grouped by shard: shard s has
+    size_t *shard_start;            // by_shard[shard_start[s] .. shard_start[s + 1])
+    unsigned int *global;           // local ID -> ID in its shard, then global ID
+    const size_t *shard_offset;     // first global ID of each shard (step 3)
+    bool ok;
+} ids_chunk_t;
+
+typedef struct {
+    ids_chunk_t *chunks;
+    size_t nchunks;
+    size_t shard;
+    id_map_t map;
+    unsigned long long *blk;        // blocks of the shard by ID in the shard
+    size_t nblk, cap;
+    block_ids_t *out;               // step 3 copies blk into out->blocks
+    bool ok;
+} ids_shard_t;
+
+static bool ids_push(unsigned long long **blk, size_t *n, size_t *cap, unsigned long long block) {
+    if (*n == *cap) {
+        size_t c = *cap ? 2 * *cap : 4096;
+        unsigned long long *b = (unsigned long long*)realloc(*blk, c * sizeof(unsigned long long));
+        if (!b) return false;
+        *blk = b;
+        *cap = c;
+    }
+    (*blk)[(*n)++] = block;
+    return true;
+}
+
+// Step 1: number the chunk's blocks and sort them into shards.
+static void *ids_chunk_number(void *arg) {
+    ids_chunk_t *ch = (ids_chunk_t*)arg;
+    chunk_buf_t buf;
+    id_map_t map;
+    ch->ok = chunk_buf_init(&buf, false) && id_map_init(&map, 1 << 12);
+    size_t pos = 0;
+    for (size_t b = ch->first_block; b < ch->end_block && ch->ok; ++b) {
+        size_t n = store_decode(ch->st, b, buf.addrs, buf.ops);
+        for (size_t i = 0; i < n && ch->ok; ++i) {
+            unsigned long long block = buf.addrs[i] / BLOCK_SIZE;
+            bool added;
+            ch->ok = id_map_get(&map, block, (unsigned int)ch->nblk, &ch->ids[pos++], &added);
+            if (ch->ok && added) ch->ok = ch->nblk < UINT_MAX && ids_push(&ch->blk, &ch->nblk, &ch->cap, block);
+        }
+    }
+    chunk_buf_free(&buf);
+    id_map_free(&map);
+    if (!ch->ok) return NULL;
+
+    ch->shard_start = (size_t*)calloc(ch->nshards + 1, sizeof(size_t));
+    ch->by_shard = (unsigned int*)malloc((ch->nblk ? ch->nblk : 1) * sizeof(unsigned int));
+    ch->global = (unsigned int*)malloc((ch->nblk ? ch->nblk : 1) * sizeof(unsigned int));
+    ch->ok = ch->shard_start && ch->by_shard && ch->global;
+    if (!ch->ok) return NULL;
+    // counting sort; global[] holds each block's shard for the moment
+    for (size_t j = 0; j < ch->nblk; ++j) {
+        ch->global[j] = (unsigned int)id_shard(ch->blk[j], ch->nshards);
+        ch->shard_start[ch->global[j] + 1]++;
+    }
+    for (size_t s = 0; s < ch->nshards; ++s) ch->shard_start[s + 1] += ch->shard_start[s];
+    size_t *fill = (size_t*)malloc((ch->nshards ? ch->nshards : 1) * sizeof(size_t));
+    if (!(ch->ok = fill != NULL)) return NULL;
+    memcpy(fill, ch->shard_start, ch->nshards * sizeof(size_t));
+    for (size_t j = 0; j < ch->nblk; ++j) ch->by_shard[fill[ch->global[j]]++] = (unsigned int)j;
+    free(fill);
+    return NULL;
+}
+
+// Step 2: number the blocks of one shard, chunk by chunk.
+static void *ids_shard_number(void *arg) {
+    ids_shard_t *sh = (ids_shard_t*)arg;
+    sh->ok = id_map_init(&sh->map, 1 << 12);
+    for (size_t k = 0; k < sh->nchunks && sh->ok; ++k) {
+        ids_chunk_t *ch = &sh->chunks[k];
+        for (size_t p = ch->shard_start[sh->shard]; p < ch->shard_start[sh->shard + 1] && sh->ok; ++p) {
+            unsigned int j = ch->by_shard[p];
+            bool added;
+            sh->ok = id_map_get(&sh->map, ch->blk[j], (unsigned int)sh->nblk, &ch->global[j], &added);
+            if (sh->ok && added) sh->ok = sh->nblk < UINT_MAX && ids_push(&sh->blk, &sh->nblk, &sh->cap, ch->blk[j]);
+        }
+    }
+    id_map_free(&sh->map);
+    return NULL;
+}
+
+// Step 3: rewrite chunk k in global IDs, and copy shard k's blocks out.
+static void *ids_finish(void *arg) {
+    ids_shard_t *sh = (ids_shard_t*)arg;
+    ids_chunk_t *ch = &sh->chunks[sh->shard];
+    for (size_t j = 0; j < ch->nblk; ++j)
+        ch->global[j] += (unsigned int)ch->shard_offset[id_shard(ch->blk[j], ch->nshards)];
+    size_t n = 0;
+    for (size_t b = ch->first_block; b < ch->end_block; ++b) n += ch->st->blocks[b].n;
+    for (size_t i = 0; i < n; ++i) ch->ids[i] = ch->global[ch->ids[i]];
+    memcpy(sh->out->blocks + ch->shard_offset[sh->shard], sh->blk, sh->nblk * sizeof(unsigned long long));
+    return NULL;
+}
+
+// Run fn on args[0 .. n-1] (each `size` bytes), one thread each; the calling
+// thread takes the first, and any thread that can't be started runs here too.
+static void run_threads(void *(*fn)(void*), void *args, size_t size, size_t n) {
+    pthread_t *tids = (pthread_t*)calloc(n, sizeof(pthread_t));
+    bool *started = (bool*)calloc(n, sizeof(bool));
+    for (size_t k = 1; k < n && tids && started; ++k)
+        started[k] = pthread_create(&tids[k], NULL, fn, (char*)args + k * size) == 0;
+    if (n > 0) fn(args);
+    for (size_t k = 1; k < n; ++k) {
+        if (started && started[k]) pthread_join(tids[k], NULL);
+        else fn((char*)args + k * size);
+    }
+    free(tids);
+    free(started);
+}
+
+// Give every block of the store a dense ID, using up to `threads` threads.
+// Returns false if we ran out of memory or there are more than 2^32 - 1
+// different blocks.
+static bool block_ids_build(block_ids_t *bi, const trace_store_t *st, size_t threads) {
+    memset(bi, 0, sizeof(*bi));
+    if (threads > st->nblocks) threads = st->nblocks;
+    if (threads == 0) threads = 1;
+    bi->n = (size_t)st->records;
+    bi->ids = (unsigned int*)malloc((bi->n ? bi->n : 1) * sizeof(unsigned int));
+    ids_chunk_t *chunks = (ids_chunk_t*)calloc(threads, sizeof(ids_chunk_t));
+    ids_shard_t *shards = (ids_shard_t*)calloc(threads, sizeof(ids_shard_t));
+    size_t *offset = (size_t*)calloc(threads + 1, sizeof(size_t));
+    bool ok = bi->ids && chunks && shards && offset;
+
+    size_t b = 0, start = 0;
+    for (size_t k = 0; k < threads && ok; ++k) {
+        ids_chunk_t *ch = &chunks[k];
+        ch->st = st;
+        ch->first_block = b;
+        b = st->nblocks * (k + 1) / threads;
+        ch->end_block = b;
+        ch->ids = bi->ids + start;
+        ch->nshards = threads;
+        ch->shard_offset = offset;
+        for (size_t j = ch->first_block; j < ch->end_block; ++j) start += st->blocks[j].n;
+        shards[k].chunks = chunks;
+        shards[k].nchunks = threads;
+        shards[k].shard = k;
+        shards[k].out = bi;
+    }
+    if (ok) run_threads(ids_chunk_number, chunks, sizeof(ids_chunk_t), threads);
+    for (size_t k = 0; k < threads && ok; ++k) ok = chunks[k].ok;
+    if (ok) run_threads(ids_shard_number, shards, sizeof(ids_shard_t), threads);
+    for (size_t k = 0; k < threads && ok; ++k) {
+        ok = shards[k].ok && offset[k] + shards[k].nblk <= UINT_MAX;
+        offset[k + 1] = offset[k] + shards[k].nblk;
+    }
+    if (ok) {
+        bi->nids = offset[threads];
+        bi->blocks = (unsigned long long*)malloc((bi->nids ? bi->nids : 1) * sizeof(unsigned long long));
+        ok = bi->blocks != NULL;
+    }
+    if (ok) run_threads(ids_finish, shards, sizeof(ids_shard_t), threads);
+
+    for (size_t k = 0; chunks && k < threads; ++k) {
+        free(chunks[k].blk);
+        free(chunks[k].by_shard);
+        free(chunks[k].shard_start);
+        free(chunks[k].global);
+    }
+    for (size_t k = 0; shards && k < threads; ++k) free(shards[k].blk);
+    free(chunks);
+    free(shards);
+    free(offset);
+    if (!ok) block_ids_free(bi);
+    return ok;
+}
+
+// ---- Parallel stack distances ----
+//
+// The trace, as dense block IDs, is split into one chunk per thread. Each
+// thread runs its chunk through its own Fenwick tree, which gets every reuse
+// inside the chunk exactly right (all the blocks in between are in the chunk
+// too), and writes down each block's first and last access in the chunk. Only
+// the first accesses need the rest of the trace, and they are resolved by a
+// merge that walks the chunks in order over one global Fenwick tree:
+//
+//  - a block's first access in the chunk at time t, last used before the chunk
+//    at time p, has the distance of the marks in (p, t). Marks are moved to the
+//    first access of each block as the chunk's first accesses go by, so blocks
+//    used both before p..chunk start and in the chunk before t count once.
+//  - after the chunk, each block's mark moves on to its last access in it.
+//
+// The merge touches each block once per chunk rather than once per access, and
+// the histograms come out the same as sd_run's. Each thread looks up the IDs
+// of its chunk in a hash map of its own, so it only needs memory for the
+// blocks the chunk uses; the merge keeps 8 bytes for every ID.
+
+typedef struct {
+    const unsigned int *ids;        // the chunk's accesses
+    size_t n;
+    unsigned long long start;       // accesses before the chunk
+    stackdist_t local;
+    // each block used in the chunk, in order of first use, with the (1-based,
+    // chunk relative) times of its first and last access
+    unsigned int *blk, *first, *last;
+    size_t nblk;
+    bool ok;
+} sd_chunk_t;
+
+// Make room for more blocks in the chunk's blk, first and last arrays.
+static bool sd_chunk_grow(sd_chunk_t *ch, size_t *cap) {
+    size_t c = *cap ? 2 * *cap : 4096;
+    unsigned int *p = (unsigned int*)realloc(ch->blk, c * sizeof(unsigned int));
+    if (!p) return false;
+    ch->blk = p;
+    p = (unsigned int*)realloc(ch->first, c * sizeof(unsigned int));
+    if (!p) return false;
+    ch->first = p;
+    p = (unsigned int*)realloc(ch->last, c * sizeof(unsigned int));
+    if (!p) return false;
+    ch->last = p;
+    *cap = c;
+    return true;
+}
+
+static void *sd_chunk_worker(void *arg) {
+    sd_chunk_t *ch = (sd_chunk_t*)arg;
+    id_map_t map;       // ID -> its index in blk
+    size_t cap = 0;
+    ch->ok = id_map_init(&map, 1 << 12) && sd_init(&ch->local);
+    while (ch->ok && ch->local.cap < ch->n) ch->ok = sd_grow_tree(&ch->local);
+
+    stackdist_t *sd = &ch->local;
+    for (size_t i = 0; i < ch->n && ch->ok; ++i) {
+        size_t t = (size_t)++sd->now;
+        unsigned int j;
+        bool added;
+        ch->ok = id_map_get(&map, ch->ids[i], (unsigned int)ch->nblk, &j, &added);
+        if (!ch->ok) break;
+        if (added) {
+            if (ch->nblk == cap && !(ch->ok = sd_chunk_grow(ch, &cap))) break;
+            ch->blk[j] = ch->ids[i];
+            ch->first[j] = (unsigned int)t;
+            ch->nblk++;
+        } else {
+            size_t prev = ch->last[j];
+            ch->ok = sd_count(sd, fenwick_sum(sd->tree, t - 1) - fenwick_sum(sd->tree, prev), 1);
+            fenwick_add(sd->tree, sd->cap, prev, -1);
+        }
+        ch->last[j] = (unsigned int)t;
+        fenwick_add(sd->tree, sd->cap, t, 1);
+    }
+    // only the histogram is needed from here on
+    id_map_free(&map);
+    free(sd->tree);
+    sd->tree = NULL;
+    return NULL;
+}
+
+// Fold one chunk into the global state in sd. last[id] is the (global) time
+// of each block's last access so far, 0 if none.
+static bool sd_merge_chunk(stackdist_t *sd, unsigned long long *last, const sd_chunk_t *ch) {
+    for (size_t d = 0; d < ch->local.hist_len; ++d) {
+        if (ch->local.hist[d] && !sd_count(sd, d, ch->local.hist[d])) return false;
+    }
+    for (size_t j = 0; j < ch->nblk; ++j) {
+        size_t t = (size_t)(ch->start + ch->first[j]);
+        size_t prev = (size_t)last[ch->blk[j]];
+        if (prev == 0) {
+            sd->cold++;
+        } else {
+            if (!sd_count(sd, fenwick_sum(sd->tree, t - 1) - fenwick_sum(sd->tree, prev), 1)) return false;
+            fenwick_add(sd->tree, sd->cap, prev, -1);
+        }
+        last[ch->blk[j]] = t;
+        fenwick_add(sd->tree, sd->cap, t, 1);
+    }
+    for (size_t j = 0; j < ch->nblk; ++j) {
+        if (ch->last[j] == ch->first[j]) continue;
+        unsigned long long *l = &last[ch->blk[j]];
+        fenwick_add(sd->tree, sd->cap, (size_t)*l, -1);
+        *l = ch->start + ch->last[j];
+        fenwick_add(sd->tree, sd->cap, (size_t)*l, 1);
+    }
+    return true;
+}
+
+// Fill sd (fresh from sd_init) with the stack distances of the whole trace,
+// using up to `threads` threads.
+static bool sd_run_parallel(stackdist_t *sd, const block_ids_t *bi, size_t threads) {
+    size_t nchunks = threads < bi->n ? threads : bi->n;
+    if (nchunks == 0) return true;
+    while (bi->n / nchunks >= UINT_MAX) nchunks++;     // chunk times are 32-bit
+    sd_chunk_t *chunks = (sd_chunk_t*)calloc(nchunks, sizeof(sd_chunk_t));
+    unsigned long long *last = (unsigned long long*)calloc(bi->nids ? bi->nids : 1, sizeof(unsigned long long));
+    bool ok = chunks && last;
+
+    for (size_t k = 0; k < nchunks && ok; ++k) {
+        sd_chunk_t *ch = &chunks[k];
+        ch->start = bi->n * k / nchunks;
+        ch->n = bi->n * (k + 1) / nchunks - ch->start;
+        ch->ids = bi->ids + ch->start;
+    }
+    if (ok) run_threads(sd_chunk_worker, chunks, sizeof(sd_chunk_t), nchunks);
+
+    while (ok && sd->cap < bi->n) ok = sd_grow_tree(sd);
+    for (size_t k = 0; k < nchunks && ok; ++k) ok = chunks[k].ok && sd_merge_chunk(sd, last, &chunks[k]);
+    sd->now = bi->n;
+    sd->blocks = bi->nids;
+
+    for (size_t k = 0; chunks && k < nchunks; ++k) {
+        sd_free(&chunks[k].local);
+        free(chunks[k].blk);
+        free(chunks[k].first);
+        free(chunks[k].last);
+    }
+    free(chunks);
+    free(last);
+    return ok;
+}
+
+// ---- Counter stacks (approximate MRC) ----
+//
+// The exact engine above needs a hash entry per block, which doesn't fit for
+// traces with billions of different blocks. Counter stacks (Wires et al.,
+// OSDI 2014) only keep a few cardinality counters instead: every INTERVAL
+// accesses a new counter starts, and every counter counts the different blocks
+// seen since it started. At the end of each interval, let d_i be how much
+// counter i grew during it (counter 0 started with the trace). Blocks that
+// made counter i+1 grow but not the older counter i were last used between the
+// starts of the two counters, so their stack distance lies between counter
+// i+1's value before the interval and counter i's value now. Counter 0's growth
+// are first accesses. Repeats inside the interval get their exact distance
+// from a stackdist_t that only ever holds one interval. Adding each group at
+// both ends gives a low and a high miss-ratio curve. With exact counters the
+// exact curve would always lie between them.
+//
+// The counters are HyperLogLog sketches (1 << CS_HLL_BITS one-byte registers),
+// which are off by about 1.04 / sqrt(registers) (1.6%). The distances and the
+// number of first accesses are widened by three times that, which makes the
+// two curves a confidence band, not a guarantee: the exact curve can fall
+// outside it wherever a sketch is off by more (strided traces do this now and
+// then). Longer intervals make the sketches' noise smaller next to how much
+// they grow per interval. A newer counter whose value has come within PRUNE
+// of the next older one is dropped, so only O(log(footprint) / PRUNE)
+// counters are kept, and the distances are kept in power-of-two buckets,
+// which is all the power-of-two cache sizes that are printed need.
+
+#define CS_HLL_BITS 12
+#define CS_HLL_SIZE (1u << CS_HLL_BITS)
+#define CS_DEFAULT_INTERVAL 4096
+#define CS_DEFAULT_PRUNE 0.02
+#define CS_BUCKETS 66   // distance 0, then [2^k, 2^(k+1)) for k = 0..63, then first accesses
+
+typedef struct {
+    unsigned char *reg;     // HyperLogLog registers
+    double before;          // estimate at the end of the last interval
+    double now;             // estimate at the end of this interval
+} cs_counter_t;
+
+typedef struct {
+    cs_counter_t *counters; // oldest first; counters[0] started with the trace
+    size_t n, cap;
+    unsigned long long interval;
+    double prune;
+    unsigned long long in_interval; // accesses since the last checkpoint
+    unsigned long long accesses;
+    double lo[CS_BUCKETS];  // accesses at the smallest possible distance
+    double hi[CS_BUCKETS];  // accesses at the largest possible distance
+    size_t peak;            // most counters alive at once
+    stackdist_t local;      // exact distances within the current interval
+} cstack_t;
+
+static double hll_estimate(const unsigned char *reg) {
+    double m = (double)CS_HLL_SIZE, sum = 0.0;
+    unsigned zeros = 0;
+    for (unsigned j = 0; j < CS_HLL_SIZE; ++j) {
+        sum += ldexp(1.0, -(int)reg[j]);
+        zeros += reg[j] == 0;
+    }
+    double e = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0) e = m * log(m / (double)zeros);  // small counts: linear counting
+    return e;
+}
+
+// Bucket of a (possibly fractional) distance.
+static size_t cs_bucket(double d) {
+    if (d < 1.0) return 0;
+    if (d >= 18446744073709551615.0) return CS_BUCKETS - 2;
+    return 1 + (size_t)(63 - __builtin_clzll((unsigned long long)d));
+}
+
+static void cs_free(cstack_t *cs) {
+    for (size_t i = 0; i < cs->n; ++i) free(cs->counters[i].reg);
+    free(cs->counters);
+    sd_free(&cs->local);
+    memset(cs, 0, sizeof(*cs));
+}
+
+// Start a new (empty) counter. Returns false if we ran out of memory.
+static bool cs_push(cstack_t *cs) {
+    if (cs->n == cs->cap) {
+        size_t cap = cs->cap ? 2 * cs->cap : 16;
+        cs_counter_t *c = (cs_counter_t*)realloc(cs->counters, cap * sizeof(cs_counter_t));
+        if (!c) return false;
+        cs->counters = c;
+        cs->cap = cap;
+    }
+    cs_counter_t *c = &cs->counters[cs->n];
+    c->reg = (unsigned char*)calloc(CS_HLL_SIZE, 1);
+    if (!c->reg) return false;
+    c->before = c->now = 0.0;
+    cs->n++;
+    if (cs->n > cs->peak) cs->peak = cs->n;
+    return true;
+}
+
+static bool cs_init(cstack_t *cs, unsigned long long interval, double prune) {
+    memset(cs, 0, sizeof(*cs));
+    cs->interval = interval;
+    cs->prune = prune;
+    if (!sd_init(&cs->local) || !cs_push(cs)) {
+        cs_free(cs);
+        return false;
+    }
+    return true;
+}
+
+#define CS_ERR (3.0 * 1.04 / 64.0)   // three standard errors with 1 << 12 registers
+
+static void cs_add(cstack_t *cs, double d_lo, double d_hi, double count) {
+    if (count <= 0.0) return;
+    cs->lo[cs_bucket(d_lo * (1.0 - CS_ERR))] += count;
+    cs->hi[cs_bucket(d_hi * (1.0 + CS_ERR))] += count;
+}
+
+// Close an interval: turn how much each counter grew into distance ranges,
+// drop counters that caught up with their older neighbour, and start a new one.
+static bool cs_checkpoint(cstack_t *cs) {
+    if (cs->in_interval == 0) return true;
+    cs_counter_t *c = cs->counters;
+    size_t last = cs->n - 1;
+    for (size_t i = 0; i < last; ++i) c[i].now = hll_estimate(c[i].reg);
+    // the newest counter started with this interval, so it is known exactly
+    c[last].now = (double)cs->local.blocks;
+
+    // an older counter can't grow more than a newer one (it has seen
+    // everything the newer one has) or less than nothing; clamping the
+    // sketch's noise this way keeps every group's count at 0 or more and
+    // makes them add up to the accesses of the interval
+    for (size_t i = last; i-- > 0;) {
+        double grow = c[i].now - c[i].before;
+        double newer = c[i + 1].now - c[i + 1].before;
+        if (grow > newer) grow = newer;
+        if (grow < 0.0) grow = 0.0;
+        c[i].now = c[i].before + grow;
+    }
+
+    double grow_prev = c[0].now - c[0].before;
+    // first accesses, give or take the sketch's error
+    cs->lo[CS_BUCKETS - 1] += grow_prev * (1.0 - CS_ERR);
+    cs->hi[CS_BUCKETS - 1] += grow_prev * (1.0 + CS_ERR);
+    for (size_t i = 0; i < last; ++i) {
+        double grow = c[i + 1].now - c[i + 1].before;
+        cs_add(cs, c[i + 1].before, c[i].now, grow - grow_prev);
+        grow_prev = grow;
+    }
+    // repeats within the interval, exactly
+    for (size_t d = 0; d < cs->local.hist_len; ++d) {
+        if (cs->local.hist[d] == 0) continue;
+        cs->lo[cs_bucket((double)d)] += (double)cs->local.hist[d];
+        cs->hi[cs_bucket((double)d)] += (double)cs->local.hist[d];
+    }
+    sd_reset(&cs->local);
+
+    // drop counters that are within `prune` of their older neighbour
+    size_t kept = 1;
+    for (size_t i = 1; i < cs->n; ++i) {
+        if (c[i].now >= (1.0 - cs->prune) * c[kept - 1].now && i < last) {
+            free(c[i].reg);
+            continue;
+        }
+        c[kept++] = c[i];
+    }
+    cs->n = kept;
+    for (size_t i = 0; i < cs->n; ++i) c[i].before = c[i].now;
+    cs->in_interval = 0;
+    return cs_push(cs);
+}
+
+static bool cs_access(cstack_t *cs, unsigned long long block) {
+    unsigned long long h = hash_block(block);
+    unsigned idx = (unsigned)(h >> (64 - CS_HLL_BITS));
+    unsigned long long w = h << CS_HLL_BITS;
+    unsigned char rank = (unsigned char)(w ? __builtin_clzll(w) + 1 : 64 - CS_HLL_BITS + 1);
+    // older counters have seen everything newer ones have, so their registers
+    // are at least as big: walk from the newest and stop at the first one
+    // that already has this rank
+    for (size_t i = cs->n; i-- > 0;) {
+        unsigned char *r = &cs->counters[i].reg[idx];
+        if (*r >= rank) break;
+        *r = rank;
+    }
+    if (!sd_access(&cs->local, block)) return false;
+    cs->accesses++;
+    if (++cs->in_interval == cs->interval) return cs_checkpoint(cs);
+    return true;
+}
+
+// Low or high end of the band on the misses of a fully associative LRU cache
+// with `lines` lines (a power of two).
+static double cs_misses(const cstack_t *cs, size_t lines, bool upper) {
+    const double *h = upper ? cs->hi : cs->lo;
+    double misses = 0.0;
+    for (size_t b = cs_bucket((double)lines); b < CS_BUCKETS; ++b) misses += h[b];
+    return misses;
+}
+
+// Most values a comma separated list on the command line can hold.
+#define MAX_LIST 64
+
+// Parse a comma separated list of numbers like "8192,16384,32768".
+// Returns how many were read, or 0 if something was wrong.
+static size_t parse_list(const char *s, unsigned long long *out, size_t max) {
+    size_t n = 0;
+    while (*s) {
+        char *end;
+        unsigned long long v = strtoull(s, &end, 10);
+        if (end == s || n == max) return 0;
+        out[n++] = v;
+        if (*end == ',') end++;
+        else if (*end) return 0;
+        s = end;
+    }
+    return n;
+}
+
+// Most levels a cache hierarchy (--next) can have, counting the first one.
+#define HIER_MAX 8
+
+// How accesses from several traces are interleaved into one shared cache.
+enum { MIX_NONE, MIX_RR, MIX_WEIGHTED, MIX_TIME };
+
+// How the ways of a shared cache are split between sources.
+enum { PART_NONE, PART_STATIC, PART_UCP };
+
+// What --solve looks for.
+enum { SOLVE_NONE, SOLVE_MISS, SOLVE_TRAFFIC };
+
+// Options that can be added anywhere on the command line as --name or --name=value.
+typedef struct {
+    size_t hot_k;           // track this many hot blocks (0 = off)
+    bool rle;               // collapse runs of accesses to the same block
+    const char *encode_path;// write the trace as a binary trace here and stop
+    const char *filter_path;// write the cache's miss/write-back stream here
+
+    // sharing one cache between several traces (see run_mix)
+    int mix;                // MIX_NONE, MIX_RR, MIX_WEIGHTED or MIX_TIME
+    unsigned long long quantum;   // accesses per turn for MIX_RR
+    unsigned long long weights[MAX_SOURCES]; // for MIX_WEIGHTED
+    size_t nweights;
+    unsigned long long interval;  // take an occupancy sample this often
+
+    // way partitioning of the shared cache (see part_t)
+    int partition;          // PART_NONE, PART_STATIC or PART_UCP
+    unsigned long long part_ways[MAX_SOURCES]; // for PART_STATIC
+    size_t npart_ways;
+
+    bool flush_on_switch;   // flush the cache whenever the running trace changes
+
+    size_t jobs;            // threads for several traces, --mrc or parsing text with --io=mmap/uring
+                            // (0 = one per CPU)
+    bool fork;              // run each sweep configuration in its own process
+    int io;                 // how text traces are read: IO_URING, IO_MMAP or IO_STDIO
+    bool direct;            // ... with O_DIRECT (io_uring only)
+    bool io_stats;          // report how fast the trace was read
+
+    // energy and area estimates (see energy_estimate)
+    bool energy;
+    double dram_read_nj;    // per block read from memory
+    double dram_write_nj;   // per write sent to memory
+
+    int solve;              // SOLVE_NONE, SOLVE_MISS or SOLVE_TRAFFIC
+    double solve_target;    // miss ratio or blocks of memory traffic to reach
+    bool mrc;               // print the fully associative LRU miss-ratio curve
+    bool mrc_approx;        // ... using counter stacks
+    unsigned long long cs_interval; // accesses between counter stack checkpoints
+    double cs_prune;        // drop counters within this fraction of their neighbour
+
+    bool dse;               // explore the configurations instead of running them all
+    double dse_tol;         // miss ratio drop below which --dse stops refining
+
+    bool verify;            // check the fast engines against cache_access
+    bool state_hash;        // print the hash of the final cache state
+    size_t rec_events;      // flight recorder size (0 = off)
+    const char *rec_path;   // where the flight recorder is dumped (NULL = stderr)
+    const char *serve_path; // run as a daemon on this Unix socket
+    const char *client_path;// send the run to the daemon on this socket
+    unsigned long long verify_every; // accesses between state checks
+    config_t next[HIER_MAX - 1]; // levels below the cache (--next), from the top down
+    size_t nnext;
+    bool inclusive;         // each level below holds everything above it
+    bool split;             // the first level is split (--icache) ...
+    config_t icache;        // ... and this is its instruction cache
+} options_t;
+
+#define DEFAULT_DRAM_READ_NJ 10.2
+#define DEFAULT_DRAM_WRITE_NJ 10.6
+#define DSE_DEFAULT_TOL 0.005
+#define VERIFY_EVERY 16384      // default accesses between --verify state checks
+#define REC_DEFAULT 4096        // default flight recorder size (events)
+#define REC_MAX (1 << 26)
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <CACHE_SIZE> <ASSOC> <REPLACEMENT> <WB> <TRACE_FILE>...\n", prog);
+    fprintf(stderr, "       %s --mix=SCHED [options] <CACHE_SIZE> <ASSOC> <REPLACEMENT> <WB> <TRACE_FILE>...\n", prog);
+    fprintf(stderr, "       %s --encode=<OUT_FILE> <TRACE_FILE>\n", prog);
+    fprintf(stderr, "       %s --mrc <TRACE_FILE>\n", prog);
+    fprintf(stderr, "       %s --serve=SOCKET [--jobs=N] [--rle]\n", prog);
+    fprintf(stderr, "       %s --client=SOCKET [<CACHE_SIZE> <ASSOC> <REPLACEMENT> <WB> <TRACE_FILE>...]\n", prog);
+    fprintf(stderr, "Any of the four numbers may be a comma separated list (e.g. 8192,16384) to sweep\n");
+    fprintf(stderr, "every combination; all of them are simulated in one pass over the trace and a CSV is printed.\n");
+    fprintf(stderr, "Several TRACE_FILEs (or quoted wildcards like 'traces/*.t') are simulated in parallel,\n");
+    fprintf(stderr, "each with its own cache, and printed as a CSV with TOTAL, MEAN and GEOMEAN rows.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --hot[=K]      report the K most accessed and most missed blocks (default K=16),\n");
+    fprintf(stderr, "                 counted in sketches of %d*K entries\n", HOT_COUNTERS);
+    fprintf(stderr, "  --rle          collapse back-to-back accesses to the same block before simulating\n");
+    fprintf(stderr, "  --encode=FILE  convert the trace to a binary trace of stride runs (read back automatically)\n");
+    fprintf(stderr, "  --filter=FILE  also write the stream this cache sends to memory (misses and write-backs)\n");
+    fprintf(stderr, "                 as a binary trace, to replay lower-level caches without this one\n");
+    fprintf(stderr, "  --next=SIZE,ASSOC,REPLACEMENT,WB  add a cache level below the last one: it sees\n");
+    fprintf(stderr, "                 that level's misses and write-backs (repeat for up to %d levels);\n",
+            HIER_MAX);
+    fprintf(stderr, "                 with --jobs above 1 each level runs on its own thread\n");
+    fprintf(stderr, "  --icache=SIZE,ASSOC,REPLACEMENT  split the first level: instruction fetches (I in\n");
+    fprintf(stderr, "                 the trace) go to this cache, reads and writes to the one given by\n");
+    fprintf(stderr, "                 the four numbers, and both send their misses to the first --next\n");
+    fprintf(stderr, "                 level; the two sides are reported separately\n");
+    fprintf(stderr, "  --inclusive    with --next, a level that evicts a block takes it out of the levels\n");
+    fprintf(stderr, "                 above too (a dirty copy there is written back with it); levels only\n");
+    fprintf(stderr, "                 get their own threads with an explicit --jobs, since each miss then\n");
+    fprintf(stderr, "                 waits for the levels below\n");
+    fprintf(stderr, "  --jobs=N       threads for several traces, --mrc, parsing a text trace (with\n");
+    fprintf(stderr, "                 --io=mmap or uring) or the levels of --next (default: one per CPU)\n");
+    fprintf(stderr, "  --fork[=N]     run each configuration of a sweep in its own process, N at a time\n");
+    fprintf(stderr, "                 (default --jobs), so a crashing configuration is only reported;\n");
+    fprintf(stderr, "                 takes a single trace\n");
+    fprintf(stderr, "  --io=MODE      how text traces are read: stdio (line by line, the default), mmap\n");
+    fprintf(stderr, "                 (mapped and parsed on --jobs threads) or uring (the same with several\n");
+    fprintf(stderr, "                 reads in flight; falls back to mmap)\n");
+    fprintf(stderr, "  --direct       with --io=uring, read around the page cache (O_DIRECT)\n");
+    fprintf(stderr, "  --io-stats     report how fast the trace was read\n");
+    fprintf(stderr, "  --mix=SCHED    run several TRACE_FILEs through one shared cache; SCHED is rr[:N]\n");
+    fprintf(stderr, "                 (N accesses per turn), weighted:W1,W2,... or time (third trace\n");
+    fprintf(stderr, "                 column, or position in the trace, decides the order)\n");
+    fprintf(stderr, "  --interval=N   with --mix, sample each trace's cache occupancy every N accesses\n");
+    fprintf(stderr, "  --timeslice=N  same as --mix=rr:N: switch traces every N accesses\n");
+    fprintf(stderr, "  --switch=MODE  with --mix, what a switch between traces does to the cache: asid (lines\n");
+    fprintf(stderr, "                 are tagged per trace and survive, the default) or flush (write back and\n");
+    fprintf(stderr, "                 invalidate everything)\n");
+    fprintf(stderr, "  --partition=W1,W2,...  with --mix, give each trace its own ways to fill (like Intel CAT)\n");
+    fprintf(stderr, "  --partition=ucp        with --mix, re-split the ways every --interval accesses using\n");
+    fprintf(stderr, "                         utility monitors (UCP)\n");
+    fprintf(stderr, "  --dse[=TOL]    explore the sizes of each assoc/replacement/wb combination, only\n");
+    fprintf(stderr, "                 splitting size ranges whose miss ratio drops by more than TOL\n");
+    fprintf(stderr, "                 (default %g), and mark the Pareto front of size, miss ratio and\n",
+            DSE_DEFAULT_TOL);
+    fprintf(stderr, "                 energy; two sizes MIN,MAX mean every power of two in between\n");
+    fprintf(stderr, "  --solve=miss:R        find the smallest size (same MIN,MAX or list as --dse) reaching\n");
+    fprintf(stderr, "  --solve=traffic:N     miss ratio R, or at most N blocks read from plus written to\n");
+    fprintf(stderr, "                        memory, for every assoc/replacement/wb combination\n");
+    fprintf(stderr, "  --mrc          print the fully associative LRU miss-ratio curve of the trace (needs\n");
+    fprintf(stderr, "                 only the trace: %s --mrc <TRACE_FILE>)\n", prog);
+    fprintf(stderr, "  --mrc=cs[:INTERVAL[:PRUNE]]  same, estimated with counter stacks in little memory,\n");
+    fprintf(stderr, "                 with a low and high confidence band of about three standard errors\n");
+    fprintf(stderr, "                 (not a guaranteed bound; default %d accesses per checkpoint,\n",
+            CS_DEFAULT_INTERVAL);
+    fprintf(stderr, "                 counters pruned within %g of each other)\n", CS_DEFAULT_PRUNE);
+    fprintf(stderr, "  --verify[=N]   check that every fast engine gives the same statistics and cache state\n");
+    fprintf(stderr, "                 as plain cache_access, every N accesses (default %d), on synthetic\n",
+            VERIFY_EVERY);
+    fprintf(stderr, "                 traces and any TRACE_FILEs; a disagreement is shrunk to a small\n");
+    fprintf(stderr, "                 trace written to verify-<engine>-<config>.t\n");
+    fprintf(stderr, "  --record[=N]   keep the last N cache events (default %d) in a flight recorder and\n",
+            REC_DEFAULT);
+    fprintf(stderr, "                 print them at the end of the run, or whenever the process gets SIGUSR1\n");
+    fprintf(stderr, "  --record-file=FILE  write the flight recorder to FILE instead of stderr\n");
+    fprintf(stderr, "  --state-hash   also print a hash of the final cache contents (tags, dirty bits and\n");
+    fprintf(stderr, "                 replacement order), equal between runs that end in the same state\n");
+    fprintf(stderr, "  --serve=SOCKET stay up as a daemon on a Unix socket, keeping every trace it is asked\n");
+    fprintf(stderr, "                 about in memory and running each configuration on one of --jobs\n");
+    fprintf(stderr, "                 worker threads; requests are lines like SIM 8192,16384 4 0 1 TRACE,\n");
+    fprintf(stderr, "                 LOAD TRACE, TRACES, QUIT or SHUTDOWN\n");
+    fprintf(stderr, "  --client=SOCKET  ask the daemon for the run and print its CSV; with no other\n");
+    fprintf(stderr, "                 arguments, send request lines from stdin and print the answers\n");
+    fprintf(stderr, "  --energy       also estimate energy (cache dynamic + leakage + memory) and cache area\n");
+    fprintf(stderr, "  --dram-energy=R,W  nJ per memory read and write for --energy (default %.1f,%.1f)\n",
+            DEFAULT_DRAM_READ_NJ, DEFAULT_DRAM_WRITE_NJ);
+}
+
+// Pull the --options out of argv. Everything else is copied to pos[] in order.
+// Returns false if an option is not recognized or has a bad value.
+static bool parse_options(int argc, char **argv, options_t *opt, char **pos, int *npos) {
+    memset(opt, 0, sizeof(*opt));
+    opt->dram_read_nj = DEFAULT_DRAM_READ_NJ;
+    opt->dram_write_nj = DEFAULT_DRAM_WRITE_NJ;
+    opt->cs_interval = CS_DEFAULT_INTERVAL;
+    opt->cs_prune = CS_DEFAULT_PRUNE;
+    opt->verify_every = VERIFY_EVERY;
+    opt->io = IO_STDIO;
+    *npos = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        if (strncmp(a, "--", 2) != 0) {
+            pos[(*npos)++] = argv[i];
+            continue;
+        }
+        const char *val = strchr(a, '=');
+        val = val ? val + 1 : NULL;
+
+        if (strcmp(a, "--hot") == 0 || strncmp(a, "--hot=", 6) == 0) {
+            opt->hot_k = val ? strtoull(val, NULL, 10) : 16;
+            if (opt->hot_k == 0) {
+                fprintf(stderr, "--hot needs a positive number of blocks.\n");
+                return false;
+            }
+        } else if (strcmp(a, "--rle") == 0) {
+            opt->rle = true;
+        } else if (strcmp(a, "--state-hash") == 0) {
+            opt->state_hash = true;
+        } else if (strcmp(a, "--record") == 0 || strncmp(a, "--record=", 9) == 0) {
+            opt->rec_events = val ? strtoull(val, NULL, 10) : REC_DEFAULT;
+            if (opt->rec_events == 0 || opt->rec_events > REC_MAX) {
+                fprintf(stderr, "--record needs between 1 and %d events.\n", REC_MAX);
+                return false;
+            }
+        } else if (strncmp(a, "--serve=", 8) == 0 && val[0]) {
+            opt->serve_path = val;
+        } else if (strncmp(a, "--client=", 9) == 0 && val[0]) {
+            opt->client_path = val;
+        } else if (strncmp(a, "--record-file=", 14) == 0 && val[0]) {
+            opt->rec_path = val;
+            if (opt->rec_events == 0) opt->rec_events = REC_DEFAULT;
+        } else if (strncmp(a, "--next=", 7) == 0) {
+            unsigned long long v[4];
+            config_t *lv = &opt->next[opt->nnext];
+            if (opt->nnext == HIER_MAX - 1 || parse_list(val, v, 4) != 4) {
+                fprintf(stderr, "--next needs SIZE,ASSOC,REPLACEMENT,WB (at most %d times).\n", HIER_MAX - 1);
+                return false;
+            }
+            lv->cache_size = (size_t)v[0];
+            lv->assoc = (size_t)v[1];
+            lv->replacement = (int)v[2];
+            lv->writeback = (int)v[3];
+            if (!config_valid(lv) || v[2] > 1 || v[3] > 1) {
+                fprintf(stderr, "Invalid cache in --next=%s.\n", val);
+                return false;
+            }
+            opt->nnext++;
+        } else if (strncmp(a, "--icache=", 9) == 0) {
+            unsigned long long v[3];
+            if (parse_list(val, v, 3) != 3) {
+                fprintf(stderr, "--icache needs SIZE,ASSOC,REPLACEMENT.\n");
+                return false;
+            }
+            opt->icache.cache_size = (size_t)v[0];
+            opt->icache.assoc = (size_t)v[1];
+            opt->icache.replacement = (int)v[2];
+            opt->icache.writeback = 0;
+            if (!config_valid(&opt->icache) || v[2] > 1) {
+                fprintf(stderr, "Invalid cache in --icache=%s.\n", val);
+                return false;
+            }
+            opt->split = true;
+        } else if (strcmp(a, "--inclusive") == 0) {
+            opt->inclusive = true;
+        } else if (strncmp(a, "--encode=", 9) == 0 && val[0]) {
+            opt->encode_path = val;
+        } else if (strncmp(a, "--filter=", 9) == 0 && val[0]) {
+            opt->filter_path = val;
+        } else if (strcmp(a, "--mix=rr") == 0 || strncmp(a, "--mix=rr:", 9) == 0) {
+            opt->mix = MIX_RR;
+            opt->quantum = a[8] ? strtoull(a + 9, NULL, 10) : 1;
+            if (opt->quantum == 0) {
+                fprintf(stderr, "--mix=rr:N needs N > 0.\n");
+                return false;
+            }
+        } else if (strncmp(a, "--mix=weighted:", 15) == 0) {
+            opt->mix = MIX_WEIGHTED;
+            opt->nweights = parse_list(a + 15, opt->weights, MAX_SOURCES);
+            for (size_t k = 0; k < opt->nweights; ++k) {
+                if (opt->weights[k] == 0) opt->nweights = 0;
+            }
+            if (opt->nweights == 0) {
+                fprintf(stderr, "--mix=weighted needs a list of positive weights.\n");
+                return false;
+            }
+        } else if (strcmp(a, "--mix=time") == 0) {
+            opt->mix = MIX_TIME;
+        } else if (strncmp(a, "--interval=", 11) == 0) {
+            opt->interval = strtoull(val, NULL, 10);
+        } else if (strncmp(a, "--timeslice=", 12) == 0) {
+            opt->mix = MIX_RR;
+            opt->quantum = strtoull(val, NULL, 10);
+            if (opt->quantum == 0) {
+                fprintf(stderr, "--timeslice needs a positive number of accesses.\n");
+                return false;
+            }
+        } else if (strcmp(a, "--fork") == 0 || strncmp(a, "--fork=", 7) == 0) {
+            opt->fork = true;
+            if (val) opt->jobs = strtoull(val, NULL, 10);
+        } else if (strncmp(a, "--jobs=", 7) == 0) {
+            opt->jobs = strtoull(val, NULL, 10);
+        } else if (strcmp(a, "--io=uring") == 0) {
+            opt->io = IO_URING;
+        } else if (strcmp(a, "--io=mmap") == 0) {
+            opt->io = IO_MMAP;
+        } else if (strcmp(a, "--io=stdio") == 0) {
+            opt->io = IO_STDIO;
+        } else if (strcmp(a, "--direct") == 0) {
+            opt->direct = true;
+        } else if (strcmp(a, "--io-stats") == 0) {
+            opt->io_stats = true;
+        } else if (strcmp(a, "--verify") == 0 || strncmp(a, "--verify=", 9) == 0) {
+            opt->verify = true;
+            if (val) opt->verify_every = strtoull(val, NULL, 10);
+            if (opt->verify_every == 0) {
+                fprintf(stderr, "--verify=N needs N > 0.\n");
+                return false;
+            }
+        } else if (strcmp(a, "--switch=flush") == 0) {
+            opt->flush_on_switch = true;
+        } else if (strcmp(a, "--switch=asid") == 0) {
+            opt->flush_on_switch = false;
+        } else if (strcmp(a, "--partition=ucp") == 0) {
+            opt->partition = PART_UCP;
+        } else if (strncmp(a, "--partition=", 12) == 0) {
+            opt->partition = PART_STATIC;
+            opt->npart_ways = parse_list(val, opt->part_ways, MAX_SOURCES);
+            for (size_t k = 0; k < opt->npart_ways; ++k) {
+                if (opt->part_ways[k] == 0) opt->npart_ways = 0;
+            }
+            if (opt->npart_ways == 0) {
+                fprintf(stderr, "--partition needs ucp or a list of positive way counts.\n");
+                return false;
+            }
+        } else if (strcmp(a, "--dse") == 0 || strncmp(a, "--dse=", 6) == 0) {
+            opt->dse = true;
+            opt->dse_tol = val ? strtod(val, NULL) : DSE_DEFAULT_TOL;
+            if (opt->dse_tol < 0.0) {
+                fprintf(stderr, "--dse needs a tolerance of 0 or more.\n");
+                return false;
+            }
+        } else if (strncmp(a, "--solve=miss:", 13) == 0 || strncmp(a, "--solve=traffic:", 16) == 0) {
+            opt->solve = a[8] == 'm' ? SOLVE_MISS : SOLVE_TRAFFIC;
+            char *end;
+            opt->solve_target = strtod(strchr(val, ':') + 1, &end);
+            if (*end || end == strchr(val, ':') + 1 || opt->solve_target < 0.0) {
+                fprintf(stderr, "--solve needs miss:RATIO or traffic:BLOCKS.\n");
+                return false;
+            }
+        } else if (strcmp(a, "--mrc") == 0) {
+            opt->mrc = true;
+        } else if (strcmp(a, "--mrc=cs") == 0 || strncmp(a, "--mrc=cs:", 9) == 0) {
+            opt->mrc = true;
+            opt->mrc_approx = true;
+            if (a[8] == ':') {
+                char *end;
+                opt->cs_interval = strtoull(a + 9, &end, 10);
+                if (*end == ':') opt->cs_prune = strtod(end + 1, &end);
+                if (*end || opt->cs_interval == 0 || opt->cs_prune < 0.0 || opt->cs_prune >= 1.0) {
+                    fprintf(stderr, "--mrc=cs:INTERVAL[:PRUNE] needs INTERVAL > 0 and 0 <= PRUNE < 1.\n");
+                    return false;
+                }
+            }
+        } else if (strcmp(a, "--energy") == 0) {
+            opt->energy = true;
+        } else if (strncmp(a, "--dram-energy=", 14) == 0) {
+            char *end;
+            opt->dram_read_nj = strtod(val, &end);
+            if (*end != ',' || opt->dram_read_nj < 0.0) {
+                fprintf(stderr, "--dram-energy needs two numbers: nJ per read,nJ per write.\n");
+                return false;
+            }
+            opt->dram_write_nj = strtod(end + 1, &end);
+            if (*end || opt->dram_write_nj < 0.0) {
+                fprintf(stderr, "--dram-energy needs two numbers: nJ per read,nJ per write.\n");
+                return false;
+            }
+            opt->energy = true;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", a);
+            return false;
+        }
+    }
+    return true;
+}
+
+// What one configuration did on one trace.
+typedef struct {
+    bool valid;             // false if the configuration couldn't be built
+    unsigned long long accesses;
+    unsigned long long writes;
+    unsigned long long misses;
+    unsigned long long mem_reads;
+    unsigned long long mem_writes;
+} sim_result_t;
+
+static double result_miss_ratio(const sim_result_t *res) {
+    return res->accesses ? (double)res->misses / (double)res->accesses : 0.0;
+}
+
+static void result_from_cache(sim_result_t *res, const cache_t *c) {
+    res->valid = true;
+    res->accesses = c->hits + c->misses;
+    res->writes = c->writes;
+    res->misses = c->misses;
+    res->mem_reads = c->mem_reads;
+    res->mem_writes = c->mem_writes;
+}
+
+// ---- Energy and area ----
+//
+// Per-access energy, leakage and area for 64B-line, 4-way SRAM caches of
+// different sizes, rounded from CACTI 6.5 runs at 32nm. Other sizes are
+// interpolated on a log-log scale and other associativities are scaled
+// (more ways = more tags and data read in parallel per access).
+typedef struct {
+    double kb;              // cache size in KB
+    double read_nj;         // energy per read access
+    double write_nj;        // energy per write access (also used for line fills)
+    double leak_mw_per_kb;  // leakage power per KB
+    double area_mm2;
+} cacti_row_t;
+
+static const cacti_row_t CACTI_TABLE[] = {
+    {    4, 0.0045, 0.0050, 0.225, 0.024 },
+    {    8, 0.0062, 0.0068, 0.213, 0.041 },
+    {   16, 0.0090, 0.0098, 0.200, 0.075 },
+    {   32, 0.0135, 0.0147, 0.191, 0.140 },
+    {   64, 0.0210, 0.0228, 0.184, 0.268 },
+    {  128, 0.0340, 0.0368, 0.179, 0.520 },
+    {  256, 0.0560, 0.0605, 0.174, 1.010 },
+    {  512, 0.0950, 0.1020, 0.170, 1.980 },
+    { 1024, 0.1650, 0.1780, 0.166, 3.900 },
+    { 2048, 0.2900, 0.3120, 0.163, 7.700 },
+    { 4096, 0.5200, 0.5580, 0.160, 15.20 },
+    { 8192, 0.9500, 1.0200, 0.157, 30.10 },
+};
+#define CACTI_ROWS (sizeof(CACTI_TABLE) / sizeof(CACTI_TABLE[0]))
+#define CACTI_ASSOC 4.0
+
+// How much each doubling (or halving) of the ways away from CACTI_ASSOC
+// changes dynamic energy, leakage and area.
+#define ASSOC_DYN_STEP  0.12
+#define ASSOC_LEAK_STEP 0.02
+#define ASSOC_AREA_STEP 0.04
+
+// Leakage is charged over an estimated run time: this long per access plus
+// this long again for every block read from memory.
+#define NS_PER_ACCESS 1.0
+#define DRAM_LATENCY_NS 60.0
+
+// The cost figures for one cache configuration.
+typedef struct {
+    double read_nj;
+    double write_nj;
+    double leak_mw;
+    double area_mm2;
+} cache_cost_t;
+
+// Interpolate y between table rows i and i+1 at size kb on a log-log scale
+// (rows 0/1 or the last two extend the ends of the table).
+static double cacti_interp(size_t i, double kb, double y0, double y1) {
+    double x0 = log(CACTI_TABLE[i].kb), x1 = log(CACTI_TABLE[i + 1].kb);
+    double t = (log(kb) - x0) / (x1 - x0);
+    return exp(log(y0) + t * (log(y1) - log(y0)));
+}
+
+static cache_cost_t cache_cost(size_t cache_size, size_t assoc) {
+    double kb = (double)cache_size / 1024.0;
+    size_t i = 0;
+    while (i + 2 < CACTI_ROWS && kb > CACTI_TABLE[i + 1].kb) i++;
+    const cacti_row_t *a = &CACTI_TABLE[i], *b = &CACTI_TABLE[i + 1];
+
+    cache_cost_t cc;
+    cc.read_nj = cacti_interp(i, kb, a->read_nj, b->read_nj);
+    cc.write_nj = cacti_interp(i, kb, a->write_nj, b->write_nj);
+    cc.leak_mw = cacti_interp(i, kb, a->leak_mw_per_kb, b->leak_mw_per_kb) * kb;
+    cc.area_mm2 = cacti_interp(i, kb, a->area_mm2, b->area_mm2);
+
+    double doublings = log2((double)assoc / CACTI_ASSOC);
+    double dyn = 1.0 + ASSOC_DYN_STEP * doublings;
+    double leak = 1.0 + ASSOC_LEAK_STEP * doublings;
+    double area = 1.0 + ASSOC_AREA_STEP * doublings;
+    cc.read_nj *= dyn > 0.5 ? dyn : 0.5;
+    cc.write_nj *= dyn > 0.5 ? dyn : 0.5;
+    cc.leak_mw *= leak > 0.5 ? leak : 0.5;
+    cc.area_mm2 *= area > 0.5 ? area : 0.5;
+    return cc;
+}
+
+// Where the energy of one run went.
+typedef struct {
+    double dynamic_nj;      // cache reads, writes and line fills
+    double leakage_nj;      // cache leakage over the estimated run time
+    double dram_nj;         // memory reads and writes
+    double total_nj;
+    double per_access_nj;
+    double area_mm2;
+} energy_t;
+
+static energy_t energy_estimate(const config_t *cfg, const sim_result_t *res, const options_t *opt) {
+    cache_cost_t cc = cache_cost(cfg->cache_size, cfg->assoc);
+    energy_t e;
+    unsigned long long reads = res->accesses - res->writes;
+    e.dynamic_nj = (double)reads * cc.read_nj + (double)(res->writes + res->mem_reads) * cc.write_nj;
+    double run_ns = (double)res->accesses * NS_PER_ACCESS + (double)res->mem_reads * DRAM_LATENCY_NS;
+    e.leakage_nj = cc.leak_mw * run_ns * 1e-3; // mW * ns = pJ
+    e.dram_nj = (double)res->mem_reads * opt->dram_read_nj + (double)res->mem_writes * opt->dram_write_nj;
+    e.total_nj = e.dynamic_nj + e.leakage_nj + e.dram_nj;
+    e.per_access_nj = res->accesses ? e.total_nj / (double)res->accesses : 0.0;
+    e.area_mm2 = cc.area_mm2;
+    return e;
+}
+
+// cache_t.lower hook that appends to a binary trace.
+static void filter_write(void *ctx, char op, unsigned long long addr) {
+    bt_write((bt_writer_t*)ctx, op, addr);
+}
+
+// How many threads (or processes) --jobs asks for (0 = one per CPU).
+static size_t job_count(const options_t *opt) {
+    if (opt->jobs > 0) return opt->jobs;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+// ---- Cache hierarchies (--next) ----
+//
+// The cache from the command line is the first level and every --next adds
+// one below the last. A level sees exactly what the level above sends to
+// memory: its misses (reads, or writes for a write-through write miss) and
+// its writes (write-backs, or every write for write-through). The last level
+// talks to memory. With --inclusive, a level that evicts a block takes it out
+// of every level above as well (a back-invalidation). With --icache the first
+// level is split in two: instruction fetches go to an instruction cache and
+// everything else to the data cache, and both send their misses to the same
+// second level.
+//
+// Run serially, a level's lower hook just calls cache_access on the next one.
+// Pipelined, every level below the first runs on its own thread and is fed by
+// the level above through a single-producer single-consumer queue, so the
+// first level, which sees every access, never waits for the others. Each
+// level still gets the same stream in the same order, so the results are the
+// same as the serial run's.
+//
+// Back-invalidations go the other way, and the level above has to act on one
+// before its next access, or it could hit a block that is already gone. So in
+// an inclusive pipeline a level waits after each message it sends down until
+// the level below answers 'A' (done). Before that the level below may send
+// 'I' (drop this block), which the level above answers with 'V' (addr 1 if
+// its copy was dirty, else 0). Both directions are queues, so every message
+// is seen in the order it was sent and the results still match the serial
+// run; the levels just no longer overlap much.
+
+#define HIER_QUEUE 4096         // messages a queue holds (a power of two)
+#define HIER_BATCH 64           // messages written before the other side is told
+#define HIER_SPINS 256          // checks before an idle side gives up its CPU
+
+typedef struct {
+    unsigned long long addr;
+    char op;                // down: 'R', 'W', 'V' or 'E' (end of the trace); up: 'I' or 'A'
+} hier_msg_t;
+
+// One direction between two levels. The producer and the consumer each keep
+// their own position and only look at the other side's shared counter when
+// they run out of room or messages, so they rarely touch the same cache line.
+typedef struct {
+    hier_msg_t ring[HIER_QUEUE];
+    unsigned long long tail __attribute__((aligned(64)));   // published by the producer
+    unsigned long long head __attribute__((aligned(64)));   // published by the consumer
+    unsigned long long p_tail __attribute__((aligned(64))); // producer: next slot to fill
+    unsigned long long p_head;                              // producer: head last seen
+    unsigned long long c_head __attribute__((aligned(64))); // consumer: next slot to read
+    unsigned long long c_tail;                              // consumer: tail last seen
+} hier_queue_t;
+
+// The two queues between a level and the one below it.
+typedef struct {
+    hier_queue_t down;
+    hier_queue_t up;
+} hier_link_t;
+
+typedef struct hier_level {
+    cache_t *cache;
+    cache_t *icache;        // first level only: the instruction cache of a split level (or NULL)
+    struct hier_level *up;  // the level above (NULL for the first)
+    hier_link_t *above;     // pipelined: the queues to the level above ...
+    hier_link_t *below;     // ... and below (NULL for the last level)
+    bool inclusive;
+    unsigned long long dropped;       // lines taken out by back-invalidations
+    unsigned long long dropped_dirty; // ... that were dirty
+    unsigned long long idropped;      // ... from icache (never dirty)
+    pthread_t thread;
+} hier_level_t;
+
+typedef struct {
+    hier_level_t levels[HIER_MAX];
+    size_t n;
+    bool pipelined;
+} hier_t;
+
+// Wait a little for the other side: spin for a while, then let it have the CPU.
+static inline void hq_pause(unsigned int *spins) {
+    if (++*spins > HIER_SPINS) sched_yield();
+}
+
+// Let the consumer see everything pushed so far.
+static inline void hq_flush(hier_queue_t *q) {
+    __atomic_store_n(&q->tail, q->p_tail, __ATOMIC_RELEASE);
+}
+
+static inline void hq_push(hier_queue_t *q, char op, unsigned long long addr) {
+    if (q->p_tail - q->p_head == HIER_QUEUE) {
+        hq_flush(q);
+        unsigned int spins = 0;
+        while (q->p_tail - (q->p_head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) == HIER_QUEUE)
+            hq_pause(&spins);
+    }
+    hier_msg_t *m = &q->ring[q->p_tail & (HIER_QUEUE - 1)];
+    m->addr = addr;
+    m->op = op;
+    if ((++q->p_tail & (HIER_BATCH - 1)) == 0) hq_flush(q);
+}
+
+static inline hier_msg_t hq_pop(hier_queue_t *q) {
+    if (q->c_head == q->c_tail) {
+        unsigned int spins = 0;
+        while ((q->c_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) == q->c_head) hq_pause(&spins);
+    }
+    hier_msg_t m = q->ring[q->c_head & (HIER_QUEUE - 1)];
+    // slots are handed back in batches too
+    if ((++q->c_head & (HIER_BATCH - 1)) == 0) __atomic_store_n(&q->head, q->c_head, __ATOMIC_RELEASE);
+    return m;
+}
+
+// A level below evicted a block: drop it here and in every level above this
+// one. Returns true if any of them held it dirty.
+static bool hier_drop(hier_level_t *lv, unsigned long long addr) {
+    bool dirty;
+    if (cache_invalidate(lv->cache, addr, &dirty)) {
+        lv->dropped++;
+        lv->dropped_dirty += dirty;
+    }
+    bool fetched;
+    if (lv->icache && cache_invalidate(lv->icache, addr, &fetched)) lv->idropped++;
+    if (lv->cache->inval && lv->cache->inval(lv->cache->inval_ctx, addr)) dirty = true;
+    return dirty;
+}
+
+// Serial lower hook: the next level handles the access right away.
+static void hier_serial_lower(void *ctx, char op, unsigned long long addr) {
+    cache_access(((hier_level_t*)ctx)->cache, op, addr);
+}
+
+// Serial inval hook: ctx is the evicting level.
+static bool hier_serial_inval(void *ctx, unsigned long long addr) {
+    return hier_drop(((hier_level_t*)ctx)->up, addr);
+}
+
+// Pipelined inclusive: wait for the level below to finish the last message,
+// answering its back-invalidations meanwhile.
+static void hier_wait_done(hier_level_t *lv) {
+    for (;;) {
+        hier_msg_t m = hq_pop(&lv->below->up);
+        if (m.op == 'A') return;
+        bool dirty = hier_drop(lv, m.addr);
+        hq_push(&lv->below->down, 'V', dirty);
+        hq_flush(&lv->below->down);
+    }
+}
+
+// Pipelined lower hook: ctx is the sending level.
+static void hier_pipe_lower(void *ctx, char op, unsigned long long addr) {
+    hier_level_t *lv = (hier_level_t*)ctx;
+    hq_push(&lv->below->down, op, addr);
+    if (lv->inclusive) {
+        hq_flush(&lv->below->down);
+        hier_wait_done(lv);
+    }
+}
+
+// Pipelined inval hook: ctx is the evicting level. The level above is waiting
+// in hier_wait_done, so the next thing it sends down is the answer.
+static bool hier_pipe_inval(void *ctx, unsigned long long addr) {
+    hier_level_t *lv = (hier_level_t*)ctx;
+    hq_push(&lv->above->up, 'I', addr);
+    hq_flush(&lv->above->up);
+    hier_msg_t m = hq_pop(&lv->above->down);
+    return m.addr != 0;
+}
+
+// Thread of a pipelined level below the first.
+static void *hier_worker(void *arg) {
+    hier_level_t *lv = (hier_level_t*)arg;
+    for (;;) {
+        hier_msg_t m = hq_pop(&lv->above->down);
+        if (m.op == 'E') break;
+        cache_access(lv->cache, m.op, m.addr);
+        if (lv->inclusive) {
+            hq_push(&lv->above->up, 'A', 0);
+            hq_flush(&lv->above->up);
+        }
+    }
+    if (lv->below) {
+        hq_push(&lv->below->down, 'E', 0);
+        hq_flush(&lv->below->down);
+    }
+    return NULL;
+}
+
+// Point every level's hooks at the next one, serially or through the queues.
+static void hier_connect(hier_t *h, bool pipelined) {
+    h->pipelined = pipelined;
+    for (size_t k = 0; k < h->n; ++k) {
+        hier_level_t *lv = &h->levels[k];
+        if (k + 1 < h->n) {
+            lv->cache->lower = pipelined ? hier_pipe_lower : hier_serial_lower;
+            lv->cache->lower_ctx = pipelined ? (void*)lv : (void*)&h->levels[k + 1];
+            if (lv->icache) {
+                lv->icache->lower = lv->cache->lower;
+                lv->icache->lower_ctx = lv->cache->lower_ctx;
+            }
+        }
+        if (k > 0 && lv->inclusive) {
+            lv->cache->inval = pipelined ? hier_pipe_inval : hier_serial_inval;
+            lv->cache->inval_ctx = lv;
+        }
+    }
+}
+
+static void hier_free(hier_t *h) {
+    for (size_t k = 1; k < h->n; ++k) {
+        cache_destroy(h->levels[k].cache);
+        free(h->levels[k].above);
+    }
+}
+
+// Put the levels of opt->next under `top`, and `itop` next to it if the first
+// level is split (both stay the caller's). With more than one thread they are
+// pipelined, unless a thread can't be started. Returns false if we ran out of
+// memory.
+static bool hier_init(hier_t *h, cache_t *top, cache_t *itop, const options_t *opt, size_t threads) {
+    memset(h, 0, sizeof(*h));
+    h->n = 1 + opt->nnext;
+    h->levels[0].cache = top;
+    h->levels[0].icache = itop;
+    for (size_t k = 0; k < h->n; ++k) {
+        hier_level_t *lv = &h->levels[k];
+        lv->inclusive = opt->inclusive;
+        if (k == 0) continue;
+        const config_t *cfg = &opt->next[k - 1];
+        lv->up = &h->levels[k - 1];
+        lv->cache = cache_create(cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback);
+        lv->above = (hier_link_t*)aligned_alloc(64, sizeof(hier_link_t));
+        if (!lv->cache || !lv->above) {
+            h->n = k + 1;
+            hier_free(h);
+            return false;
+        }
+        memset(lv->above, 0, sizeof(hier_link_t));
+        lv->up->below = lv->above;
+    }
+    if (threads < 2 || h->n < 2) {
+        hier_connect(h, false);
+        return true;
+    }
+
+    hier_connect(h, true);
+    for (size_t k = 1; k < h->n; ++k) {
+        if (pthread_create(&h->levels[k].thread, NULL, hier_worker, &h->levels[k]) == 0) continue;
+        // stop the ones already running and go serial
+        hq_push(&h->levels[0].below->down, 'E', 0);
+        hq_flush(&h->levels[0].below->down);
+        for (size_t j = 1; j < k; ++j) pthread_join(h->levels[j].thread, NULL);
+        for (size_t j = 1; j < h->n; ++j) memset(h->levels[j].above, 0, sizeof(hier_link_t));
+        hier_connect(h, false);
+        break;
+    }
+    return true;
+}
+
+// The first level is done: let the rest drain and stop.
+static void hier_finish(hier_t *h) {
+    if (!h->pipelined) return;
+    hq_push(&h->levels[0].below->down, 'E', 0);
+    hq_flush(&h->levels[0].below->down);
+    for (size_t k = 1; k < h->n; ++k) pthread_join(h->levels[k].thread, NULL);
+}
+
+static void hier_print_cache(const char *name, const cache_t *c) {
+    unsigned long long total = c->hits + c->misses;
+    printf("%s %zu %zu-way %s %s: %llu accesses, miss ratio %f, write %llu, read %llu",
+           name, c->cache_size, c->assoc, c->replacement == 0 ? "LRU" : "FIFO",
+           c->writeback == 1 ? "WB" : "WT", total,
+           total > 0 ? (double)c->misses / (double)total : 0.0, c->mem_writes, c->mem_reads);
+}
+
+// One line per cache, below what run_single prints for the first level.
+static void hier_print(const hier_t *h) {
+    printf("\n");
+    for (size_t k = 0; k < h->n; ++k) {
+        const hier_level_t *lv = &h->levels[k];
+        bool drops = lv->inclusive && k + 1 < h->n;
+        char name[16];
+        snprintf(name, sizeof(name), "L%zu", k + 1);
+        if (lv->icache) {
+            hier_print_cache("L1I", lv->icache);
+            if (drops) printf(", %llu lines back-invalidated", lv->idropped);
+            printf("\n");
+            snprintf(name, sizeof(name), "L1D");
+        }
+        hier_print_cache(name, lv->cache);
+        if (drops) printf(", %llu lines back-invalidated (%llu dirty)", lv->dropped, lv->dropped_dirty);
+        printf("\n");
+    }
+}
+
+// Run the trace through a split first level: instruction fetches go to ic,
+// everything else to dc. Runs of one block aren't collapsed here, since a run
+// could mix the two sides; binary traces still go run by run.
+static bool simulate_split(cache_t *ic, cache_t *dc, reader_t *r) {
+    if (r->binary) {
+        stride_run_t s;
+        while (bt_read(r->fp, &r->prev, &s)) {
+            cache_access_stride(s.op == 'I' ? ic : dc, &s);
+            rec_poll(dc);
+        }
+        return true;
+    }
+
+    chunk_buf_t buf;
+    if (!chunk_buf_init(&buf, false)) { chunk_buf_free(&buf); return false; }
+    size_t n;
+    while ((n = reader_next(r, buf.addrs, buf.ops)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            char op = buf.ops[i];
+            cache_access((op == 'I' || op == 'i') ? ic : dc, op, buf.addrs[i]);
+        }
+        rec_poll(dc);
+    }
+    chunk_buf_free(&buf);
+    return true;
+}
+
+// Simulate one configuration and print the results the way the scripts expect.
+static int run_single(const config_t *cfg, const char *trace_path, const options_t *opt) {
+    cache_t *cache = cache_create(cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback);
+    if (!cache) {
+        fprintf(stderr, "Could not set up cache.\n");
+        return 1;
+    }
+    if (opt->hot_k > 0) {
+        cache->hot = hot_create(opt->hot_k);
+        if (!cache->hot) {
+            fprintf(stderr, "Could not set up hot-block tracking.\n");
+            cache_destroy(cache);
+            return 1;
+        }
+    }
+    if (opt->state_hash && !cache_track_state(cache)) {
+        fprintf(stderr, "Out of memory.\n");
+        cache_destroy(cache);
+        return 1;
+    }
+    if (opt->rec_events > 0) {
+        FILE *out = opt->rec_path ? fopen(opt->rec_path, "w") : stderr;
+        if (!out) {
+            fprintf(stderr, "Error: could not create %s\n", opt->rec_path);
+            cache_destroy(cache);
+            return 1;
+        }
+        cache->rec = rec_create(opt->rec_events, out);
+        if (!cache->rec) {
+            if (out != stderr) fclose(out);
+            fprintf(stderr, "Could not set up the flight recorder.\n");
+            cache_destroy(cache);
+            return 1;
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = rec_on_signal;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+
+    // open the trace file
+    FILE *fp = fopen(trace_path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open the trace file: %s\n", trace_path);
+        cache_destroy(cache);
+        return 1;
+    }
+
+    reader_t r;
+    if (!reader_open_file(&r, fp)) {
+        fclose(fp);
+        cache_destroy(cache);
+        return 1;
+    }
+    reader_note_filter(&r);
+
+    bt_writer_t filter;
+    if (opt->filter_path) {
+        bt_header_t info;
+        memset(&info, 0, sizeof(info));
+        info.filter_size = cfg->cache_size;
+        info.filter_assoc = (unsigned int)cfg->assoc;
+        info.filter_repl = (unsigned int)cfg->replacement;
+        info.filter_wb = (unsigned int)cfg->writeback;
+        if (!bt_writer_open(&filter, opt->filter_path, &info)) {
+            fprintf(stderr, "Error: could not create %s\n", opt->filter_path);
+            reader_close(&r);
+            fclose(fp);
+            cache_destroy(cache);
+            return 1;
+        }
+        cache->lower = filter_write;
+        cache->lower_ctx = &filter;
+    }
+
+    // with --icache the cache from the command line is the data side of a
+    // split first level. An inclusive pipeline waits for the levels below on
+    // every miss, which only pays off on spare CPUs, so it has to be asked
+    // for with --jobs.
+    cache_t *icache = NULL;
+    if (opt->split) {
+        const config_t *ic = &opt->icache;
+        icache = cache_create(ic->cache_size, ic->assoc, ic->replacement, ic->writeback);
+    }
+    hier_t hier;
+    bool levels = opt->nnext > 0 || opt->split;
+    size_t levels_threads = (opt->inclusive && opt->jobs == 0) ? 1 : job_count(opt);
+    if ((opt->split && !icache) || (levels && !hier_init(&hier, cache, icache, opt, levels_threads))) {
+        fprintf(stderr, "Could not set up the cache hierarchy.\n");
+        reader_close(&r);
+        fclose(fp);
+        cache_destroy(icache);
+        cache_destroy(cache);
+        return 1;
+    }
+
+    rle_stats_t rs = {0, 0};
+    double start = now_seconds();
+    bool ok = icache ? simulate_split(icache, cache, &r) : simulate(cache, &r, opt->rle, &rs);
+    reader_close(&r);
+    fclose(fp);
+    if (levels) hier_finish(&hier);
+    if (opt->nnext > 0) {
+        fprintf(stderr, "next: %zu levels %s in %.3f s\n", hier.n,
+                hier.pipelined ? "pipelined" : "run serially", now_seconds() - start);
+    }
+    if (cache->rec) rec_dump(cache, ok ? "end of run" : "out of memory");
+    if (opt->filter_path) {
+        if (!bt_writer_close(&filter)) {
+            fprintf(stderr, "Error: could not write %s\n", opt->filter_path);
+            cache_destroy(cache);
+            return 1;
+        } else {
+            fprintf(stderr, "filtered %llu accesses down to %llu (%llu records, %llu bytes) in %s\n",
+                    cache->hits + cache->misses, filter.accesses, filter.records, filter.bytes,
+                    opt->filter_path);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Out of memory.\n");
+        if (levels) hier_free(&hier);
+        cache_destroy(icache);
+        cache_destroy(cache);
+        return 1;
+    }
+
+    // figure out the miss ratio (misses divided by total accesses); a split
+    // first level counts both of its caches
+    unsigned long long total = cache->hits + cache->misses;
+    unsigned long long l1_total = total, l1_misses = cache->misses;
+    unsigned long long l1_writes = cache->mem_writes, l1_reads = cache->mem_reads;
+    if (icache) {
+        l1_total += icache->hits + icache->misses;
+        l1_misses += icache->misses;
+        l1_writes += icache->mem_writes;
+        l1_reads += icache->mem_reads;
+    }
+    double miss_ratio = (l1_total > 0) ? (double)l1_misses / (double)l1_total : 0.0;
+
+    // print the results
+    printf("Miss ratio %f\n", miss_ratio);
+    printf("write %llu\n", l1_writes);
+    printf("read %llu\n", l1_reads);
+    if (cache->track_state) printf("State hash %016llx\n", cache->state_hash);
+
+    if (opt->energy) {
+        sim_result_t res;
+        result_from_cache(&res, cache);
+        energy_t e = energy_estimate(cfg, &res, opt);
+        printf("Energy %.3f nJ (cache dynamic %.3f, leakage %.3f, memory %.3f)\n",
+               e.total_nj, e.dynamic_nj, e.leakage_nj, e.dram_nj);
+        printf("Energy per access %.6f nJ\n", e.per_access_nj);
+        printf("Area %.4f mm^2\n", e.area_mm2);
+    }
+
+    if (cache->hot) {
+        printf("\n");
+        topk_print(stdout, &cache->hot->by_access, cache->hot->k, "accesses", total);
+        printf("\n");
+        topk_print(stdout, &cache->hot->by_miss, cache->hot->k, "misses", cache->misses);
+    }
+
+    if (levels) {
+        hier_print(&hier);
+        hier_free(&hier);
+    }
+
+    if ((opt->rle || r.binary) && !icache) rle_report(stderr, &rs);
+
+    cache_destroy(icache);
+    cache_destroy(cache);
+    return 0;
+}
+
+// Simulate every configuration over one trace, filling out[0..ncfg-1].
+// A single configuration goes through simulate(); several run in lockstep
+// over a single pass of the file (see lockstep_t).
+// Returns false if the trace can't be read.
+static bool simulate_configs(const char *trace_path, const config_t *cfgs, size_t ncfg,
+                             const options_t *opt, sim_result_t *out) {
+    memset(out, 0, ncfg * sizeof(sim_result_t));
+    FILE *fp = fopen(trace_path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open the trace file: %s\n", trace_path);
+        return false;
+    }
+    reader_t r;
+    if (!reader_open_file(&r, fp)) {
+        fclose(fp);
+        return false;
+    }
+
+    bool ok = true;
+    if (ncfg == 1) {
+        const config_t *cfg = &cfgs[0];
+        cache_t *cache = cache_create(cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback);
+        if (!cache) {
+            fprintf(stderr, "Skipping invalid configuration: size %zu assoc %zu\n", cfg->cache_size, cfg->assoc);
+        } else {
+            ok = simulate(cache, &r, opt->rle, NULL);
+            result_from_cache(&out[0], cache);
+            cache_destroy(cache);
+        }
+    } else {
+        lockstep_t ls;
+        ok = lockstep_init(&ls, cfgs, ncfg) && lockstep_run(&ls, &r, opt->rle);
+        for (size_t k = 0; ok && k < ls.ncaches; ++k) result_from_cache(&out[ls.cfg_index[k]], &ls.caches[k]);
+        if (ls.caches) lockstep_free(&ls);
+    }
+    if (!ok) fprintf(stderr, "Out of memory.\n");
+    reader_close(&r);
+    fclose(fp);
+    return ok;
+}
+
+// ---- Sweeps in worker processes (--fork) ----
+//
+// Instead of one address space, each configuration can run in its own forked
+// process, so one that crashes (or that runs code we don't trust) can't take
+// the sweep down with it. The trace is decoded once into memory shared with
+// every worker, and each worker writes its statistics into its own entry of a
+// results table that is shared too. A worker that dies before filling in its
+// entry just marks that configuration as failed.
+
+// A decoded trace in shared memory. The addresses and ops live in two
+// mappings backed by memory files, so they can grow while the trace is read.
+typedef struct {
+    unsigned long long *addrs;
+    char *ops;
+    size_t n;
+    size_t cap;             // entries both mappings have room for
+} shared_trace_t;
+
+// One entry of the shared results table.
+typedef struct {
+    sim_result_t res;
+    int done;               // set by the worker once res is filled in
+} fork_slot_t;
+
+static void *shared_alloc(size_t bytes) {
+    void *p = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Grow the shared mapping *p (backed by fd) from old_bytes to bytes. The
+// mapping may move, but it stays shared with every process forked later.
+static bool shared_grow(int fd, void **p, size_t old_bytes, size_t bytes) {
+    if (ftruncate(fd, (off_t)bytes) != 0) return false;
+    void *q = *p ? mremap(*p, old_bytes, bytes, MREMAP_MAYMOVE)
+                 : mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (q == MAP_FAILED) return false;
+    *p = q;
+    return true;
+}
+
+static void shared_trace_free(shared_trace_t *t) {
+    if (t->addrs) munmap(t->addrs, t->cap * sizeof(unsigned long long));
+    if (t->ops) munmap(t->ops, t->cap);
+    memset(t, 0, sizeof(*t));
+}
+
+// Read the whole trace straight into shared memory. We don't know the length
+// up front, so the mappings double whenever they fill up.
+static bool shared_trace_load(shared_trace_t *t, const char *path) {
+    memset(t, 0, sizeof(*t));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open the trace file: %s\n", path);
+        return false;
+    }
+    reader_t r;
+    if (!reader_open_file(&r, fp)) {
+        fclose(fp);
+        return false;
+    }
+    reader_note_filter(&r);
+
+    int afd = memfd_create("trace-addrs", 0), ofd = memfd_create("trace-ops", 0);
+    bool ok = afd >= 0 && ofd >= 0;
+    size_t got;
+    while (ok) {
+        if (t->n + TRACE_CHUNK > t->cap) {
+            size_t cap = t->cap ? t->cap * 2 : TRACE_CHUNK;
+            ok = shared_grow(afd, (void**)&t->addrs, t->cap * sizeof(unsigned long long),
+                             cap * sizeof(unsigned long long));
+            if (!ok) break;
+            if (!shared_grow(ofd, (void**)&t->ops, t->cap, cap)) {
+                // the addresses grew already, so unmap them at their new size
+                munmap(t->addrs, cap * sizeof(unsigned long long));
+                t->addrs = NULL;
+                ok = false;
+                break;
+            }
+            t->cap = cap;
+        }
+        if ((got = reader_next(&r, t->addrs + t->n, t->ops + t->n)) == 0) break;
+        t->n += got;
+    }
+    reader_close(&r);
+    fclose(fp);
+    // the mappings keep the memory files alive
+    if (afd >= 0) close(afd);
+    if (ofd >= 0) close(ofd);
+
+    if (!ok) {
+        fprintf(stderr, "Out of memory while loading %s\n", path);
+        shared_trace_free(t);
+    }
+    return ok;
+}
+
+// Run one configuration over the shared trace (in a worker process).
+static void fork_worker(const shared_trace_t *t, const config_t *cfg, const options_t *opt, fork_slot_t *slot) {
+    cache_t *c = cache_create(cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback);
+    if (!c) _exit(2);   // out of memory (the configuration was checked already)
+    block_run_t *runs = NULL;
+    if (opt->rle) {
+        runs = (block_run_t*)malloc(TRACE_CHUNK * sizeof(block_run_t));
+        if (!runs) _exit(3);
+    }
+    for (size_t start = 0; start < t->n; start += TRACE_CHUNK) {
+        size_t n = t->n - start < TRACE_CHUNK ? t->n - start : TRACE_CHUNK;
+        if (runs) {
+            size_t nruns = rle_collapse(t->addrs + start, t->ops + start, n, runs);
+            for (size_t i = 0; i < nruns; ++i) cache_access_run(c, &runs[i]);
+        } else {
+            for (size_t i = 0; i < n; ++i) cache_access(c, t->ops[start + i], t->addrs[start + i]);
+        }
+    }
+    result_from_cache(&slot->res, c);
+    slot->done = 1;
+    _exit(0);
+}
+
+// Say why a worker didn't finish.
+static void fork_report_failure(const config_t *cfg, int status) {
+    fprintf(stderr, "Configuration size %zu assoc %zu %s %s failed: ", cfg->cache_size, cfg->assoc,
+            cfg->replacement == 0 ? "LRU" : "FIFO", cfg->writeback == 1 ? "WB" : "WT");
+    if (WIFSIGNALED(status)) fprintf(stderr, "killed by signal %d (%s)\n", WTERMSIG(status), strsignal(WTERMSIG(status)));
+    else if (WIFEXITED(status)) fprintf(stderr, "worker exited with status %d\n", WEXITSTATUS(status));
+    else fprintf(stderr, "could not start a worker\n");
+}
+
+// Same as simulate_configs, but every configuration runs in its own process,
+// at most job_count(opt) at a time.
+static bool simulate_configs_forked(const char *trace_path, const config_t *cfgs, size_t ncfg,
+                                    const options_t *opt, sim_result_t *out) {
+    memset(out, 0, ncfg * sizeof(sim_result_t));
+    shared_trace_t t;
+    if (!shared_trace_load(&t, trace_path)) return false;
+    fork_slot_t *table = (fork_slot_t*)shared_alloc(ncfg * sizeof(fork_slot_t));
+    pid_t *pids = (pid_t*)calloc(ncfg ? ncfg : 1, sizeof(pid_t));
+    if (!table || !pids) {
+        fprintf(stderr, "Out of memory.\n");
+        if (table) munmap(table, ncfg * sizeof(fork_slot_t));
+        free(pids);
+        shared_trace_free(&t);
+        return false;
+    }
+    fflush(NULL);   // so the workers don't write out our buffered output again
+
+    size_t limit = job_count(opt), running = 0, next = 0;
+    int *status = (int*)calloc(ncfg ? ncfg : 1, sizeof(int));
+    while ((next < ncfg || running > 0) && status) {
+        if (next < ncfg && !config_valid(&cfgs[next])) {
+            fprintf(stderr, "Skipping invalid configuration: size %zu assoc %zu\n",
+                    cfgs[next].cache_size, cfgs[next].assoc);
+            next++;
+            continue;
+        }
+        if (next < ncfg && running < limit) {
+            pid_t pid = fork();
+            if (pid == 0) fork_worker(&t, &cfgs[next], opt, &table[next]);
+            pids[next] = pid;
+            if (pid > 0) running++;
+            else status[next] = -1;
+            next++;
+            continue;
+        }
+        int st;
+        pid_t pid = wait(&st);
+        if (pid < 0) break;
+        for (size_t i = 0; i < next; ++i) {
+            if (pids[i] == pid) {
+                status[i] = st;
+                running--;
+            }
+        }
+    }
+
+    bool ok = status != NULL;
+    for (size_t i = 0; i < ncfg && ok; ++i) {
+        if (table[i].done) out[i] = table[i].res;
+        else if (config_valid(&cfgs[i])) fork_report_failure(&cfgs[i], status[i]);
+    }
+    if (!ok) fprintf(stderr, "Out of memory.\n");
+    free(status);
+    free(pids);
+    munmap(table, ncfg * sizeof(fork_slot_t));
+    shared_trace_free(&t);
+    return ok;
+}
+
+static void print_config_cells(const config_t *cfg) {
+    printf("%zu,%zu,%s,%s", cfg->cache_size, cfg->assoc,
+           cfg->replacement == 0 ? "LRU" : "FIFO", cfg->writeback == 1 ? "WB" : "WT");
+}
+
+// Extra CSV columns printed with --energy.
+#define ENERGY_COLUMNS ",energy_nj,energy_per_access_nj,area_mm2"
+
+static void print_energy_cells(const config_t *cfg, const sim_result_t *res, const options_t *opt) {
+    energy_t e = energy_estimate(cfg, res, opt);
+    printf(",%.3f,%.6f,%.4f", e.total_nj, e.per_access_nj, e.area_mm2);
+}
+
+// Simulate many configurations over the same trace, all in one pass over the
+// file (see lockstep_t). Prints one CSV row per configuration.
+static int run_sweep(const config_t *cfgs, size_t ncfg, const char *trace_path, const options_t *opt) {
+    sim_result_t *res = (sim_result_t*)calloc(ncfg, sizeof(sim_result_t));
+    if (!res) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    bool ok = opt->fork ? simulate_configs_forked(trace_path, cfgs, ncfg, opt, res)
+                        : simulate_configs(trace_path, cfgs, ncfg, opt, res);
+    if (!ok) {
+        free(res);
+        return 1;
+    }
+
+    printf("size_bytes,assoc,replacement,wb,miss_ratio,mem_writes,mem_reads%s\n",
+           opt->energy ? ENERGY_COLUMNS : "");
+    for (size_t i = 0; i < ncfg; ++i) {
+        if (!res[i].valid) continue;
+        print_config_cells(&cfgs[i]);
+        printf(",%f,%llu,%llu", result_miss_ratio(&res[i]), res[i].mem_writes, res[i].mem_reads);
+        if (opt->energy) print_energy_cells(&cfgs[i], &res[i], opt);
+        printf("\n");
+    }
+    free(res);
+    return 0;
+}
+
+// Work shared by the threads of run_multi: each thread keeps taking the next
+// trace until none are left. Every trace gets its own caches.
+typedef struct {
+    char **paths;
+    size_t npaths;
+    const config_t *cfgs;
+    size_t ncfg;
+    const options_t *opt;
+    sim_result_t *results;  // npaths * ncfg
+    bool *ok;               // per trace
+    size_t next;
+    pthread_mutex_t lock;
+} multi_work_t;
+
+static void *multi_worker(void *arg) {
+    multi_work_t *mw = (multi_work_t*)arg;
+    for (;;) {
+        pthread_mutex_lock(&mw->lock);
+        size_t t = mw->next++;
+        pthread_mutex_unlock(&mw->lock);
+        if (t >= mw->npaths) return NULL;
+        mw->ok[t] = simulate_configs(mw->paths[t], mw->cfgs, mw->ncfg, mw->opt, mw->results + t * mw->ncfg);
+    }
+}
+
+// Print the TOTAL, MEAN and GEOMEAN rows for one configuration.
+static void print_aggregates(const config_t *cfg, const sim_result_t *res, size_t stride,
+                             const bool *ok, size_t npaths, const options_t *opt) {
+    sim_result_t sum;
+    memset(&sum, 0, sizeof(sum));
+    double ratio_sum = 0.0, log_sum = 0.0, per_access_sum = 0.0;
+    bool any_zero = false;
+    size_t n = 0;
+    for (size_t t = 0; t < npaths; ++t) {
+        const sim_result_t *r = &res[t * stride];
+        if (!ok[t] || !r->valid) continue;
+        sum.accesses += r->accesses;
+        sum.writes += r->writes;
+        sum.misses += r->misses;
+        sum.mem_reads += r->mem_reads;
+        sum.mem_writes += r->mem_writes;
+        double mr = result_miss_ratio(r);
+        ratio_sum += mr;
+        if (opt->energy) per_access_sum += energy_estimate(cfg, r, opt).per_access_nj;
+        if (mr > 0.0) log_sum += log(mr);
+        else any_zero = true;
+        n++;
+    }
+    if (n == 0) return;
+    double dn = (double)n;
+
+    printf("TOTAL,");
+    print_config_cells(cfg);
+    printf(",%llu,%llu,%f,%llu,%llu", sum.accesses, sum.misses,
+           sum.accesses ? (double)sum.misses / (double)sum.accesses : 0.0, sum.mem_writes, sum.mem_reads);
+    if (opt->energy) print_energy_cells(cfg, &sum, opt);
+    printf("\nMEAN,");
+    print_config_cells(cfg);
+    printf(",%.1f,%.1f,%f,%.1f,%.1f", (double)sum.accesses / dn, (double)sum.misses / dn,
+           ratio_sum / dn, (double)sum.mem_writes / dn, (double)sum.mem_reads / dn);
+    if (opt->energy) {
+        // like miss_ratio, the per-access energy is the mean of the traces' own
+        energy_t e = energy_estimate(cfg, &sum, opt);
+        printf(",%.3f,%.6f,%.4f", e.total_nj / dn, per_access_sum / dn, e.area_mm2);
+    }
+    printf("\nGEOMEAN,");
+    print_config_cells(cfg);
+    printf(",,,%f,,%s\n", any_zero ? 0.0 : exp(log_sum / dn), opt->energy ? ",,," : "");
+}
+
+// Print the rows of one trace (res[i] is what cfgs[i] did on it) in the CSV
+// for several traces.
+static void print_trace_rows(const char *trace, const config_t *cfgs, size_t ncfg, const sim_result_t *res,
+                             const options_t *opt) {
+    for (size_t i = 0; i < ncfg; ++i) {
+        const sim_result_t *r = &res[i];
+        if (!r->valid) continue;
+        printf("%s,", trace);
+        print_config_cells(&cfgs[i]);
+        printf(",%llu,%llu,%f,%llu,%llu", r->accesses, r->misses, result_miss_ratio(r),
+               r->mem_writes, r->mem_reads);
+        if (opt->energy) print_energy_cells(&cfgs[i], r, opt);
+        printf("\n");
+    }
+}
+
+// Simulate several traces at once, each on its own thread with its own caches,
+// and print per-trace rows followed by aggregate rows for every configuration.
+static int run_multi(const config_t *cfgs, size_t ncfg, char **paths, size_t npaths, const options_t *opt) {
+    multi_work_t mw;
+    memset(&mw, 0, sizeof(mw));
+    mw.paths = paths;
+    mw.npaths = npaths;
+    mw.cfgs = cfgs;
+    mw.ncfg = ncfg;
+    mw.opt = opt;
+    mw.results = (sim_result_t*)calloc(npaths * ncfg, sizeof(sim_result_t));
+    mw.ok = (bool*)calloc(npaths, sizeof(bool));
+    pthread_mutex_init(&mw.lock, NULL);
+
+    size_t nthreads = job_count(opt);
+    if (nthreads > npaths) nthreads = npaths;
+    pthread_t *threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+    if (!mw.results || !mw.ok || !threads) {
+        fprintf(stderr, "Out of memory.\n");
+        free(mw.results);
+        free(mw.ok);
+        free(threads);
+        return 1;
+    }
+
+    // the calling thread works too, so one "job" means no extra threads
+    size_t started = 0;
+    for (size_t i = 1; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, multi_worker, &mw) == 0) started = i;
+        else break;
+    }
+    multi_worker(&mw);
+    for (size_t i = 1; i <= started; ++i) pthread_join(threads[i], NULL);
+
+    int rc = 0;
+    printf("trace,size_bytes,assoc,replacement,wb,accesses,misses,miss_ratio,mem_writes,mem_reads%s\n",
+           opt->energy ? ENERGY_COLUMNS : "");
+    for (size_t t = 0; t < npaths; ++t) {
+        if (mw.ok[t]) print_trace_rows(paths[t], cfgs, ncfg, mw.results + t * ncfg, opt);
+        else rc = 1;
+    }
+    for (size_t i = 0; i < ncfg; ++i) print_aggregates(&cfgs[i], mw.results + i, ncfg, mw.ok, npaths, opt);
+
+    pthread_mutex_destroy(&mw.lock);
+    free(mw.results);
+    free(mw.ok);
+    free(threads);
+    return rc;
+}
+
+// ---- Design-space exploration (--dse) ----
+//
+// Instead of simulating every combination, --dse walks the sizes of each
+// (assoc, replacement, wb) group from both ends inwards. With LRU and a
+// power-of-two number of sets, a bigger cache with the same ways always holds
+// everything a smaller one holds (inclusion), so the miss ratio can only go
+// down as the size grows. When two simulated sizes are within the tolerance of
+// each other, the sizes between them are skipped: their miss ratio is already
+// pinned between the two, and they cost more area and leakage for (nearly)
+// nothing. Intervals with big drops, the knees of the curve, keep being split
+// until they are smooth. FIFO has no inclusion property (Belady's anomaly), so
+// for FIFO the skipped sizes are only assumed to lie in between. Direct-mapped
+// caches are simulated once, whatever the replacement policy.
+
+typedef struct {
+    config_t cfg;
+    bool simulated;
+    sim_result_t res;
+    energy_t e;
+    bool pareto;
+} dse_point_t;
+
+// Simulate one configuration from the in-memory trace.
+static bool dse_simulate(const trace_store_t *st, dse_point_t *p, const options_t *opt) {
+    cache_t *cache = cache_create(p->cfg.cache_size, p->cfg.assoc, p->cfg.replacement, p->cfg.writeback);
+    if (!cache) return false;
+    reader_t r;
+    reader_open_store(&r, st);
+    bool ok = simulate(cache, &r, opt->rle, NULL);
+    result_from_cache(&p->res, cache);
+    cache_destroy(cache);
+    p->e = energy_estimate(&p->cfg, &p->res, opt);
+    p->simulated = ok;
+    return ok;
+}
+
+// Refine one group of sizes (pts[0..n-1], smallest first) around its knees.
+// Returns the number of configurations simulated, or -1 on error.
+static long dse_group(const trace_store_t *st, dse_point_t *pts, size_t n, const options_t *opt) {
+    if (n == 0) return 0;
+    long count = 0;
+    if (!dse_simulate(st, &pts[0], opt)) return -1;
+    count++;
+    if (n == 1) return count;
+    if (!dse_simulate(st, &pts[n - 1], opt)) return -1;
+    count++;
+
+    // intervals still to look at, as pairs of indexes into pts[]
+    size_t *stack = (size_t*)calloc(2 * n, sizeof(size_t));
+    if (!stack) return -1;
+    size_t top = 0;
+    stack[top++] = 0;
+    stack[top++] = n - 1;
+    while (top > 0) {
+        size_t j = stack[--top];
+        size_t i = stack[--top];
+        if (j - i < 2) continue;
+        double drop = result_miss_ratio(&pts[i].res) - result_miss_ratio(&pts[j].res);
+        if (drop <= opt->dse_tol) continue;   // flat enough: skip everything in between
+        size_t m = i + (j - i) / 2;
+        if (!dse_simulate(st, &pts[m], opt)) {
+            free(stack);
+            return -1;
+        }
+        count++;
+        stack[top++] = i;
+        stack[top++] = m;
+        stack[top++] = m;
+        stack[top++] = j;
+    }
+    free(stack);
+    return count;
+}
+
+// Does a beat b on every axis (size, miss ratio, energy) and strictly on one?
+static bool dse_dominates(const dse_point_t *a, const dse_point_t *b) {
+    double ma = result_miss_ratio(&a->res), mb = result_miss_ratio(&b->res);
+    if (a->cfg.cache_size > b->cfg.cache_size || ma > mb || a->e.total_nj > b->e.total_nj) return false;
+    return a->cfg.cache_size < b->cfg.cache_size || ma < mb || a->e.total_nj < b->e.total_nj;
+}
+
+static int compare_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+// The sizes to search, smallest first: two sizes MIN,MAX mean every power of
+// two from MIN up to MAX, a longer list is used as it is. Returns the count.
+static size_t expand_sizes(const unsigned long long *list, size_t n, unsigned long long *out) {
+    size_t count = 0;
+    if (n == 2) {
+        unsigned long long lo = list[0] < list[1] ? list[0] : list[1];
+        unsigned long long hi = list[0] < list[1] ? list[1] : list[0];
+        for (unsigned long long v = lo; v <= hi && count < MAX_LIST; v *= 2) out[count++] = v;
+    } else {
+        memcpy(out, list, n * sizeof(out[0]));
+        count = n;
+        qsort(out, count, sizeof(out[0]), compare_ull);
+    }
+    return count;
+}
+
+// Explore the sizes x assocs x repls x wbs grid over one trace and print the
+// simulated points as a CSV, marking the Pareto front of size, miss ratio and
+// energy. The sizes are expanded by expand_sizes.
+static int run_dse(const unsigned long long *size_list, size_t nsize_list,
+                   const unsigned long long *assocs, size_t nassoc,
+                   const unsigned long long *repls, size_t nrepl,
+                   const unsigned long long *wbs, size_t nwb,
+                   const char *trace_path, const options_t *opt) {
+    unsigned long long sizes[MAX_LIST];
+    size_t nsize = expand_sizes(size_list, nsize_list, sizes);
+
+    size_t ngroups = nassoc * nrepl * nwb;
+    dse_point_t *pts = (dse_point_t*)calloc(ngroups * nsize, sizeof(dse_point_t));
+    if (!pts) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    trace_store_t *st = store_load(trace_path);
+    if (!st) {
+        free(pts);
+        return 1;
+    }
+    store_report(stderr, st);
+
+    // each group keeps only the sizes that divide into whole sets, smallest
+    // first (duplicates in the size list are dropped)
+    size_t *group_len = (size_t*)calloc(ngroups, sizeof(size_t));
+    if (!group_len) {
+        fprintf(stderr, "Out of memory.\n");
+        store_destroy(st);
+        free(pts);
+        return 1;
+    }
+    size_t grid = 0, simulated = 0;
+    size_t g = 0;
+    int rc = 0;
+    for (size_t b = 0; b < nassoc && rc == 0; ++b)
+        for (size_t c = 0; c < nrepl && rc == 0; ++c)
+            for (size_t d = 0; d < nwb && rc == 0; ++d, ++g) {
+                dse_point_t *row = pts + g * nsize;
+                size_t n = 0;
+                for (size_t a = 0; a < nsize; ++a) {
+                    unsigned long long lines = sizes[a] / BLOCK_SIZE;
+                    if (lines == 0 || lines % assocs[b] != 0) continue;
+                    if (n > 0 && row[n - 1].cfg.cache_size == sizes[a]) continue;
+                    row[n].cfg.cache_size = (size_t)sizes[a];
+                    row[n].cfg.assoc = (size_t)assocs[b];
+                    row[n].cfg.replacement = (int)repls[c];
+                    row[n].cfg.writeback = (int)wbs[d];
+                    n++;
+                }
+                group_len[g] = n;
+                grid += n;
+                if (assocs[b] == 1 && c > 0) {
+                    // direct-mapped caches have no choice of victim, so every
+                    // replacement policy gives the same results as the first
+                    const dse_point_t *same = pts + (g - c * nwb) * nsize;
+                    for (size_t k = 0; k < n; ++k) {
+                        row[k].simulated = same[k].simulated;
+                        row[k].res = same[k].res;
+                        row[k].e = same[k].e;
+                    }
+                    continue;
+                }
+                long done = dse_group(st, row, n, opt);
+                if (done < 0) {
+                    fprintf(stderr, "Out of memory.\n");
+                    rc = 1;
+                } else {
+                    simulated += (size_t)done;
+                }
+            }
+    store_destroy(st);
+    if (rc != 0) {
+        free(group_len);
+        free(pts);
+        return rc;
+    }
+
+    for (size_t i = 0; i < ngroups * nsize; ++i) {
+        if (!pts[i].simulated) continue;
+        pts[i].pareto = true;
+        for (size_t k = 0; k < ngroups * nsize && pts[i].pareto; ++k) {
+            if (pts[k].simulated && dse_dominates(&pts[k], &pts[i])) pts[i].pareto = false;
+        }
+    }
+
+    printf("size_bytes,assoc,replacement,wb,miss_ratio,mem_writes,mem_reads" ENERGY_COLUMNS ",pareto\n");
+    for (g = 0; g < ngroups; ++g) {
+        for (size_t a = 0; a < group_len[g]; ++a) {
+            const dse_point_t *p = &pts[g * nsize + a];
+            if (!p->simulated) continue;
+            print_config_cells(&p->cfg);
+            printf(",%f,%llu,%llu", result_miss_ratio(&p->res), p->res.mem_writes, p->res.mem_reads);
+            print_energy_cells(&p->cfg, &p->res, opt);
+            printf(",%d\n", p->pareto ? 1 : 0);
+        }
+    }
+    fprintf(stderr, "dse: simulated %zu of %zu configurations (%.1f%%), tolerance %g\n",
+            simulated, grid, grid ? 100.0 * (double)simulated / (double)grid : 0.0, opt->dse_tol);
+
+    free(group_len);
+    free(pts);
+    return 0;
+}
+
+// ---- Smallest cache for a target (--solve) ----
+//
+// For every assoc/replacement/wb combination, binary search the sizes for the
+// smallest cache that reaches the target miss ratio or memory traffic (blocks
+// read plus writes sent to memory). This relies on the results only getting
+// better as the cache grows, which LRU inclusion guarantees (power-of-two
+// sets); FIFO usually behaves but isn't guaranteed to. For miss ratio targets
+// the fully associative LRU answer is also worked out from stack distances,
+// which needs only one pass for all sizes. It is printed as one more row
+// (assoc = lines, write-back, 0 simulations) with its misses and miss ratio;
+// stack distances don't see dirty lines, so its traffic cells stay empty.
+
+static bool solve_met(const dse_point_t *p, const options_t *opt) {
+    if (opt->solve == SOLVE_MISS) return result_miss_ratio(&p->res) <= opt->solve_target;
+    return (double)(p->res.mem_reads + p->res.mem_writes) <= opt->solve_target;
+}
+
+// Breaks ties between solutions of the same size: lower is better.
+static double solve_score(const dse_point_t *p, const options_t *opt) {
+    if (opt->solve == SOLVE_MISS) return result_miss_ratio(&p->res);
+    return (double)(p->res.mem_reads + p->res.mem_writes);
+}
+
+// Find the first size in pts[0..n-1] that meets the target, or n if none does.
+// *sims counts the simulations. Returns false if we ran out of memory.
+static bool solve_group(const trace_store_t *st, dse_point_t *pts, size_t n, const options_t *opt,
+                        size_t *found, size_t *sims) {
+    *found = n;
+    if (n == 0) return true;
+    if (!dse_simulate(st, &pts[n - 1], opt)) return false;
+    (*sims)++;
+    if (!solve_met(&pts[n - 1], opt)) return true;
+
+    // pts[hi] meets the target; everything below lo is known not to
+    size_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (!dse_simulate(st, &pts[mid], opt)) return false;
+        (*sims)++;
+        if (solve_met(&pts[mid], opt)) hi = mid;
+        else lo = mid + 1;
+    }
+    *found = hi;
+    return true;
+}
+
+static int run_solve(const unsigned long long *size_list, size_t nsize_list,
+                     const unsigned long long *assocs, size_t nassoc,
+                     const unsigned long long *repls, size_t nrepl,
+                     const unsigned long long *wbs, size_t nwb,
+                     const char *trace_path, const options_t *opt) {
+    unsigned long long sizes[MAX_LIST];
+    size_t nsize = expand_sizes(size_list, nsize_list, sizes);
+    dse_point_t *row = (dse_point_t*)calloc(nsize, sizeof(dse_point_t));
+    size_t ngroups = nassoc * nrepl * nwb;
+    dse_point_t *best = (dse_point_t*)calloc(ngroups, sizeof(dse_point_t));
+    size_t *group_sims = (size_t*)calloc(ngroups, sizeof(size_t));
+    if (!row || !best || !group_sims) {
+        fprintf(stderr, "Out of memory.\n");
+        free(row);
+        free(best);
+        free(group_sims);
+        return 1;
+    }
+    trace_store_t *st = store_load(trace_path);
+    if (!st) {
+        free(row);
+        free(best);
+        free(group_sims);
+        return 1;
+    }
+    store_report(stderr, st);
+
+    int rc = 0;
+    size_t g = 0;
+    for (size_t b = 0; b < nassoc && rc == 0; ++b)
+        for (size_t c = 0; c < nrepl && rc == 0; ++c)
+            for (size_t d = 0; d < nwb && rc == 0; ++d, ++g) {
+                size_t n = 0;
+                memset(row, 0, nsize * sizeof(dse_point_t));
+                for (size_t a = 0; a < nsize; ++a) {
+                    unsigned long long lines = sizes[a] / BLOCK_SIZE;
+                    if (lines == 0 || lines % assocs[b] != 0) continue;
+                    if (n > 0 && row[n - 1].cfg.cache_size == sizes[a]) continue;
+                    row[n].cfg.cache_size = (size_t)sizes[a];
+                    row[n].cfg.assoc = (size_t)assocs[b];
+                    row[n].cfg.replacement = (int)repls[c];
+                    row[n].cfg.writeback = (int)wbs[d];
+                    n++;
+                }
+                size_t found;
+                if (!solve_group(st, row, n, opt, &found, &group_sims[g])) {
+                    fprintf(stderr, "Out of memory.\n");
+                    rc = 1;
+                } else if (found < n) {
+                    best[g] = row[found];
+                } else {
+                    // remember the combination even though nothing met the target
+                    best[g].cfg.assoc = (size_t)assocs[b];
+                    best[g].cfg.replacement = (int)repls[c];
+                    best[g].cfg.writeback = (int)wbs[d];
+                }
+            }
+
+    // the fully associative LRU row: fa_lines = 0 if it wasn't worked out,
+    // fa_met = false if no size gets there
+    size_t fa_lines = 0;
+    unsigned long long fa_misses = 0, fa_accesses = 0;
+    bool fa_met = false;
+    if (rc == 0 && opt->solve == SOLVE_MISS) {
+        stackdist_t sd;
+        reader_t r;
+        reader_open_store(&r, st);
+        if (sd_init(&sd) && sd_run(&sd, &r)) {
+            size_t lines = 1;
+            while (lines <= sd.blocks &&
+                   (double)sd_misses(&sd, lines) > opt->solve_target * (double)sd.now) lines *= 2;
+            fa_lines = lines;
+            fa_misses = sd_misses(&sd, lines);
+            fa_accesses = sd.now;
+            fa_met = lines <= sd.blocks || (double)sd.cold <= opt->solve_target * (double)sd.now;
+            if (!fa_met) {
+                fprintf(stderr, "fully associative LRU can't reach miss ratio %g: %.6f are first accesses\n",
+                        opt->solve_target, sd.now ? (double)sd.cold / (double)sd.now : 0.0);
+            }
+        }
+        sd_free(&sd);
+    }
+    store_destroy(st);
+    if (rc != 0) {
+        free(row);
+        free(best);
+        free(group_sims);
+        return rc;
+    }
+
+    // best = 1 marks the smallest solution for each replacement policy (ties go
+    // to the lower miss ratio or traffic)
+    printf("size_bytes,assoc,replacement,wb,misses,miss_ratio,mem_writes,mem_reads,traffic,simulations,best\n");
+    for (g = 0; g < ngroups; ++g) {
+        const dse_point_t *p = &best[g];
+        if (!p->simulated) {
+            printf("none,%zu,%s,%s,,,,,,%zu,0\n", p->cfg.assoc, p->cfg.replacement == 0 ? "LRU" : "FIFO",
+                   p->cfg.writeback == 1 ? "WB" : "WT", group_sims[g]);
+            continue;
+        }
+        bool is_best = true;
+        for (size_t k = 0; k < ngroups && is_best; ++k) {
+            const dse_point_t *q = &best[k];
+            if (k == g || !q->simulated || q->cfg.replacement != p->cfg.replacement) continue;
+            if (q->cfg.cache_size != p->cfg.cache_size) {
+                if (q->cfg.cache_size < p->cfg.cache_size) is_best = false;
+            } else if (solve_score(q, opt) != solve_score(p, opt)) {
+                if (solve_score(q, opt) < solve_score(p, opt)) is_best = false;
+            } else if (k < g) {
+                is_best = false;
+            }
+        }
+        print_config_cells(&p->cfg);
+        printf(",%llu,%f,%llu,%llu,%llu,%zu,%d\n", p->res.misses, result_miss_ratio(&p->res), p->res.mem_writes,
+               p->res.mem_reads, p->res.mem_reads + p->res.mem_writes, group_sims[g], is_best ? 1 : 0);
+    }
+    if (fa_lines > 0 && fa_met) {
+        printf("%llu,%zu,LRU,WB,%llu,%f,,,,0,0\n", (unsigned long long)fa_lines * BLOCK_SIZE, fa_lines, fa_misses,
+               fa_accesses ? (double)fa_misses / (double)fa_accesses : 0.0);
+    } else if (fa_lines > 0) {
+        printf("none,,LRU,WB,,,,,,0,0\n");
+    }
+    free(row);
+    free(best);
+    free(group_sims);
+    return 0;
+}
+
+// Print the miss-ratio curve of a fully associative LRU cache, worked out in
+// one pass from stack distances, at every power of two number of lines up to
+// the trace's footprint. With --jobs=1 the trace is streamed from the file,
+// otherwise it's loaded into the store and split between threads.
+static int run_mrc(const char *trace_path, const options_t *opt) {
+    size_t threads = job_count(opt);
+    stackdist_t sd;
+    bool ok;
+    double t0, secs;
+    if (threads == 1) {
+        FILE *fp = fopen(trace_path, "rb");
+        if (!fp) {
+            fprintf(stderr, "Error: could not open the trace file: %s\n", trace_path);
+            return 1;
+        }
+        reader_t r;
+        if (!reader_open_file(&r, fp)) {
+            fclose(fp);
+            return 1;
+        }
+        t0 = now_seconds();
+        ok = sd_init(&sd) && sd_run(&sd, &r);
+        secs = now_seconds() - t0;
+        reader_close(&r);
+        fclose(fp);
+    } else {
+        trace_store_t *st = store_load(trace_path);
+        if (!st) return 1;
+        t0 = now_seconds();
+        block_ids_t bi;
+        memset(&bi, 0, sizeof(bi));
+        ok = sd_init(&sd) && block_ids_build(&bi, st, threads) && sd_run_parallel(&sd, &bi, threads);
+        secs = now_seconds() - t0;
+        block_ids_free(&bi);
+        store_destroy(st);
+    }
+    if (!ok) {
+        fprintf(stderr, "Out of memory.\n");
+        sd_free(&sd);
+        return 1;
+    }
+
+    printf("size_bytes,lines,miss_ratio,misses\n");
+    for (size_t lines = 1;; lines *= 2) {
+        unsigned long long misses = sd_misses(&sd, lines);
+        printf("%llu,%zu,%f,%llu\n", (unsigned long long)lines * BLOCK_SIZE, lines,
+               sd.now ? (double)misses / (double)sd.now : 0.0, misses);
+        if (lines >= sd.blocks) break;
+    }
+    fprintf(stderr, "mrc: %llu accesses, %zu different blocks (%llu bytes) in %.3f s (%zu threads)\n",
+            sd.now, sd.blocks, (unsigned long long)sd.blocks * BLOCK_SIZE, secs, threads);
+    sd_free(&sd);
+    return 0;
+}
+
+// Same as run_mrc, but with counter stacks: memory doesn't grow with the
+// number of different blocks, and each size gets a range the exact miss
+// ratio lies in.
+static int run_mrc_approx(const char *trace_path, const options_t *opt) {
+    FILE *fp = fopen(trace_path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open the trace file: %s\n", trace_path);
+        return 1;
+    }
+    reader_t r;
+    if (!reader_open_file(&r, fp)) {
+        fclose(fp);
+        return 1;
+    }
+    cstack_t cs;
+    chunk_buf_t buf;
+    double t0 = now_seconds();
+    bool ok = cs_init(&cs, opt->cs_interval, opt->cs_prune);
+    ok = chunk_buf_init(&buf, false) && ok;
+    size_t n;
+    while (ok && (n = reader_next(&r, buf.addrs, buf.ops)) > 0) {
+        for (size_t i = 0; i < n && ok; ++i) ok = cs_access(&cs, buf.addrs[i] / BLOCK_SIZE);
+    }
+    ok = ok && cs_checkpoint(&cs);
+    double secs = now_seconds() - t0;
+    chunk_buf_free(&buf);
+    reader_close(&r);
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "Out of memory.\n");
+        cs_free(&cs);
+        return 1;
+    }
+
+    double total = (double)cs.accesses;
+    double footprint = cs.counters[0].now;
+    printf("size_bytes,lines,miss_ratio,miss_ratio_band_low,miss_ratio_band_high\n");
+    for (size_t lines = 1;; lines *= 2) {
+        double low = total > 0 ? cs_misses(&cs, lines, false) / total : 0.0;
+        double high = total > 0 ? cs_misses(&cs, lines, true) / total : 0.0;
+        if (high > 1.0) high = 1.0;
+        if (low > high) low = high;
+        printf("%llu,%zu,%f,%f,%f\n", (unsigned long long)lines * BLOCK_SIZE, lines,
+               (low + high) / 2.0, low, high);
+        if ((double)lines >= footprint) break;
+    }
+    fprintf(stderr, "mrc: %llu accesses, about %.0f different blocks, %zu counters at most "
+            "(%zu KB) in %.3f s\n", cs.accesses, footprint, cs.peak,
+            cs.peak * CS_HLL_SIZE / 1024, secs);
+    cs_free(&cs);
+    return 0;
+}
+
+// Expand trace arguments that contain wildcards (*, ? or [) into the matching
+// files. Other arguments are kept as they are. Returns the number of paths
+// put in *out (which the caller frees along with `g`), or 0 on error.
+static size_t expand_traces(char **args, size_t nargs, glob_t *g, char ***out) {
+    memset(g, 0, sizeof(*g));
+    int flags = 0;
+    for (size_t i = 0; i < nargs; ++i) {
+        // GLOB_NOCHECK keeps plain names, so later errors name the missing file
+        int rc = glob(args[i], flags | GLOB_NOCHECK, NULL, g);
+        if (rc != 0) {
+            fprintf(stderr, "Error: could not expand %s\n", args[i]);
+            globfree(g);
+            return 0;
+        }
+        flags = GLOB_APPEND;
+    }
+    *out = g->gl_pathv;
+    return g->gl_pathc;
+}
+
+// Convert a trace (text or binary) into a binary trace of stride runs.
+static int run_encode(const char *trace_path, const char *out_path) {
+    FILE *fp = fopen(trace_path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open the trace file: %s\n", trace_path);
+        return 1;
+    }
+    reader_t r;
+    if (!reader_open_file(&r, fp)) {
+        fclose(fp);
+        return 1;
+    }
+    bt_writer_t w;
+    if (!bt_writer_open(&w, out_path, NULL)) {
+        fprintf(stderr, "Error: could not create %s\n", out_path);
+        reader_close(&r);
+        fclose(fp);
+        return 1;
+    }
+
+    chunk_buf_t buf;
+    bool ok = chunk_buf_init(&buf, false);
+    size_t n;
+    while (ok && (n = reader_next(&r, buf.addrs, buf.ops)) > 0) {
+        for (size_t i = 0; i < n; ++i) bt_write(&w, buf.ops[i], buf.addrs[i]);
+    }
+    chunk_buf_free(&buf);
+    reader_close(&r);
+    fclose(fp);
+    if (!bt_writer_close(&w) || !ok) {
+        fprintf(stderr, "Error: could not write %s\n", out_path);
+        return 1;
+    }
+    fprintf(stderr, "encoded %llu accesses into %llu records, %llu bytes (%.2f bytes/access)\n",
+            w.accesses, w.records, w.bytes, w.accesses ? (double)w.bytes / (double)w.accesses : 0.0);
+    return 0;
+}
+
+// ---- Checking the fast paths against the reference (--verify) ----
+//
+// Every shortcut in this file (the compressed store, run-length collapsing,
+// stride runs, lockstep sweeps, stack distances) promises the same numbers
+// as calling cache_access once per access. --verify holds them to it: each
+// trace (a few synthetic ones, plus any given) goes through the plain
+// cache_access loop and through every engine, and the statistics and
+// cache_state_hash are compared every --verify=N accesses. When an engine
+// disagrees, the trace up to that point is shrunk with delta debugging
+// (ddmin) to a few accesses that still show it, and written out as a text
+// trace to reproduce the bug with.
+
+#define VERIFY_SYNTH 200000         // accesses per synthetic trace
+#define VERIFY_MAX_TESTS 4000       // stop shrinking after this many tries
+
+// A whole trace in memory, as plain arrays.
+typedef struct {
+    unsigned long long *addrs;
+    char *ops;
+    size_t n, cap;
+} vtrace_t;
+
+static void vtrace_free(vtrace_t *t) {
+    free(t->addrs);
+    free(t->ops);
+    memset(t, 0, sizeof(*t));
+}
+
+static bool vtrace_push(vtrace_t *t, char op, unsigned long long addr) {
+    if (t->n == t->cap) {
+        size_t cap = t->cap ? 2 * t->cap : TRACE_CHUNK;
+        unsigned long long *a = (unsigned long long*)realloc(t->addrs, cap * sizeof(unsigned long long));
+        if (a) t->addrs = a;
+        char *o = (char*)realloc(t->ops, cap);
+        if (o) t->ops = o;
+        if (!a || !o) return false;
+        t->cap = cap;
+    }
+    t->addrs[t->n] = addr;
+    t->ops[t->n] = op;
+    t->n++;
+    return true;
+}
+
+// Read a trace file (text or binary) into memory.
+static bool vtrace_load(vtrace_t *t, const char *path) {
+    memset(t, 0, sizeof(*t));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open the trace file: %s\n", path);
+        return false;
+    }
+    reader_t r;
+    if (!reader_open_file(&r, fp)) {
+        fclose(fp);
+        return false;
+    }
+    chunk_buf_t buf;
+    bool ok = chunk_buf_init(&buf, false);
+    size_t n;
+    while (ok && (n = reader_next(&r, buf.addrs, buf.ops)) > 0) {
+        for (size_t i = 0; i < n && ok; ++i) ok = vtrace_push(t, buf.ops[i], buf.addrs[i]);
+    }
+    chunk_buf_free(&buf);
+    reader_close(&r);
+    fclose(fp);
+    if (!ok) fprintf(stderr, "Out of memory while loading %s\n", path);
+    return ok;
+}
+
+// The accesses of t listed in idx[0..m), as a trace of their own.
+static bool vtrace_pick(vtrace_t *out, const vtrace_t *t, const size_t *idx, size_t m) {
+    memset(out, 0, sizeof(*out));
+    bool ok = true;
+    for (size_t i = 0; i < m && ok; ++i) ok = vtrace_push(out, t->ops[idx[i]], t->addrs[idx[i]]);
+    return ok;
+}
+
+// xorshift64*: plenty random for test traces, and the same on every machine.
+static inline unsigned long long verify_rand(unsigned long long *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+#define NSYNTH 4
+static const char *const SYNTH_NAMES[NSYNTH] = {
+    "synthetic-random", "synthetic-strides", "synthetic-bursts", "synthetic-sweeps"
+};
+
+// Make one of the synthetic traces, each aimed at some of the engines.
+static bool vtrace_synth(vtrace_t *t, int kind, size_t n, unsigned long long seed) {
+    static const long long strides[8] = { 0, 4, 8, 16, 64, 200, -8, -128 };
+    memset(t, 0, sizeof(*t));
+    unsigned long long s = seed * 0x9e3779b97f4a7c15ULL + 1;
+    bool ok = true;
+    while (ok && t->n < n) {
+        unsigned long long r = verify_rand(&s);
+        char op = (r >> 60) < 5 ? 'W' : 'R';    // about 30% writes
+        if (kind == 0) {
+            // anywhere in 1 MB
+            ok = vtrace_push(t, op, (r >> 8) % (1 << 20));
+        } else if (kind == 1) {
+            // stride runs, what binary traces are made of
+            long long stride = strides[(r >> 4) & 7];
+            unsigned long long base = (r >> 20) % (1ULL << 24);
+            size_t len = 1 + (size_t)((r >> 8) % 300);
+            for (size_t k = 0; k < len && ok && t->n < n; ++k)
+                ok = vtrace_push(t, op, base + (unsigned long long)(stride * (long long)k));
+        } else if (kind == 2) {
+            // bursts of reads and writes to one block (for run-length
+            // collapsing), low blocks picked more often
+            unsigned long long u = (r >> 32) % 4096;
+            unsigned long long block = u * u / 4096;
+            size_t len = 1 + (size_t)((r >> 8) % 20);
+            for (size_t k = 0; k < len && ok && t->n < n; ++k) {
+                unsigned long long q = verify_rand(&s);
+                ok = vtrace_push(t, (q >> 62) == 0 ? 'W' : 'R', block * BLOCK_SIZE + (q >> 20) % BLOCK_SIZE);
+            }
+        } else {
+            // sweeps over arrays of 16 to 2048 blocks
+            size_t lines = (size_t)16 << ((r >> 4) % 8);
+            unsigned long long base = ((r >> 24) % 64) << 20;
+            for (size_t k = 0; k < lines && ok && t->n < n; ++k)
+                ok = vtrace_push(t, op, base + k * BLOCK_SIZE);
+        }
+    }
+    return ok;
+}
+
+// What --verify compares at every checkpoint.
+typedef struct {
+    unsigned long long hits, misses, mem_reads, mem_writes, writes;
+    unsigned long long hash;    // cache_state_hash
+} vstate_t;
+
+static void vstate_of(vstate_t *v, const cache_t *c) {
+    v->hits = c->hits;
+    v->misses = c->misses;
+    v->mem_reads = c->mem_reads;
+    v->mem_writes = c->mem_writes;
+    v->writes = c->writes;
+    v->hash = c->track_state ? c->state_hash : cache_state_hash(c);
+}
+
+static bool vstate_same(const vstate_t *a, const vstate_t *b) {
+    return a->hits == b->hits && a->misses == b->misses && a->mem_reads == b->mem_reads &&
+           a->mem_writes == b->mem_writes && a->writes == b->writes && a->hash == b->hash;
+}
+
+// state-hash is plain cache_access too, but with track_state: it checks the
+// incrementally kept hash against cache_state_hash.
+enum { V_STORE, V_RLE, V_STRIDE, V_LOCKSTEP, V_LOCKSTEP_RLE, V_STATE_HASH, V_STACKDIST, V_PARALLEL_SD, V_ENGINES };
+static const char *const V_NAMES[V_ENGINES] = {
+    "store", "rle", "stride", "lockstep", "lockstep-rle", "state-hash", "stackdist", "parallel-stackdist"
+};
+
+typedef struct {
+    const vtrace_t *t;
+    const config_t *cfgs;       // all valid
+    size_t ncfg;
+    size_t every;               // accesses between checkpoints
+    size_t nseg;
+    trace_store_t **segs;       // the trace cut at every checkpoint
+    vstate_t *ref;              // ref[k * nseg + s]: config k after segment s, per cache_access
+    size_t threads;             // for parallel stack distances
+} verify_t;
+
+// Where an engine first went wrong.
+typedef struct {
+    size_t cfg;
+    size_t seg;
+    vstate_t want, got;
+} vfail_t;
+
+static void verify_free(verify_t *v) {
+    for (size_t s = 0; v->segs && s < v->nseg; ++s) store_destroy(v->segs[s]);
+    free(v->segs);
+    free(v->ref);
+    memset(v, 0, sizeof(*v));
+}
+
+// Accesses [lo, hi) of the trace in a store of their own.
+static trace_store_t *verify_store(const vtrace_t *t, size_t lo, size_t hi) {
+    trace_store_t *st = store_create();
+    bool ok = st != NULL;
+    for (size_t i = lo; i < hi && ok; ++i) ok = store_append(st, t->ops[i], t->addrs[i]);
+    if (ok && store_seal(st)) return st;
+    store_destroy(st);
+    return NULL;
+}
+
+// Cut the trace at the checkpoints and run the reference over it. Returns
+// false if we ran out of memory (verify_free cleans up either way).
+static bool verify_setup(verify_t *v, const vtrace_t *t, const config_t *cfgs, size_t ncfg,
+                         size_t every, size_t threads) {
+    memset(v, 0, sizeof(*v));
+    v->t = t;
+    v->cfgs = cfgs;
+    v->ncfg = ncfg;
+    v->every = every;
+    v->nseg = t->n ? (t->n + every - 1) / every : 1;
+    v->threads = threads;
+    v->segs = (trace_store_t**)calloc(v->nseg, sizeof(trace_store_t*));
+    v->ref = (vstate_t*)calloc(ncfg * v->nseg, sizeof(vstate_t));
+    if (!v->segs || !v->ref) return false;
+    for (size_t s = 0; s < v->nseg; ++s) {
+        size_t lo = s * every, hi = t->n - lo < every ? t->n : lo + every;
+        if (!(v->segs[s] = verify_store(t, lo, hi))) return false;
+    }
+
+    // the reference: one cache_access per access
+    for (size_t k = 0; k < ncfg; ++k) {
+        cache_t c;
+        if (!cache_init(&c, cfgs[k].cache_size, cfgs[k].assoc, cfgs[k].replacement, cfgs[k].writeback))
+            return false;
+        for (size_t s = 0; s < v->nseg; ++s) {
+            size_t lo = s * every, hi = t->n - lo < every ? t->n : lo + every;
+            for (size_t i = lo; i < hi; ++i) cache_access(&c, t->ops[i], t->addrs[i]);
+            vstate_of(&v->ref[k * v->nseg + s], &c);
+        }
+        cache_fini(&c);
+    }
+    return true;
+}
+
+// Feed segment s to one cache through the store, rle, stride or state-hash engine.
+static bool verify_feed(const verify_t *v, int engine, cache_t *c, size_t s) {
+    reader_t r;
+    size_t lo = s * v->every, hi = v->t->n - lo < v->every ? v->t->n : lo + v->every;
+    if (engine == V_STATE_HASH) {
+        for (size_t i = lo; i < hi; ++i) cache_access(c, v->t->ops[i], v->t->addrs[i]);
+        return true;
+    }
+    if (engine != V_STRIDE) {
+        reader_open_store(&r, v->segs[s]);
+        return simulate(c, &r, engine == V_RLE, NULL);
+    }
+
+    // through a binary trace of stride runs, kept in memory
+    char *bin = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&bin, &len);
+    if (!fp) return false;
+    bt_writer_t w;
+    bt_writer_start(&w, fp, NULL);
+    for (size_t i = lo; i < hi; ++i) bt_write(&w, v->t->ops[i], v->t->addrs[i]);
+    bool ok = bt_writer_close(&w);
+    fp = ok ? fmemopen(bin, len, "rb") : NULL;
+    ok = fp && reader_open_file(&r, fp) && simulate(c, &r, false, NULL);
+    if (fp) {
+        reader_close(&r);
+        fclose(fp);
+    }
+    free(bin);
+    return ok;
+}
+
+// Stack distances only model fully associative LRU caches that allocate on
+// every miss (so write-back).
+static bool verify_sd_config(const config_t *cfg) {
+    return cfg->replacement == 0 && cfg->writeback == 1 && cfg->cache_size / BLOCK_SIZE == cfg->assoc;
+}
+
+static void verify_mismatch(const verify_t *v, vfail_t *f, size_t cfg, size_t s, const vstate_t *got) {
+    f->cfg = cfg;
+    f->seg = s;
+    f->want = v->ref[cfg * v->nseg + s];
+    f->got = *got;
+}
+
+// Run one engine over the trace and compare it with the reference at every
+// checkpoint. Returns 1 if it agrees, 0 if not (f says where) and -1 if it
+// couldn't run.
+static int verify_engine(const verify_t *v, int engine, vfail_t *f) {
+    int agree = 1;
+    if (engine == V_LOCKSTEP || engine == V_LOCKSTEP_RLE) {
+        lockstep_t ls;
+        if (!lockstep_init(&ls, v->cfgs, v->ncfg)) return -1;
+        for (size_t s = 0; s < v->nseg && agree == 1; ++s) {
+            reader_t r;
+            reader_open_store(&r, v->segs[s]);
+            if (!lockstep_run(&ls, &r, engine == V_LOCKSTEP_RLE)) agree = -1;
+            for (size_t k = 0; k < ls.ncaches && agree == 1; ++k) {
+                vstate_t got;
+                vstate_of(&got, &ls.caches[k]);
+                if (!vstate_same(&got, &v->ref[ls.cfg_index[k] * v->nseg + s])) {
+                    verify_mismatch(v, f, ls.cfg_index[k], s, &got);
+                    agree = 0;
+                }
+            }
+        }
+        lockstep_free(&ls);
+        return agree;
+    }
+
+    if (engine == V_STACKDIST || engine == V_PARALLEL_SD) {
+        // only the end of the trace: the misses of each fully associative cache
+        stackdist_t sd;
+        if (!sd_init(&sd)) return -1;
+        bool ok = true;
+        if (engine == V_STACKDIST) {
+            for (size_t s = 0; s < v->nseg && ok; ++s) {
+                reader_t r;
+                reader_open_store(&r, v->segs[s]);
+                ok = sd_run(&sd, &r);
+            }
+        } else {
+            trace_store_t *whole = verify_store(v->t, 0, v->t->n);
+            block_ids_t bi;
+            ok = whole && block_ids_build(&bi, whole, v->threads) && sd_run_parallel(&sd, &bi, v->threads);
+            if (whole) block_ids_free(&bi);
+            store_destroy(whole);
+        }
+        if (!ok) agree = -1;
+        size_t last = v->nseg - 1;
+        for (size_t k = 0; k < v->ncfg && agree == 1; ++k) {
+            if (!verify_sd_config(&v->cfgs[k])) continue;
+            vstate_t got = v->ref[k * v->nseg + last];
+            got.misses = sd_misses(&sd, v->cfgs[k].assoc);
+            got.hits = v->t->n - got.misses;
+            if (!vstate_same(&got, &v->ref[k * v->nseg + last])) {
+                verify_mismatch(v, f, k, last, &got);
+                agree = 0;
+            }
+        }
+        sd_free(&sd);
+        return agree;
+    }
+
+    for (size_t k = 0; k < v->ncfg && agree == 1; ++k) {
+        cache_t c;
+        const config_t *cfg = &v->cfgs[k];
+        if (!cache_init(&c, cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback)) return -1;
+        if (engine == V_STATE_HASH && !cache_track_state(&c)) {
+            cache_fini(&c);
+            return -1;
+        }
+        for (size_t s = 0; s < v->nseg && agree == 1; ++s) {
+            vstate_t got;
+            if (!verify_feed(v, engine, &c, s)) {
+                agree = -1;
+                break;
+            }
+            vstate_of(&got, &c);
+            if (!vstate_same(&got, &v->ref[k * v->nseg + s])) {
+                verify_mismatch(v, f, k, s, &got);
+                agree = 0;
+            }
+        }
+        cache_fini(&c);
+    }
+    return agree;
+}
+
+// Does the engine still disagree with cache_access about cfg on this trace?
+static bool verify_fails(const vtrace_t *t, int engine, const config_t *cfg, size_t threads) {
+    verify_t v;
+    bool fails = false;
+    if (verify_setup(&v, t, cfg, 1, t->n ? t->n : 1, threads)) {
+        vfail_t f;
+        fails = verify_engine(&v, engine, &f) == 0;
+    }
+    verify_free(&v);
+    return fails;
+}
+
+// Shrink the failing trace with delta debugging: try keeping just one chunk of
+// the accesses, then dropping one chunk, and use smaller chunks whenever
+// neither still fails. idx[0..*m) are the accesses kept. Returns false if we
+// ran out of memory.
+static bool verify_shrink(const vtrace_t *t, int engine, const config_t *cfg, size_t threads,
+                          size_t *idx, size_t *m) {
+    size_t *trial = (size_t*)malloc((*m ? *m : 1) * sizeof(size_t));
+    if (!trial) return false;
+    size_t parts = 2, tests = 0;
+    while (*m >= 2 && tests < VERIFY_MAX_TESTS) {
+        bool shrunk = false;
+        size_t chunk = (*m + parts - 1) / parts;
+        for (int drop = 0; drop < 2 && !shrunk; ++drop) {
+            for (size_t lo = 0; lo < *m && !shrunk && tests < VERIFY_MAX_TESTS; lo += chunk) {
+                size_t hi = *m - lo < chunk ? *m : lo + chunk, n = 0;
+                for (size_t i = 0; i < *m; ++i) {
+                    if ((i >= lo && i < hi) != (drop == 1)) trial[n++] = idx[i];
+                }
+                if (n == 0 || n == *m) continue;
+                vtrace_t sub;
+                if (!vtrace_pick(&sub, t, trial, n)) {
+                    vtrace_free(&sub);
+                    free(trial);
+                    return false;
+                }
+                tests++;
+                if (verify_fails(&sub, engine, cfg, threads)) {
+                    memcpy(idx, trial, n * sizeof(size_t));
+                    *m = n;
+                    parts = drop ? (parts > 2 ? parts - 1 : 2) : 2;
+                    shrunk = true;
+                }
+                vtrace_free(&sub);
+            }
+        }
+        if (!shrunk) {
+            if (parts >= *m) break;
+            parts = 2 * parts < *m ? 2 * parts : *m;
+        }
+    }
+    free(trial);
+    return true;
+}
+
+// Say how an engine went wrong, shrink the trace up to there and write it out.
+static void verify_report(const verify_t *v, int engine, const vfail_t *f) {
+    const config_t *cfg = &v->cfgs[f->cfg];
+    size_t m = (f->seg + 1) * v->every < v->t->n ? (f->seg + 1) * v->every : v->t->n;
+    printf("  %zu %zu %d %d after %zu accesses:\n", cfg->cache_size, cfg->assoc, cfg->replacement,
+           cfg->writeback, m);
+    printf("    %-10s %18s %18s\n", "", "cache_access", V_NAMES[engine]);
+    printf("    %-10s %18llu %18llu\n", "hits", f->want.hits, f->got.hits);
+    printf("    %-10s %18llu %18llu\n", "misses", f->want.misses, f->got.misses);
+    printf("    %-10s %18llu %18llu\n", "mem_reads", f->want.mem_reads, f->got.mem_reads);
+    printf("    %-10s %18llu %18llu\n", "mem_writes", f->want.mem_writes, f->got.mem_writes);
+    printf("    %-10s %18llu %18llu\n", "writes", f->want.writes, f->got.writes);
+    printf("    %-10s 0x%016llx 0x%016llx\n", "state", f->want.hash, f->got.hash);
+
+    size_t *idx = (size_t*)malloc((m ? m : 1) * sizeof(size_t));
+    if (!idx) {
+        fprintf(stderr, "Out of memory.\n");
+        return;
+    }
+    for (size_t i = 0; i < m; ++i) idx[i] = i;
+    if (!verify_shrink(v->t, engine, cfg, v->threads, idx, &m))
+        fprintf(stderr, "Out of memory while shrinking the trace.\n");
+
+    char path[128];
+    snprintf(path, sizeof(path), "verify-%s-%zu-%zu-%d-%d.t", V_NAMES[engine], cfg->cache_size,
+             cfg->assoc, cfg->replacement, cfg->writeback);
+    FILE *fp = fopen(path, "w");
+    bool ok = fp != NULL;
+    for (size_t i = 0; i < m && ok; ++i) ok = fprintf(fp, "%c 0x%llx\n", v->t->ops[idx[i]], v->t->addrs[idx[i]]) > 0;
+    if (fp && fclose(fp) != 0) ok = false;
+    if (ok) {
+        printf("  wrote %s (%zu accesses); replay it with --verify %zu %zu %d %d %s\n", path, m,
+               cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback, path);
+    } else {
+        fprintf(stderr, "Error: could not write %s\n", path);
+    }
+    free(idx);
+}
+
+// Check every engine on one trace. Returns 1 if they all agree, 0 if one
+// didn't and -1 if the checks couldn't run.
+static int verify_trace(const char *name, const vtrace_t *t, const config_t *cfgs, size_t ncfg,
+                        size_t every, size_t threads) {
+    verify_t v;
+    if (!verify_setup(&v, t, cfgs, ncfg, every, threads)) {
+        verify_free(&v);
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+    size_t nsd = 0;
+    for (size_t k = 0; k < ncfg; ++k) nsd += verify_sd_config(&cfgs[k]);
+
+    int result = 1;
+    for (int e = 0; e < V_ENGINES; ++e) {
+        bool sd = (e == V_STACKDIST || e == V_PARALLEL_SD);
+        printf("verify: %-20s %-18s ", name, V_NAMES[e]);
+        if (sd && nsd == 0) {
+            printf("skipped (no fully associative LRU write-back configuration)\n");
+            continue;
+        }
+        vfail_t f;
+        int r = verify_engine(&v, e, &f);
+        if (r == 1) {
+            printf("ok (%zu configurations, %zu checkpoints)\n", sd ? nsd : ncfg, sd ? (size_t)1 : v.nseg);
+        } else if (r < 0) {
+            printf("could not run (out of memory)\n");
+            result = -1;
+        } else {
+            printf("MISMATCH\n");
+            verify_report(&v, e, &f);
+            if (result == 1) result = 0;
+        }
+    }
+    verify_free(&v);
+    return result;
+}
+
+// Reading the file line by line (fgets) must give exactly the same accesses
+// as the parallel text parser. The parser is checked with --io=uring if that
+// was asked for and with mmap otherwise, on at least 4 threads so the splits
+// between them get checked even on one CPU.
+static int verify_parser(const char *path) {
+    int saved_mode = io_mode;
+    size_t saved_threads = text_threads;
+    vtrace_t plain, par;
+    memset(&par, 0, sizeof(par));
+    io_mode = IO_STDIO;
+    bool ok = vtrace_load(&plain, path);
+    io_mode = saved_mode == IO_STDIO ? IO_MMAP : saved_mode;
+    if (text_threads < 4) text_threads = 4;
+    ok = ok && vtrace_load(&par, path);
+    io_mode = saved_mode;
+    text_threads = saved_threads;
+    int same = ok ? (plain.n == par.n && memcmp(plain.addrs, par.addrs, par.n * sizeof(unsigned long long)) == 0 &&
+                     memcmp(plain.ops, par.ops, par.n) == 0) : -1;
+    vtrace_free(&plain);
+    vtrace_free(&par);
+    return same;
+}
+
+static int run_verify(const config_t *cfgs, size_t ncfg, char **paths, size_t npaths, const options_t *opt) {
+    // only the configurations that make a cache take part
+    config_t *valid = (config_t*)calloc(ncfg, sizeof(config_t));
+    if (!valid) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    size_t nvalid = 0;
+    for (size_t k = 0; k < ncfg; ++k) {
+        if (config_valid(&cfgs[k])) valid[nvalid++] = cfgs[k];
+        else fprintf(stderr, "Skipping invalid configuration: size %zu assoc %zu\n", cfgs[k].cache_size, cfgs[k].assoc);
+    }
+    if (nvalid == 0) {
+        fprintf(stderr, "No valid configuration.\n");
+        free(valid);
+        return 1;
+    }
+
+    // the parallel stack distance engine gets a few threads even on one CPU,
+    // so its merge always gets checked
+    size_t threads = job_count(opt) > 4 ? job_count(opt) : 4;
+    int worst = 1;
+    for (size_t i = 0; i < NSYNTH + npaths && worst >= 0; ++i) {
+        vtrace_t t;
+        const char *name = i < NSYNTH ? SYNTH_NAMES[i] : paths[i - NSYNTH];
+        bool ok = i < NSYNTH ? vtrace_synth(&t, (int)i, VERIFY_SYNTH, i + 1) : vtrace_load(&t, name);
+        int r = ok ? 1 : -1;
+        if (ok && i >= NSYNTH) {
+            r = verify_parser(name);
+            printf("verify: %-20s %-18s %s\n", name, "parser", r == 1 ? "ok" : r == 0 ? "MISMATCH" : "could not run");
+        }
+        if (ok) {
+            int e = verify_trace(name, &t, valid, nvalid, (size_t)opt->verify_every, threads);
+            if (e < r) r = e;
+        }
+        if (r < worst) worst = r;
+        vtrace_free(&t);
+    }
+    free(valid);
+
+    if (worst == 1) printf("verify: every engine agrees with cache_access\n");
+    else if (worst == 0) printf("verify: some engines disagree with cache_access (see above)\n");
+    return worst == 1 ? 0 : 1;
+}
+
+// Only every UMON_SAMPLE-th set is watched by the utility monitors.
+#define UMON_SAMPLE 32
+
+// Utility monitor (UMON) for one source: a shadow LRU tag directory for a few
+// sampled sets, as if the source had the whole cache to itself. Counting hits
+// by stack position tells how many hits each extra way would give it.
+typedef struct {
+    unsigned long long *stack;  // per sampled set: assoc tags, most recent first
+    unsigned char *depth;       // per sampled set: valid entries in stack
+    unsigned long long *hits;   // hits at each stack position (aged every interval)
+    unsigned long long *total_hits; // same, never aged (for the final miss curves)
+    unsigned long long accesses;    // sampled accesses, never aged
+} umon_t;
+
+// Way partitioning state for a shared cache.
+typedef struct {
+    size_t nsrc;
+    size_t assoc;
+    size_t sample_every;        // watch sets where set_idx % sample_every == 0
+    size_t nsampled;
+    umon_t *umon;               // one per source
+    unsigned int *ways;         // ways each source gets right now
+    unsigned int *history;      // ways per source after each UCP decision
+    size_t ndecisions, cap;
+} part_t;
+
+// Turn per-source way counts into masks of neighbouring ways.
+static void part_apply(part_t *p, cache_t *c) {
+    size_t next = 0;
+    for (size_t k = 0; k < p->nsrc; ++k) {
+        unsigned long long mask = 0;
+        for (unsigned int w = 0; w < p->ways[k]; ++w, ++next) mask |= 1ULL << next;
+        c->way_mask[k] = mask;
+    }
+}
+
+static void part_destroy(part_t *p) {
+    if (!p) return;
+    for (size_t k = 0; k < p->nsrc && p->umon; ++k) {
+        free(p->umon[k].stack);
+        free(p->umon[k].depth);
+        free(p->umon[k].hits);
+        free(p->umon[k].total_hits);
+    }
+    free(p->umon);
+    free(p->ways);
+    free(p->history);
+    free(p);
+}
+
+// Set up partitioning for nsrc sources. Static partitions use the given way
+// counts; UCP starts from an even split.
+static part_t *part_create(cache_t *c, size_t nsrc, const options_t *opt) {
+    if (c->assoc > 64 || nsrc > c->assoc) {
+        fprintf(stderr, "Partitioning needs at most 64 ways and at least one way per trace.\n");
+        return NULL;
+    }
+    part_t *p = (part_t*)calloc(1, sizeof(part_t));
+    if (!p) return NULL;
+    p->nsrc = nsrc;
+    p->assoc = c->assoc;
+    p->sample_every = c->num_sets < UMON_SAMPLE ? 1 : UMON_SAMPLE;
+    p->nsampled = (c->num_sets + p->sample_every - 1) / p->sample_every;
+    p->umon = (umon_t*)calloc(nsrc, sizeof(umon_t));
+    p->ways = (unsigned int*)calloc(nsrc, sizeof(unsigned int));
+    c->way_mask = (unsigned long long*)calloc(nsrc, sizeof(unsigned long long));
+    bool ok = p->umon && p->ways && c->way_mask;
+    for (size_t k = 0; ok && k < nsrc; ++k) {
+        umon_t *u = &p->umon[k];
+        u->stack = (unsigned long long*)calloc(p->nsampled * c->assoc, sizeof(unsigned long long));
+        u->depth = (unsigned char*)calloc(p->nsampled, 1);
+        u->hits = (unsigned long long*)calloc(c->assoc, sizeof(unsigned long long));
+        u->total_hits = (unsigned long long*)calloc(c->assoc, sizeof(unsigned long long));
+        ok = u->stack && u->depth && u->hits && u->total_hits;
+    }
+    if (!ok) {
+        part_destroy(p);
+        return NULL;
+    }
+
+    if (opt->partition == PART_STATIC) {
+        unsigned long long sum = 0;
+        for (size_t k = 0; k < nsrc; ++k) {
+            p->ways[k] = (unsigned int)opt->part_ways[k < opt->npart_ways ? k : opt->npart_ways - 1];
+            sum += p->ways[k];
+        }
+        if (sum > c->assoc) {
+            fprintf(stderr, "The partitions add up to %llu ways but the cache only has %zu.\n", sum, c->assoc);
+            part_destroy(p);
+            return NULL;
+        }
+    } else {
+        for (size_t k = 0; k < nsrc; ++k)
+            p->ways[k] = (unsigned int)(c->assoc / nsrc + (k < c->assoc % nsrc ? 1 : 0));
+    }
+    part_apply(p, c);
+    return p;
+}
+
+// Feed one access of source `src` to its utility monitor.
+static void umon_access(part_t *p, size_t src, size_t set_idx, unsigned long long tag) {
+    if (set_idx % p->sample_every != 0) return;
+    umon_t *u = &p->umon[src];
+    size_t s = set_idx / p->sample_every;
+    unsigned long long *stack = u->stack + s * p->assoc;
+    size_t depth = u->depth[s];
+
+    u->accesses++;
+    size_t pos = 0;
+    while (pos < depth && stack[pos] != tag) pos++;
+    if (pos < depth) {
+        u->hits[pos]++;
+        u->total_hits[pos]++;
+    } else if (depth < p->assoc) {
+        u->depth[s] = (unsigned char)++depth;
+    } else {
+        pos = depth - 1; // drop the least recently used tag
+    }
+    // move the tag to the front
+    for (size_t i = pos; i > 0; --i) stack[i] = stack[i - 1];
+    stack[0] = tag;
+}
+
+// Hits source k would get with `ways` ways, according to its monitor.
+static unsigned long long umon_utility(const umon_t *u, size_t ways) {
+    unsigned long long h = 0;
+    for (size_t i = 0; i < ways; ++i) h += u->hits[i];
+    return h;
+}
+
+// UCP's lookahead algorithm: everyone gets one way, then the remaining ways go
+// out in steps to whoever gains the most hits per extra way.
+static void part_decide(part_t *p, cache_t *c) {
+    size_t balance = p->assoc - p->nsrc;
+    for (size_t k = 0; k < p->nsrc; ++k) p->ways[k] = 1;
+
+    while (balance > 0) {
+        size_t best_src = 0, best_step = 1;
+        double best_mu = -1.0;
+        for (size_t k = 0; k < p->nsrc; ++k) {
+            unsigned long long base = umon_utility(&p->umon[k], p->ways[k]);
+            for (size_t step = 1; step <= balance; ++step) {
+                double mu = (double)(umon_utility(&p->umon[k], p->ways[k] + step) - base) / (double)step;
+                if (mu > best_mu) {
+                    best_mu = mu;
+                    best_src = k;
+                    best_step = step;
+                }
+            }
+        }
+        p->ways[best_src] += (unsigned int)best_step;
+        balance -= best_step;
+    }
+    part_apply(p, c);
+
+    // age the monitors so newer behaviour counts more
+    for (size_t k = 0; k < p->nsrc; ++k) {
+        for (size_t i = 0; i < p->assoc; ++i) p->umon[k].hits[i] /= 2;
+    }
+
+    if (p->ndecisions == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 64;
+        unsigned int *h = (unsigned int*)realloc(p->history, cap * p->nsrc * sizeof(unsigned int));
+        if (!h) return;
+        p->history = h;
+        p->cap = cap;
+    }
+    memcpy(p->history + p->ndecisions * p->nsrc, p->ways, p->nsrc * sizeof(unsigned int));
+    p->ndecisions++;
+}
+
+// Print the partition history and each source's miss curve: estimated misses
+// if it had 1, 2, ... ways of the whole cache to itself.
+static void part_report(const part_t *p, const options_t *opt, unsigned long long interval) {
+    printf("\nWay partitioning: %s", opt->partition == PART_UCP ? "ucp" : "static");
+    if (opt->partition == PART_UCP) printf(", decided every %llu accesses", interval);
+    printf("\ndecision");
+    for (size_t k = 0; k < p->nsrc; ++k) printf(",src%zu_ways", k);
+    printf("\n");
+    if (opt->partition == PART_STATIC) {
+        printf("0");
+        for (size_t k = 0; k < p->nsrc; ++k) printf(",%u", p->ways[k]);
+        printf("\n");
+    }
+    for (size_t d = 0; d < p->ndecisions; ++d) {
+        printf("%zu", d + 1);
+        for (size_t k = 0; k < p->nsrc; ++k) printf(",%u", p->history[d * p->nsrc + k]);
+        printf("\n");
+    }
+
+    printf("\nMiss curves (sampling 1 in %zu sets, misses scaled up)\nsource,ways,misses,miss_ratio\n",
+           p->sample_every);
+    for (size_t k = 0; k < p->nsrc; ++k) {
+        const umon_t *u = &p->umon[k];
+        unsigned long long hits = 0;
+        for (size_t w = 1; w <= p->assoc; ++w) {
+            hits += u->total_hits[w - 1];
+            unsigned long long misses = u->accesses - hits;
+            printf("%zu,%zu,%llu,%f\n", k, w, misses * p->sample_every,
+                   u->accesses ? (double)misses / (double)u->accesses : 0.0);
+        }
+    }
+}
+
+// One trace feeding a shared cache.
+typedef struct {
+    const char *path;
+    FILE *fp;
+    reader_t r;
+    chunk_buf_t buf;
+    unsigned long long *ts;
+    size_t n, next;         // accesses in buf, and the next one to use
+    bool done;
+    long long credit;       // for the weighted schedule
+} mix_src_t;
+
+// Make sure the source has an access ready. Returns false once it is used up.
+static bool mix_src_ready(mix_src_t *m) {
+    if (m->done) return false;
+    if (m->next < m->n) return true;
+    m->n = reader_next_ts(&m->r, m->buf.addrs, m->buf.ops, m->ts);
+    m->next = 0;
+    if (m->n == 0) m->done = true;
+    return !m->done;
+}
+
+// Pick the source of the next access, or return -1 when all are used up.
+static int mix_pick(mix_src_t *srcs, size_t nsrc, const options_t *opt, int cur, unsigned long long *turn_used) {
+    if (opt->mix == MIX_RR) {
+        // stay with the current source for `quantum` accesses, then move on
+        if (cur >= 0 && *turn_used < opt->quantum && mix_src_ready(&srcs[cur])) {
+            (*turn_used)++;
+            return cur;
+        }
+        for (size_t k = 1; k <= nsrc; ++k) {
+            int s = (int)((size_t)(cur + (int)k) % nsrc);
+            if (mix_src_ready(&srcs[s])) {
+                *turn_used = 1;
+                return s;
+            }
+        }
+        return -1;
+    }
+
+    int best = -1;
+    if (opt->mix == MIX_WEIGHTED) {
+        // smooth weighted round robin: everyone earns their weight, the
+        // richest source goes and pays back the total
+        long long total = 0;
+        for (size_t k = 0; k < nsrc; ++k) {
+            if (!mix_src_ready(&srcs[k])) continue;
+            long long w = (long long)opt->weights[k < opt->nweights ? k : opt->nweights - 1];
+            srcs[k].credit += w;
+            total += w;
+            if (best < 0 || srcs[k].credit > srcs[best].credit) best = (int)k;
+        }
+        if (best >= 0) srcs[best].credit -= total;
+        return best;
+    }
+
+    // MIX_TIME: the earliest timestamp goes first
+    for (size_t k = 0; k < nsrc; ++k) {
+        if (!mix_src_ready(&srcs[k])) continue;
+        if (best < 0 || srcs[k].ts[srcs[k].next] < srcs[best].ts[srcs[best].next]) best = (int)k;
+    }
+    return best;
+}
+
+static const char *mix_name(const options_t *opt, char *buf, size_t len) {
+    if (opt->mix == MIX_RR) snprintf(buf, len, "rr:%llu", opt->quantum);
+    else if (opt->mix == MIX_WEIGHTED) snprintf(buf, len, "weighted");
+    else snprintf(buf, len, "time");
+    return buf;
+}
+
+// Interleave several traces into one shared cache. Hits, misses and memory
+// traffic are charged to the trace that made the access; write-backs to the
+// trace whose line was dirty.
+static int run_mix(const config_t *cfg, char **paths, size_t nsrc, const options_t *opt) {
+    if (nsrc > MAX_SOURCES) {
+        fprintf(stderr, "At most %d traces can share a cache.\n", MAX_SOURCES);
+        return 1;
+    }
+    cache_t *cache = cache_create(cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback);
+    mix_src_t *srcs = (mix_src_t*)calloc(nsrc, sizeof(mix_src_t));
+    if (!cache || !srcs) {
+        fprintf(stderr, "Could not set up cache.\n");
+        cache_destroy(cache);
+        free(srcs);
+        return 1;
+    }
+    cache->src = (src_stats_t*)calloc(nsrc, sizeof(src_stats_t));
+
+    int rc = cache->src ? 0 : 1;
+    for (size_t k = 0; k < nsrc && rc == 0; ++k) {
+        mix_src_t *m = &srcs[k];
+        m->path = paths[k];
+        m->fp = fopen(m->path, "rb");
+        if (!m->fp) {
+            fprintf(stderr, "Error: could not open the trace file: %s\n", m->path);
+            rc = 1;
+            break;
+        }
+        m->ts = (unsigned long long*)malloc(TRACE_CHUNK * sizeof(unsigned long long));
+        if (!reader_open_file(&m->r, m->fp) || !chunk_buf_init(&m->buf, false) || !m->ts) rc = 1;
+    }
+
+    part_t *part = NULL;
+    unsigned long long part_interval = opt->interval ? opt->interval : 100000;
+    if (rc == 0 && opt->partition != PART_NONE) {
+        part = part_create(cache, nsrc, opt);
+        if (!part) rc = 1;
+    }
+
+    // occupancy samples: one row of nsrc line counts per interval
+    unsigned long long *samples = NULL;
+    size_t nsamples = 0, cap = 0;
+
+    unsigned long long accesses = 0, turn_used = 0;
+    unsigned long long switches = 0, flushed = 0, flush_writes = 0;
+    int cur = -1;
+    while (rc == 0) {
+        int prev = cur;
+        cur = mix_pick(srcs, nsrc, opt, cur, &turn_used);
+        if (cur < 0) break;
+        if (prev >= 0 && cur != prev) {
+            switches++;
+            if (opt->flush_on_switch) {
+                unsigned long long mw = cache->mem_writes;
+                flushed += cache_flush(cache);
+                flush_writes += cache->mem_writes - mw;
+            }
+        }
+
+        mix_src_t *m = &srcs[cur];
+        src_stats_t *st = &cache->src[cur];
+        cache->cur_src = (unsigned int)cur;
+        cache->tag_src = (unsigned long long)cur << SRC_SHIFT;
+
+        unsigned long long addr = m->buf.addrs[m->next];
+        if (part) {
+            umon_access(part, (size_t)cur, get_set_index(addr, cache->num_sets),
+                        get_tag(addr, cache->num_sets));
+        }
+
+        unsigned long long h = cache->hits, mr = cache->mem_reads, mw = cache->mem_writes;
+        cache_access(cache, m->buf.ops[m->next], addr);
+        m->next++;
+        st->accesses++;
+        if (cache->hits != h) st->hits++;
+        else st->misses++;
+        st->mem_reads += cache->mem_reads - mr;
+        st->mem_writes += cache->mem_writes - mw;
+
+        accesses++;
+        if (part && opt->partition == PART_UCP && accesses % part_interval == 0) part_decide(part, cache);
+        if (opt->interval && accesses % opt->interval == 0) {
+            if (nsamples == cap) {
+                cap = cap ? cap * 2 : 256;
+                unsigned long long *ns = (unsigned long long*)realloc(samples, cap * nsrc * sizeof(unsigned long long));
+                if (!ns) { rc = 1; break; }
+                samples = ns;
+            }
+            for (size_t k = 0; k < nsrc; ++k) samples[nsamples * nsrc + k] = cache->src[k].lines;
+            nsamples++;
+        }
+    }
+
+    if (rc == 0) {
+        unsigned long long total = cache->hits + cache->misses;
+        double miss_ratio = (total > 0) ? (double)cache->misses / (double)total : 0.0;
+        printf("Miss ratio %f\n", miss_ratio);
+        printf("write %llu\n", cache->mem_writes);
+        printf("read %llu\n", cache->mem_reads);
+
+        char name[32];
+        printf("\nShared cache: %zu bytes, %zu-way, %s, %s, schedule %s\n", cfg->cache_size, cfg->assoc,
+               cfg->replacement == 0 ? "LRU" : "FIFO", cfg->writeback == 1 ? "WB" : "WT",
+               mix_name(opt, name, sizeof(name)));
+        printf("source,trace,accesses,hits,misses,miss_ratio,mem_reads,mem_writes,writebacks,evicted_by_other,lines_at_end\n");
+        for (size_t k = 0; k < nsrc; ++k) {
+            const src_stats_t *st = &cache->src[k];
+            printf("%zu,%s,%llu,%llu,%llu,%f,%llu,%llu,%llu,%llu,%llu\n", k, srcs[k].path, st->accesses,
+                   st->hits, st->misses, st->accesses ? (double)st->misses / (double)st->accesses : 0.0,
+                   st->mem_reads, st->mem_writes, st->writebacks, st->evicted_by_other, st->lines);
+        }
+
+        if (opt->flush_on_switch) {
+            printf("\nContext switches: %llu, cache flushed each time: %llu lines dropped, %llu written back\n",
+                   switches, flushed, flush_writes);
+        } else {
+            printf("\nContext switches: %llu, lines tagged per trace and kept across switches\n", switches);
+        }
+
+        if (nsamples > 0) {
+            printf("\nOccupancy (lines held by each source, every %llu accesses)\naccess", opt->interval);
+            for (size_t k = 0; k < nsrc; ++k) printf(",src%zu", k);
+            printf("\n");
+            for (size_t i = 0; i < nsamples; ++i) {
+                printf("%llu", (unsigned long long)(i + 1) * opt->interval);
+                for (size_t k = 0; k < nsrc; ++k) printf(",%llu", samples[i * nsrc + k]);
+                printf("\n");
+            }
+        }
+        if (part) part_report(part, opt, part_interval);
+    } else {
+        fprintf(stderr, "Could not read the traces.\n");
+    }
+
+    for (size_t k = 0; k < nsrc; ++k) {
+        if (srcs[k].fp) {
+            reader_close(&srcs[k].r);
+            fclose(srcs[k].fp);
+        }
+        chunk_buf_free(&srcs[k].buf);
+        free(srcs[k].ts);
+    }
+    free(srcs);
+    free(samples);
+    part_destroy(part);
+    cache_destroy(cache);
+    return rc;
+}
+
+// ---- Simulation daemon (--serve) ----
+//
+// Many small what-if runs over the same few traces spend most of their time
+// reading and parsing the trace again. With --serve=PATH, SIM stays up and
+// listens on a Unix socket instead. Every trace it is asked about is loaded
+// once into a compressed store and stays in memory until the daemon stops.
+// Each configuration of a request becomes a job for a pool of --jobs worker
+// threads, and results go back as soon as each one is done. --client=PATH is
+// the other end.
+//
+// The protocol is plain text, one request per line:
+//   SIM <SIZES> <ASSOCS> <REPLS> <WBS> <TRACE>   any number may be a list, like on
+//                                                the command line
+//   LOAD <TRACE>                                 load a trace ahead of time
+//   TRACES                                       list the traces in memory
+//   QUIT                                         close the connection
+//   SHUTDOWN                                     stop the daemon (requests already
+//                                                running on other connections
+//                                                still finish)
+// SIM answers with one line per configuration, in the order they finish:
+//   RESULT trace,size_bytes,assoc,replacement,wb,accesses,misses,miss_ratio,mem_writes,mem_reads
+// (the columns of the CSV for several traces), or "SKIP <why>" for one that
+// can't be built. Every request ends with "DONE", or "ERROR <why>" if it
+// couldn't run at all.
+
+#define SERVE_LINE 8192     // longest request line
+
+// A trace the daemon keeps in memory.
+typedef struct serve_trace {
+    char *path;
+    trace_store_t *st;      // NULL while it's being loaded
+    struct serve_trace *next;
+} serve_trace_t;
+
+// One SIM request. Its connection's thread waits until every job is done.
+typedef struct {
+    int fd;                 // the client
+    const char *trace;      // as the client named it, for the RESULT lines
+    const trace_store_t *st;
+    size_t left;            // jobs not finished yet
+    pthread_mutex_t lock;   // guards left and writing to fd
+    pthread_cond_t done;
+} serve_request_t;
+
+typedef struct serve_job {
+    serve_request_t *req;
+    config_t cfg;
+    struct serve_job *next;
+} serve_job_t;
+
+// A client connection, and the thread that reads its requests.
+typedef struct serve_conn {
+    struct server *sv;
+    int fd;
+    struct serve_conn *next;
+} serve_conn_t;
+
+typedef struct server {
+    const options_t *opt;
+    int listen_fd;
+    pthread_mutex_t lock;   // guards everything below
+    pthread_cond_t work;    // a job was queued, or we're stopping
+    pthread_cond_t loaded;  // a trace finished loading
+    serve_job_t *head, *tail;
+    serve_trace_t *traces;
+    serve_conn_t *conns;    // connections whose thread is still running
+    bool stopping;
+} server_t;
+
+// Write one line to a socket. A client that went away just makes this fail
+// (SIGPIPE is ignored while serving).
+static bool serve_send(int fd, const char *fmt, ...) {
+    char line[SERVE_LINE + 256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0) return false;
+    size_t n = (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1;
+    for (size_t done = 0; done < n;) {
+        ssize_t w = write(fd, line + done, n - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        done += (size_t)w;
+    }
+    return true;
+}
+
+// Find a trace in memory, loading it first if nobody has yet. Returns NULL
+// (and says why on fd) if it can't be read.
+static const trace_store_t *serve_trace_get(server_t *sv, int fd, const char *path) {
+    pthread_mutex_lock(&sv->lock);
+    for (;;) {
+        serve_trace_t *t = sv->traces;
+        while (t && strcmp(t->path, path) != 0) t = t->next;
+        if (t && t->st) {
+            pthread_mutex_unlock(&sv->lock);
+            return t->st;
+        }
+        if (!t) break;
+        // another connection is loading it; if that fails we try ourselves
+        pthread_cond_wait(&sv->loaded, &sv->lock);
+    }
+
+    // not there yet: add a placeholder, then load without holding the lock
+    serve_trace_t *t = (serve_trace_t*)calloc(1, sizeof(serve_trace_t));
+    if (t) t->path = strdup(path);
+    if (!t || !t->path) {
+        pthread_mutex_unlock(&sv->lock);
+        if (t) free(t);
+        serve_send(fd, "ERROR out of memory\n");
+        return NULL;
+    }
+    t->next = sv->traces;
+    sv->traces = t;
+    pthread_mutex_unlock(&sv->lock);
+
+    trace_store_t *st = store_load(path);
+
+    pthread_mutex_lock(&sv->lock);
+    if (st) {
+        t->st = st;
+    } else {
+        serve_trace_t **p = &sv->traces;
+        while (*p != t) p = &(*p)->next;
+        *p = t->next;
+        free(t->path);
+        free(t);
+    }
+    pthread_cond_broadcast(&sv->loaded);
+    pthread_mutex_unlock(&sv->lock);
+    if (!st) serve_send(fd, "ERROR could not load %s\n", path);
+    return st;
+}
+
+// A worker thread: run jobs until the daemon stops. Workers keep going while
+// any connection is still open, so its last request gets every answer.
+static void *serve_worker(void *arg) {
+    server_t *sv = (server_t*)arg;
+    for (;;) {
+        pthread_mutex_lock(&sv->lock);
+        while (!sv->head && !(sv->stopping && !sv->conns)) pthread_cond_wait(&sv->work, &sv->lock);
+        serve_job_t *job = sv->head;
+        if (!job) {
+            pthread_mutex_unlock(&sv->lock);
+            return NULL;
+        }
+        sv->head = job->next;
+        if (!sv->head) sv->tail = NULL;
+        pthread_mutex_unlock(&sv->lock);
+
+        serve_request_t *req = job->req;
+        const config_t *cfg = &job->cfg;
+        sim_result_t res;
+        cache_t c;
+        bool ok = cache_init(&c, cfg->cache_size, cfg->assoc, cfg->replacement, cfg->writeback);
+        if (ok) {
+            reader_t r;
+            reader_open_store(&r, req->st);
+            ok = simulate(&c, &r, sv->opt->rle, NULL);
+            result_from_cache(&res, &c);
+            cache_fini(&c);
+        }
+
+        pthread_mutex_lock(&req->lock);
+        if (ok) {
+            serve_send(req->fd, "RESULT %s,%zu,%zu,%s,%s,%llu,%llu,%f,%llu,%llu\n", req->trace,
+                       cfg->cache_size, cfg->assoc, cfg->replacement == 0 ? "LRU" : "FIFO",
+                       cfg->writeback == 1 ? "WB" : "WT", res.accesses, res.misses,
+                       result_miss_ratio(&res), res.mem_writes, res.mem_reads);
+        } else {
+            serve_send(req->fd, "SKIP size %zu assoc %zu: out of memory\n", cfg->cache_size, cfg->assoc);
+        }
+        if (--req->left == 0) pthread_cond_signal(&req->done);
+        pthread_mutex_unlock(&req->lock);
+        free(job);
+    }
+}
+
+// SIM <SIZES> <ASSOCS> <REPLS> <WBS> <TRACE>: queue a job per configuration
+// and wait for all of them.
+static void serve_sim(server_t *sv, int fd, const char *args) {
+    char lists[4][256];
+    int used = 0;
+    if (sscanf(args, "%255s %255s %255s %255s %n", lists[0], lists[1], lists[2], lists[3], &used) != 4 ||
+        !args[used]) {
+        serve_send(fd, "ERROR usage: SIM <SIZES> <ASSOCS> <REPLS> <WBS> <TRACE>\n");
+        return;
+    }
+    const char *trace = args + used;
+    unsigned long long v[4][MAX_LIST];
+    size_t n[4];
+    bool valid = true;
+    for (int k = 0; k < 4; ++k) valid = (n[k] = parse_list(lists[k], v[k], MAX_LIST)) > 0 && valid;
+    for (int k = 0; k < 2 && valid; ++k)
+        for (size_t i = 0; i < n[k]; ++i) valid = valid && v[k][i] != 0;
+    if (!valid) {
+        serve_send(fd, "ERROR invalid cache size or associativity\n");
+        return;
+    }
+    const trace_store_t *st = serve_trace_get(sv, fd, trace);
+    if (!st) return;
+
+    serve_request_t req;
+    req.fd = fd;
+    req.trace = trace;
+    req.st = st;
+    req.left = 0;
+    pthread_mutex_init(&req.lock, NULL);
+    pthread_cond_init(&req.done, NULL);
+
+    // build every job first, so none runs before we know how many there are
+    serve_job_t *first = NULL, *last = NULL;
+    bool ok = true;
+    for (size_t a = 0; a < n[0] && ok; ++a)
+        for (size_t b = 0; b < n[1] && ok; ++b)
+            for (size_t c = 0; c < n[2] && ok; ++c)
+                for (size_t d = 0; d < n[3] && ok; ++d) {
+                    config_t cfg = { (size_t)v[0][a], (size_t)v[1][b], (int)v[2][c], (int)v[3][d] };
+                    if (!config_valid(&cfg)) {
+                        serve_send(fd, "SKIP size %zu assoc %zu: not a whole number of sets\n",
+                                   cfg.cache_size, cfg.assoc);
+                        continue;
+                    }
+                    serve_job_t *job = (serve_job_t*)malloc(sizeof(serve_job_t));
+                    if (!(ok = job != NULL)) break;
+                    job->req = &req;
+                    job->cfg = cfg;
+                    job->next = NULL;
+                    if (last) last->next = job;
+                    else first = job;
+                    last = job;
+                    req.left++;
+                }
+    if (!ok) {
+        while (first) {
+            serve_job_t *next = first->next;
+            free(first);
+            first = next;
+        }
+        serve_send(fd, "ERROR out of memory\n");
+    } else if (first) {
+        pthread_mutex_lock(&sv->lock);
+        if (sv->tail) sv->tail->next = first;
+        else sv->head = first;
+        sv->tail = last;
+        pthread_cond_broadcast(&sv->work);
+        pthread_mutex_unlock(&sv->lock);
+
+        pthread_mutex_lock(&req.lock);
+        while (req.left > 0) pthread_cond_wait(&req.done, &req.lock);
+        pthread_mutex_unlock(&req.lock);
+    }
+    if (ok) serve_send(fd, "DONE\n");
+    pthread_cond_destroy(&req.done);
+    pthread_mutex_destroy(&req.lock);
+}
+
+// One thread per client: read requests until it hangs up (or the daemon
+// stops and shuts down our side of the socket).
+static void *serve_connection(void *arg) {
+    serve_conn_t *conn = (serve_conn_t*)arg;
+    server_t *sv = conn->sv;
+    int fd = conn->fd;
+    FILE *in = fdopen(fd, "r");
+    char line[SERVE_LINE];
+    while (in && fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "SIM ", 4) == 0) {
+            serve_sim(sv, fd, line + 4);
+        } else if (strncmp(line, "LOAD ", 5) == 0) {
+            const trace_store_t *st = serve_trace_get(sv, fd, line + 5);
+            if (st) serve_send(fd, "DONE\n");
+        } else if (strcmp(line, "TRACES") == 0) {
+            pthread_mutex_lock(&sv->lock);
+            for (const serve_trace_t *t = sv->traces; t; t = t->next) {
+                if (t->st) {
+                    serve_send(fd, "TRACE %s %llu accesses, %zu KB\n", t->path, t->st->records,
+                               t->st->bytes / 1024);
+                }
+            }
+            pthread_mutex_unlock(&sv->lock);
+            serve_send(fd, "DONE\n");
+        } else if (strcmp(line, "QUIT") == 0) {
+            break;
+        } else if (strcmp(line, "SHUTDOWN") == 0) {
+            // answer first: once accept() wakes up, run_serve heads for exit
+            serve_send(fd, "DONE\n");
+            pthread_mutex_lock(&sv->lock);
+            sv->stopping = true;
+            pthread_mutex_unlock(&sv->lock);
+            shutdown(sv->listen_fd, SHUT_RDWR);     // wakes up accept()
+            break;
+        } else if (line[0]) {
+            serve_send(fd, "ERROR unknown request (SIM, LOAD, TRACES, QUIT or SHUTDOWN)\n");
+        }
+    }
+
+    // leave the list before closing, so run_serve never touches a closed fd
+    pthread_mutex_lock(&sv->lock);
+    serve_conn_t **p = &sv->conns;
+    while (*p != conn) p = &(*p)->next;
+    *p = conn->next;
+    if (!sv->conns) pthread_cond_broadcast(&sv->work);
+    pthread_mutex_unlock(&sv->lock);
+    if (in) fclose(in);
+    else close(fd);
+    free(conn);
+    return NULL;
+}
+
+// Run the daemon on a Unix socket at `path` until a client sends SHUTDOWN.
+static int run_serve(const char *path, const options_t *opt) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    server_t sv;
+    memset(&sv, 0, sizeof(sv));
+    sv.opt = opt;
+    sv.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sv.listen_fd < 0) {
+        fprintf(stderr, "Error: could not create a socket: %s\n", strerror(errno));
+        return 1;
+    }
+    bool bound = bind(sv.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        // left over from a daemon that was killed? (if one still answers, leave it alone)
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool alive = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (alive) errno = EADDRINUSE;
+        else bound = unlink(path) == 0 && bind(sv.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    }
+    if (!bound || listen(sv.listen_fd, 64) != 0) {
+        fprintf(stderr, "Error: could not listen on %s: %s\n", path, strerror(errno));
+        close(sv.listen_fd);
+        return 1;
+    }
+    pthread_mutex_init(&sv.lock, NULL);
+    pthread_cond_init(&sv.work, NULL);
+    pthread_cond_init(&sv.loaded, NULL);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    size_t nworkers = job_count(opt), started = 0;
+    pthread_t *workers = (pthread_t*)calloc(nworkers, sizeof(pthread_t));
+    while (workers && started < nworkers && pthread_create(&workers[started], NULL, serve_worker, &sv) == 0)
+        started++;
+    int rc = 0;
+    if (started == 0) {
+        fprintf(stderr, "Could not start the worker threads.\n");
+        rc = 1;
+    } else {
+        fprintf(stderr, "serving on %s with %zu workers\n", path, started);
+    }
+
+    while (rc == 0) {
+        int fd = accept(sv.listen_fd, NULL, NULL);
+        pthread_mutex_lock(&sv.lock);
+        bool stopping = sv.stopping;
+        pthread_mutex_unlock(&sv.lock);
+        if (stopping) {
+            if (fd >= 0) close(fd);
+            break;
+        }
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            rc = 1;
+            break;
+        }
+        serve_conn_t *conn = (serve_conn_t*)malloc(sizeof(serve_conn_t));
+        pthread_t tid;
+        bool running = false;
+        if (conn) {
+            conn->sv = &sv;
+            conn->fd = fd;
+            pthread_mutex_lock(&sv.lock);
+            conn->next = sv.conns;
+            sv.conns = conn;
+            running = pthread_create(&tid, NULL, serve_connection, conn) == 0;
+            if (!running) sv.conns = conn->next;
+            pthread_mutex_unlock(&sv.lock);
+        }
+        if (!running) {
+            serve_send(fd, "ERROR the daemon is out of resources\n");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    // Stop reading new requests on every open connection. Requests already
+    // running still get all their answers and DONE: the workers only stop
+    // once the queue is empty and every connection thread has finished.
+    pthread_mutex_lock(&sv.lock);
+    sv.stopping = true;
+    for (serve_conn_t *c = sv.conns; c; c = c->next) shutdown(c->fd, SHUT_RD);
+    pthread_cond_broadcast(&sv.work);
+    pthread_mutex_unlock(&sv.lock);
+    for (size_t i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+    free(workers);
+    close(sv.listen_fd);
+    unlink(path);
+    fprintf(stderr, "daemon on %s stopped\n", path);
+    return rc;
+}
+
+// Read the answer to one request, up to DONE or ERROR, and print it as it is
+// (SKIP and ERROR lines to stderr). Returns 0 on DONE, 1 otherwise.
+static int client_answer(FILE *in) {
+    char line[SERVE_LINE];
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, "SKIP ", 5) == 0 || strncmp(line, "ERROR ", 6) == 0) fputs(line, stderr);
+        else if (strcmp(line, "DONE\n") != 0) fputs(line, stdout);
+        fflush(stdout);
+        if (strcmp(line, "DONE\n") == 0) return 0;
+        if (strncmp(line, "ERROR ", 6) == 0) return 1;
+    }
+    fprintf(stderr, "Error: the daemon closed the connection.\n");
+    return 1;
+}
+
+// Read the answer to a SIM request for `trace` and file each RESULT line under
+// its configuration in out (the results come in the order they finish).
+// Returns 0 on DONE, 1 otherwise.
+static int client_collect(FILE *in, const char *trace, const config_t *cfgs, size_t ncfg, sim_result_t *out) {
+    size_t skip = strlen("RESULT ") + strlen(trace) + 1;
+    char line[SERVE_LINE + 256];
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, "RESULT ", 7) == 0 && strlen(line) > skip) {
+            config_t c;
+            char repl[8], wb[8];
+            double ratio;
+            sim_result_t r;
+            memset(&r, 0, sizeof(r));
+            if (sscanf(line + skip, "%zu,%zu,%7[^,],%7[^,],%llu,%llu,%lf,%llu,%llu", &c.cache_size, &c.assoc,
+                       repl, wb, &r.accesses, &r.misses, &ratio, &r.mem_writes, &r.mem_reads) != 9) {
+                fprintf(stderr, "Error: could not read the daemon's answer: %s", line);
+                return 1;
+            }
+            c.replacement = strcmp(repl, "LRU") == 0 ? 0 : 1;
+            c.writeback = strcmp(wb, "WB") == 0 ? 1 : 0;
+            r.valid = true;
+            for (size_t i = 0; i < ncfg; ++i) {
+                if (cfgs[i].cache_size == c.cache_size && cfgs[i].assoc == c.assoc &&
+                    cfgs[i].replacement == c.replacement && cfgs[i].writeback == c.writeback) out[i] = r;
+            }
+        } else if (strncmp(line, "SKIP ", 5) == 0 || strncmp(line, "ERROR ", 6) == 0) {
+            fputs(line, stderr);
+            if (line[0] == 'E') return 1;
+        } else if (strcmp(line, "DONE\n") == 0) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: the daemon closed the connection.\n");
+    return 1;
+}
+
+// The client side of --serve. With <SIZES> <ASSOCS> <REPLS> <WBS> <TRACE>...
+// (pos), ask for every trace and print the same CSV as a run over several
+// traces, aggregate rows included (but no --energy columns: the daemon
+// doesn't send the write counts they need). With no arguments, pass request
+// lines from stdin to the daemon and print its answers.
+static int run_client(const char *path, char **pos, size_t npos, const options_t *opt) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: could not connect to %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    FILE *in = fdopen(fd, "r");
+    if (!in) {
+        close(fd);
+        return 1;
+    }
+
+    int rc = 0;
+    char line[SERVE_LINE];
+    if (npos == 0) {
+        while (fgets(line, sizeof(line), stdin)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (!line[0]) continue;
+            if (!serve_send(fd, "%s\n", line)) {
+                rc = 1;
+                break;
+            }
+            if (strcmp(line, "QUIT") == 0) break;
+            rc |= client_answer(in);
+            if (strcmp(line, "SHUTDOWN") == 0) break;
+        }
+        fclose(in);
+        return rc;
+    }
+
+    // the configurations in the order main would run them, so the rows can
+    // be put back in that order
+    unsigned long long v[4][MAX_LIST];
+    size_t n[4];
+    for (int k = 0; k < 4; ++k) n[k] = parse_list(pos[k], v[k], MAX_LIST);
+    size_t ncfg = n[0] * n[1] * n[2] * n[3];
+    config_t *cfgs = (config_t*)calloc(ncfg ? ncfg : 1, sizeof(config_t));
+    glob_t g;
+    char **traces = NULL;
+    size_t ntraces = expand_traces(pos + 4, npos - 4, &g, &traces);
+    sim_result_t *res = (sim_result_t*)calloc(ntraces && ncfg ? ntraces * ncfg : 1, sizeof(sim_result_t));
+    bool *ok = (bool*)calloc(ntraces ? ntraces : 1, sizeof(bool));
+    if (!cfgs || !res || !ok) {
+        fprintf(stderr, "Out of memory.\n");
+        rc = 1;
+    } else if (ntraces == 0) {
+        rc = 1;
+    }
+    size_t k = 0;
+    for (size_t a = 0; a < n[0] && cfgs; ++a)
+        for (size_t b = 0; b < n[1]; ++b)
+            for (size_t c = 0; c < n[2]; ++c)
+                for (size_t d = 0; d < n[3]; ++d) {
+                    config_t cfg = { (size_t)v[0][a], (size_t)v[1][b], (int)v[2][c], (int)v[3][d] };
+                    cfgs[k++] = cfg;
+                }
+
+    // the daemon has its own working directory, so send full paths
+    for (size_t t = 0; t < ntraces && rc == 0; ++t) {
+        char *full = realpath(traces[t], NULL);
+        if (!full) {
+            fprintf(stderr, "Error: could not open the trace file: %s\n", traces[t]);
+            continue;
+        }
+        bool sent = serve_send(fd, "SIM %s %s %s %s %s\n", pos[0], pos[1], pos[2], pos[3], full);
+        ok[t] = sent && client_collect(in, full, cfgs, ncfg, res + t * ncfg) == 0;
+        free(full);
+        if (!sent) break;
+    }
+
+    if (rc == 0) {
+        options_t plain = *opt;
+        plain.energy = false;
+        printf("trace,size_bytes,assoc,replacement,wb,accesses,misses,miss_ratio,mem_writes,mem_reads\n");
+        for (size_t t = 0; t < ntraces; ++t) {
+            if (ok[t]) print_trace_rows(traces[t], cfgs, ncfg, res + t * ncfg, &plain);
+            else rc = 1;
+        }
+        for (size_t i = 0; i < ncfg; ++i) print_aggregates(&cfgs[i], res + i, ncfg, ok, ntraces, &plain);
+    }
+    if (ntraces > 0) globfree(&g);
+    free(cfgs);
+    free(res);
+    free(ok);
+    fclose(in);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    // check that the arguments are correct
+    options_t opt;
+    char **pos = (char**)calloc((size_t)argc, sizeof(char*));
+    int npos = 0;
+    bool args_ok = pos && parse_options(argc, argv, &opt, pos, &npos);
+    if (opt.serve_path) args_ok = args_ok && npos == 0;
+    else if (opt.client_path) args_ok = args_ok && (npos == 0 || npos >= 5);
+    else if (opt.encode_path || opt.mrc) args_ok = args_ok && npos == 1;
+    else args_ok = args_ok && npos >= (opt.verify ? 4 : 5);
+    if (!args_ok) {
+        print_usage(argv[0]);
+        free(pos);
+        return 1;
+    }
+    // with --io=mmap or uring, text traces are parsed on as many threads as
+    // --jobs allows (stdio reads them line by line)
+    text_threads = job_count(&opt);
+    io_mode = opt.io;
+    io_direct = opt.direct;
+    io_stats = opt.io_stats;
+    if (opt.serve_path || opt.client_path) {
+        int rc = opt.serve_path ? run_serve(opt.serve_path, &opt) : run_client(opt.client_path, pos, (size_t)npos, &opt);
+        free(pos);
+        return rc;
+    }
+    if (opt.encode_path) {
+        int rc = run_encode(pos[0], opt.encode_path);
+        free(pos);
+        return rc;
+    }
+    if (opt.mrc) {
+        int rc = opt.mrc_approx ? run_mrc_approx(pos[0], &opt) : run_mrc(pos[0], &opt);
+        free(pos);
+        return rc;
+    }
+
+    // each of the four numbers may be a comma separated list; more than one
+    // value anywhere turns the run into a sweep over every combination
+    unsigned long long sizes[MAX_LIST], assocs[MAX_LIST], repls[MAX_LIST], wbs[MAX_LIST];
+    size_t nsize  = parse_list(pos[0], sizes, MAX_LIST);
+    size_t nassoc = parse_list(pos[1], assocs, MAX_LIST);
+    size_t nrepl  = parse_list(pos[2], repls, MAX_LIST);  // 0 = LRU, 1 = FIFO
+    size_t nwb    = parse_list(pos[3], wbs, MAX_LIST);    // 0 = write-through, 1 = write-back
+    // trace arguments may be wildcards
+    glob_t g;
+    char **traces = NULL;
+    size_t ntraces = expand_traces(pos + 4, (size_t)npos - 4, &g, &traces);
+    free(pos);
+    if (ntraces == 0 && !opt.verify) return 1;
+    if (ntraces > 1) text_threads = 1;  // each trace already has its own thread
+
+    // make sure we got valid numbers
+    bool valid = nsize > 0 && nassoc > 0 && nrepl > 0 && nwb > 0;
+    for (size_t i = 0; i < nsize; ++i) valid = valid && sizes[i] != 0;
+    for (size_t i = 0; i < nassoc; ++i) valid = valid && assocs[i] != 0;
+    if (!valid) {
+        fprintf(stderr, "Invalid cache size or associativity.\n");
+        globfree(&g);
+        return 1;
+    }
+
+    size_t ncfg = nsize * nassoc * nrepl * nwb;
+    config_t *cfgs = (config_t*)calloc(ncfg, sizeof(config_t));
+    if (!cfgs) {
+        fprintf(stderr, "Out of memory.\n");
+        globfree(&g);
+        return 1;
+    }
+    size_t k = 0;
+    for (size_t a = 0; a < nsize; ++a)
+        for (size_t b = 0; b < nassoc; ++b)
+            for (size_t c = 0; c < nrepl; ++c)
+                for (size_t d = 0; d < nwb; ++d) {
+                    cfgs[k].cache_size = (size_t)sizes[a];
+                    cfgs[k].assoc = (size_t)assocs[b];
+                    cfgs[k].replacement = (int)repls[c];
+                    cfgs[k].writeback = (int)wbs[d];
+                    k++;
+                }
+
+    int rc;
+    if ((opt.nnext > 0 || opt.split) &&
+        (ncfg != 1 || ntraces != 1 || opt.verify || opt.solve != SOLVE_NONE || opt.dse ||
+         opt.mix != MIX_NONE || opt.partition != PART_NONE || opt.filter_path)) {
+        fprintf(stderr, "--next and --icache need a single configuration and trace and no --verify,\n"
+                        "--solve, --dse, --mix, --partition or --filter.\n");
+        rc = 1;
+    } else if (opt.split && opt.energy) {
+        fprintf(stderr, "--energy only works with a unified first level, not --icache.\n");
+        rc = 1;
+    } else if (opt.inclusive && opt.nnext == 0) {
+        fprintf(stderr, "--inclusive only works together with --next.\n");
+        rc = 1;
+    } else if (opt.fork && ntraces > 1) {
+        fprintf(stderr, "--fork only works with a single trace.\n");
+        rc = 1;
+    } else if (opt.verify) {
+        rc = run_verify(cfgs, ncfg, traces, ntraces, &opt);
+    } else if (opt.solve != SOLVE_NONE) {
+        if (ntraces == 1 && !opt.dse && opt.mix == MIX_NONE && opt.hot_k == 0 && !opt.filter_path) {
+            rc = run_solve(sizes, nsize, assocs, nassoc, repls, nrepl, wbs, nwb, traces[0], &opt);
+        } else {
+            fprintf(stderr, "--solve needs a single trace and no --dse, --mix, --hot or --filter.\n");
+            rc = 1;
+        }
+    } else if (opt.dse) {
+        if (ntraces == 1 && opt.mix == MIX_NONE && opt.hot_k == 0 && !opt.filter_path) {
+            rc = run_dse(sizes, nsize, assocs, nassoc, repls, nrepl, wbs, nwb, traces[0], &opt);
+        } else {
+            fprintf(stderr, "--dse needs a single trace and no --mix, --hot or --filter.\n");
+            rc = 1;
+        }
+    } else if (opt.mix != MIX_NONE) {
+        if (ncfg == 1 && opt.hot_k == 0 && !opt.filter_path) {
+            rc = run_mix(&cfgs[0], traces, ntraces, &opt);
+        } else {
+            fprintf(stderr, "--mix needs a single configuration and no --hot or --filter.\n");
+            rc = 1;
+        }
+    } else if (opt.partition != PART_NONE) {
+        fprintf(stderr, "--partition only works together with --mix.\n");
+        rc = 1;
+    } else if (ncfg == 1 && ntraces == 1) {
+        rc = run_single(&cfgs[0], traces[0], &opt);
+    } else if (opt.hot_k > 0 || opt.filter_path) {
+        fprintf(stderr, "--hot and --filter only work with a single configuration and trace.\n");
+        rc = 1;
+    } else if (ntraces == 1) {
+        rc = run_sweep(cfgs, ncfg, traces[0], &opt);
+    } else {
+        rc = run_multi(cfgs, ncfg, traces, ntraces, &opt);
+    }
+    free(cfgs);
+    globfree(&g);
+    return rc;
 }
@@ -8,7 +8,11 @@ OUT_DIR="$ROOT/out"
 
 mkdir -p "$OUT_DIR"
 
+# trace names (inside traces/) can be given on the command line
 TRACES=("MINIFE-1.t" "XSBENCH-1.t")
+if [ "$#" -gt 0 ]; then
+  TRACES=("$@")
+fi
 
 parse_result() {
   awk '
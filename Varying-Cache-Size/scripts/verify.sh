@@ -0,0 +1,27 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+BIN="$ROOT/SIM"
+TRACES_DIR="$ROOT/traces"
+OUT_DIR="$ROOT/out"
+
+mkdir -p "$TRACES_DIR" "$OUT_DIR"
+unzip -n -q "$ROOT/Traces.zip" -x '__MACOSX/*' -d "$TRACES_DIR"
+
+# trace names (inside traces/) can be given on the command line
+TRACES=("smallTest.t" "mediumTest.t" "tiny.t")
+if [ "$#" -gt 0 ]; then
+  TRACES=("$@")
+fi
+paths=()
+for t in "${TRACES[@]}"; do
+  paths+=("$TRACES_DIR/$t")
+done
+
+# direct mapped up to fully associative (4KB, 64-way), LRU and FIFO, WT and WB;
+# shrunk reproducers for any disagreement are written to out/. The traces are
+# read with the parallel parser (--io=mmap); the "parser" line checks it
+# against reading them line by line.
+cd "$OUT_DIR"
+"$BIN" --verify --io=mmap 4096,32768 1,2,8,64 0,1 0,1 "${paths[@]}"